@@ -2,259 +2,3306 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <stddef.h>
 #include <stdbool.h>
-#include <getopt.h>
 #include <png.h>
 #include <math.h> 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "cw_internal.h"
 
-#define ERROR_SUCCESS 0
-#define ERROR_ARG 40
-#define ERROR_FILE 41
-#define ERROR_OPERATION_FLAG 42 
-#define ERROR_MEMORY 43
-#define ERROR_PNG_FORMAT 44
+static inline unsigned char* image_pixel(const Image *image, int x, int y) {
+    if (!image->tiled) return image_row(image, y) + (size_t)x * image->bpp;
+    int tiles_x = (image->width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+    size_t tile = (size_t)(y >> IMAGE_TILE_SHIFT) * tiles_x + (x >> IMAGE_TILE_SHIFT);
+    return image->data + ((tile << IMAGE_TILE_SHIFT) + (y & IMAGE_TILE_MASK)) * (size_t)image->stride +
+           (size_t)(x & IMAGE_TILE_MASK) * image->bpp;
+}
+
+/* Pixels from x towards x1 (inclusive) stored contiguously on one row. */
+static inline int image_run_length(const Image *image, int x, int x1) {
+    int count = x1 - x + 1;
+    if (image->tiled) {
+        int left = IMAGE_TILE_SIZE - (x & IMAGE_TILE_MASK);
+        if (left < count) count = left;
+    }
+    return count;
+}
+
+/* Storage as a plain list of rows: the image rows, or every tile row of a
+ * tiled image including padding. Used by whole-buffer pixel rewrites. */
+static inline int image_storage_rows(const Image *image, int *row_pixels) {
+    if (!image->tiled) {
+        *row_pixels = image->width;
+        return image->height;
+    }
+    int tiles_x = (image->width + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+    int tiles_y = (image->height + IMAGE_TILE_MASK) >> IMAGE_TILE_SHIFT;
+    *row_pixels = IMAGE_TILE_SIZE;
+    return tiles_x * tiles_y * IMAGE_TILE_SIZE;
+}
+
+/* Per-format kernels: the pixel size is a compile-time constant in each
+ * instance, so the memcpy/memcmp calls become plain loads and stores.
+ * color_bytes excludes the trailing alpha sample from colour matching. */
+#define DEFINE_PIXEL_KERNELS(name, BPP, COLOR_BYTES)                                              \
+static void fill_span_##name(unsigned char *dst, const PixelValue *value, int count) {           \
+    for (int i = 0; i < count; i++, dst += (BPP)) memcpy(dst, value->bytes, (BPP));              \
+}                                                                                                 \
+static void match_histogram_##name(const unsigned char *row, int width, const ColorMatch *match, int *hist) { \
+    for (int x = 0; x < width; x++, row += (BPP)) {                                               \
+        hist[x] = memcmp(row, match->value.bytes, (COLOR_BYTES)) == 0 ? hist[x] + 1 : 0;          \
+    }                                                                                             \
+}                                                                                                 \
+static void match_flags_##name(const unsigned char *row, int width, const ColorMatch *match, unsigned char *flags) { \
+    for (int x = 0; x < width; x++, row += (BPP)) {                                               \
+        flags[x] = memcmp(row, match->value.bytes, (COLOR_BYTES)) == 0;                           \
+    }                                                                                             \
+}
+
+DEFINE_PIXEL_KERNELS(rgb8, 3, 3)
+DEFINE_PIXEL_KERNELS(rgba8, 4, 3)
+DEFINE_PIXEL_KERNELS(rgb16, 6, 6)
+DEFINE_PIXEL_KERNELS(rgba16, 8, 6)
+
+/* Blend kernels: the value's colour over `count` pixels at opacity
+ * alpha/255 (1-254). The colour is premultiplied once per span, so every
+ * sample costs one multiply-add and a division by 255, rounded exactly as
+ * ((t + (t >> 8)) >> 8) with t = x + 128. Pixels with alpha use "over"
+ * and keep straight (non-premultiplied) alpha, as PNG stores it. */
+/* One 8-bit pixel with alpha in the fourth byte. */
+static inline void blend_over8(unsigned char *p, const unsigned char *v, unsigned alpha) {
+    unsigned keep = (255 - alpha) * p[3];
+    unsigned total = alpha * 255 + keep;
+    if (total == 0) return;
+    for (int c = 0; c < 3; c++) p[c] = (unsigned char)((v[c] * alpha * 255 + p[c] * keep + total / 2) / total);
+    p[3] = (unsigned char)((total + 127) / 255);
+}
+
+#if defined(__SSE2__)
+/* Byte-wise blend of 16 bytes: pre holds the premultiplied colour plus
+ * rounding for the low and high 8 bytes in 16-bit lanes. */
+static inline __m128i blend_bytes_sse2(__m128i d, __m128i pre_lo, __m128i pre_hi, __m128i inv) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), inv), pre_lo);
+    __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), inv), pre_hi);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+    return _mm_packus_epi16(lo, hi);
+}
+#endif
+
+/* RGB8 and BGR8: the channel pattern repeats every 48 bytes, three
+ * vectors per iteration. */
+static void blend_span_rgb8(unsigned char *dst, const PixelValue *value, int count, unsigned alpha) {
+    unsigned inv = 255 - alpha;
+    uint16_t pre[48];
+    for (int i = 0; i < 48; i++) pre[i] = (uint16_t)(value->bytes[i % 3] * alpha + 128);
+    size_t bytes = (size_t)count * 3, i = 0;
+#if defined(__SSE2__)
+    __m128i pre_v[6], inv_v = _mm_set1_epi16((short)inv);
+    for (int k = 0; k < 6; k++) pre_v[k] = _mm_loadu_si128((const __m128i*)(pre + 8 * k));
+    for (; i + 48 <= bytes; i += 48) {
+        for (int k = 0; k < 3; k++) {
+            __m128i d = _mm_loadu_si128((const __m128i*)(dst + i + 16 * k));
+            _mm_storeu_si128((__m128i*)(dst + i + 16 * k), blend_bytes_sse2(d, pre_v[2 * k], pre_v[2 * k + 1], inv_v));
+        }
+    }
+#endif
+    for (; i < bytes; i++) {
+        unsigned t = dst[i] * inv + pre[i % 3];
+        dst[i] = (unsigned char)((t + (t >> 8)) >> 8);
+    }
+}
+
+/* RGBA8: four pixels per vector. Where all four are opaque "over" is the
+ * plain byte-wise blend (the alpha byte blends 255 with 255); other
+ * groups take the exact straight-alpha path. */
+static void blend_span_rgba8(unsigned char *dst, const PixelValue *value, int count, unsigned alpha) {
+    int i = 0;
+#if defined(__SSE2__)
+    uint16_t pre[8];
+    for (int k = 0; k < 8; k++) pre[k] = (uint16_t)((k % 4 == 3 ? 255 : value->bytes[k % 4]) * alpha + 128);
+    const __m128i pre_v = _mm_loadu_si128((const __m128i*)pre), inv_v = _mm_set1_epi16((short)(255 - alpha));
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000u);
+    for (; i + 4 <= count; i += 4) {
+        unsigned char *p = dst + 4 * i;
+        __m128i d = _mm_loadu_si128((const __m128i*)p);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(d, alpha_mask), alpha_mask)) == 0xffff) {
+            _mm_storeu_si128((__m128i*)p, blend_bytes_sse2(d, pre_v, pre_v, inv_v));
+        } else {
+            for (int k = 0; k < 4; k++) blend_over8(p + 4 * k, value->bytes, alpha);
+        }
+    }
+#endif
+    for (; i < count; i++) blend_over8(dst + 4 * i, value->bytes, alpha);
+}
+
+static void blend_span_rgb16(unsigned char *dst, const PixelValue *value, int count, unsigned alpha) {
+    uint64_t a = alpha * 257u, inv = 65535 - a;
+    uint64_t pre[3];
+    for (int c = 0; c < 3; c++) pre[c] = ((uint64_t)value->bytes[2 * c] << 8 | value->bytes[2 * c + 1]) * a + 32767;
+    for (int i = 0; i < count; i++, dst += 6) {
+        for (int c = 0; c < 3; c++) {
+            uint64_t d = (uint64_t)dst[2 * c] << 8 | dst[2 * c + 1];
+            uint64_t out = (d * inv + pre[c]) / 65535;
+            dst[2 * c] = (unsigned char)(out >> 8);
+            dst[2 * c + 1] = (unsigned char)out;
+        }
+    }
+}
+
+static void blend_span_rgba16(unsigned char *dst, const PixelValue *value, int count, unsigned alpha) {
+    uint64_t a = alpha * 257u;
+    for (int i = 0; i < count; i++, dst += 8) {
+        uint64_t keep = (65535 - a) * ((uint64_t)dst[6] << 8 | dst[7]);
+        uint64_t total = a * 65535 + keep;
+        if (total == 0) continue;
+        for (int c = 0; c < 3; c++) {
+            uint64_t d = (uint64_t)dst[2 * c] << 8 | dst[2 * c + 1];
+            uint64_t v = (uint64_t)value->bytes[2 * c] << 8 | value->bytes[2 * c + 1];
+            uint64_t out = (v * a * 65535 + d * keep + total / 2) / total;
+            dst[2 * c] = (unsigned char)(out >> 8);
+            dst[2 * c + 1] = (unsigned char)out;
+        }
+        uint64_t out_alpha = (total + 32767) / 65535;
+        dst[6] = (unsigned char)(out_alpha >> 8);
+        dst[7] = (unsigned char)out_alpha;
+    }
+}
+
+static void fill_span_pal8(unsigned char *dst, const PixelValue *value, int count) {
+    memset(dst, value->bytes[0], count);
+}
+
+static void match_histogram_pal8(const unsigned char *row, int width, const ColorMatch *match, int *hist) {
+    for (int x = 0; x < width; x++) {
+        hist[x] = match->index_match[row[x]] ? hist[x] + 1 : 0;
+    }
+}
+
+static void match_flags_pal8(const unsigned char *row, int width, const ColorMatch *match, unsigned char *flags) {
+    for (int x = 0; x < width; x++) flags[x] = match->index_match[row[x]];
+}
+
+static const PixelFormatInfo pixel_formats[PIXEL_FORMAT_COUNT] = {
+    [PIXEL_RGB8]   = {"RGB8",   3, 3, 8,  false, PNG_COLOR_TYPE_RGB,       false, fill_span_rgb8,   blend_span_rgb8,   match_histogram_rgb8, match_flags_rgb8},
+    [PIXEL_RGBA8]  = {"RGBA8",  4, 3, 8,  true,  PNG_COLOR_TYPE_RGB_ALPHA, false, fill_span_rgba8,  blend_span_rgba8,  match_histogram_rgba8, match_flags_rgba8},
+    [PIXEL_RGB16]  = {"RGB16",  6, 6, 16, false, PNG_COLOR_TYPE_RGB,       false, fill_span_rgb16,  blend_span_rgb16,  match_histogram_rgb16, match_flags_rgb16},
+    [PIXEL_RGBA16] = {"RGBA16", 8, 6, 16, true,  PNG_COLOR_TYPE_RGB_ALPHA, false, fill_span_rgba16, blend_span_rgba16, match_histogram_rgba16, match_flags_rgba16},
+    [PIXEL_PAL8]   = {"PAL8",   1, 1, 8,  false, PNG_COLOR_TYPE_PALETTE,   false, fill_span_pal8,   NULL,              match_histogram_pal8, match_flags_pal8},
+    [PIXEL_BGR8]   = {"BGR8",   3, 3, 8,  false, PNG_COLOR_TYPE_RGB,       true,  fill_span_rgb8,   blend_span_rgb8,   match_histogram_rgb8, match_flags_rgb8},
+};
 
-struct Png {
+struct ThreadPool {
+    pthread_t *threads;
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    ThreadPoolTask task;
+    void *task_ctx;
+    int task_count;
+    atomic_int next_index;
+    int busy_workers;
+    unsigned long generation;
+    bool shutdown;
+};
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define PIXEL_POOL_SLOTS 4
+
+/* Inclusive pixel rectangle that clipped drawing is confined to. */
+typedef struct {
+    int x0, y0, x1, y1;
+} ClipRect;
+
+/* Summed-area tables for --region_stats. Cell (x, y) of the (width + 1) x
+ * (height + 1) grid holds, per plane, the sum over the pixels above and to
+ * the left of (x, y): the R, G, B (and A) samples at their full depth,
+ * then the pixel count of each tracked colour. The planes of a cell are
+ * stored together, so a query reads four runs of `planes` values. */
+typedef struct CwRegionTable {
     int width, height;
-    png_byte color_type;
-    png_byte bit_depth;
-    png_structp png_ptr_read; 
-    png_infop info_ptr_read;  
-    int number_of_passes;     
-    png_bytep *row_pointers;
-    int status; 
-    int original_height_for_row_pointers; 
+    int channels, color_count, planes;
+    unsigned sample_max;
+    uint64_t *sums;
+    size_t mapping_size;
+} RegionTable;
+
+enum JobStage {
+    STAGE_READ,
+    STAGE_CONVERT,
+    STAGE_OPERATION,
+    STAGE_WRITE,
+    STAGE_COUNT
+};
+
+/* Per-stage measurements of one file for --stats. Peak RSS is the process
+ * high-water mark once the stage is done, so it never goes down. */
+struct JobStats {
+    struct {
+        bool done;
+        double wall, cpu;
+        long peak_rss_kib;
+        unsigned long long bytes;
+    } stage[STAGE_COUNT];
+    double wall_start, cpu_start;
 };
 
+/* Fixed-point filter weights for one axis: output sample o reads count[o]
+ * inputs from start[o], weighted by weights[o * taps ...]. */
+typedef struct {
+    int in_size, out_size;
+    int taps;
+    int *start;
+    int *count;
+    int16_t *weights;
+} ResampleCoeffs;
+
+static void read_png_memory(const unsigned char *data, size_t size, struct Png *image);
+static int write_png_memory(const Image *pixels, unsigned char **data, size_t *size);
+static void print_job_stats(FILE *out, const char *input_filename, const char *output_filename, const JobStats *stats, bool json_output);
+static int load_image_memory(const unsigned char *data, size_t size, const JobOptions *job, Image **result);
+static int save_image_file(const char *filename, const Image *image, unsigned long long *written);
+static int encode_image(const char *filename, const Image *image, unsigned char **data, size_t *size);
+static bool has_bmp_extension(const char *filename);
+static int read_bmp_file(const char *filename, Image **result);
+static int read_bmp_memory(const unsigned char *data, size_t size, Image **result);
+static int write_bmp_file(const char *filename, const Image *image);
+static int write_bmp_memory(const Image *image, unsigned char **data, size_t *size);
+
+static int pixel_format_from_png(png_byte color_type, png_byte bit_depth, enum PixelFormat *format);
+static PixelValue pixel_value_from_rgb(enum PixelFormat format, Rgb color);
+static int image_color_value(Image *image, Rgb color, PixelValue *value);
+static int image_paint_value(Image *image, Rgba color, PixelValue *value);
+static void color_match_init(ColorMatch *match, const Image *image, Rgb color);
+static void color_match_at(ColorMatch *match, const Image *image, int x, int y);
+static void arena_release(void);
+static unsigned char* pixels_alloc(size_t bytes, bool zeroed, size_t *mapping_size);
+static void pixels_release(unsigned char *pixels, size_t mapping_size);
+static void pixel_pool_drain(void);
+static int image_expand_palette(Image *image);
+static void image_copy_palette(Image *dst, const Image *src);
+static Image* image_create_tiled(int width, int height, enum PixelFormat format);
+static const unsigned char* image_read_row(const Image *image, int y, unsigned char *scratch);
+static void image_free(Image *image);
+static void fill_span_safe(Image *image, int y, int x0, int x1, const PixelValue *value);
+
+static int draw_line_thick(Image *image, Point p1, Point p2, Rgb color, int thickness);
+static int fill_triangle_half_space(Image *image, Point v0, Point v1, Point v2, Rgba color, int threads);
+static RegionTable* region_table_build(const Image *image, const Rgb *colors, int color_count, int threads);
+static void region_table_query(const RegionTable *table, Point left_up, Point right_down, RegionStats *stats, unsigned long long *counts);
+static void region_table_free(RegionTable *table);
+static int compute_resample_coeffs(ResampleCoeffs *coeffs, int in_size, int out_size, enum ResampleFilter filter);
+static void free_resample_coeffs(ResampleCoeffs *coeffs);
+static Image* image_area_reduce_axis(const Image *image, int out_size, bool horizontal);
+
+
+const PixelFormatInfo* cw_pixel_format_info(enum PixelFormat format) {
+    return &pixel_formats[format];
+}
+
+static int pixel_format_from_png(png_byte color_type, png_byte bit_depth, enum PixelFormat *format) {
+    for (int f = 0; f < PIXEL_FORMAT_COUNT; f++) {
+        if (pixel_formats[f].png_color_type == color_type && pixel_formats[f].bit_depth == bit_depth &&
+            !pixel_formats[f].bgr_order) {
+            *format = (enum PixelFormat)f;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Packs an 8-bit colour into the byte layout of the given format: 16-bit
+ * samples are stored big-endian as libpng delivers them, alpha is opaque. */
+static PixelValue pixel_value_from_rgb(enum PixelFormat format, Rgb color) {
+    PixelValue value;
+    memset(&value, 0, sizeof(value));
+    value.alpha = 255;
+    const PixelFormatInfo *info = cw_pixel_format_info(format);
+    unsigned char channels[4] = {color.r, color.g, color.b, 255};
+    if (info->bgr_order) {
+        channels[0] = color.b;
+        channels[2] = color.r;
+    }
+    int channel_count = info->has_alpha ? 4 : 3;
+    for (int c = 0; c < channel_count; c++) {
+        if (info->bit_depth == 16) {
+            value.bytes[2 * c] = channels[c];
+            value.bytes[2 * c + 1] = channels[c];
+        } else {
+            value.bytes[c] = channels[c];
+        }
+    }
+    return value;
+}
+
+/* Returns the palette index for a colour, adding it to the palette when
+ * there is room; -1 when the palette is full. */
+static int palette_find_or_add(Image *image, Rgb color, unsigned char alpha) {
+    for (int i = 0; i < image->palette_size; i++) {
+        if (image->palette_alpha[i] == alpha && image->palette[i].r == color.r &&
+            image->palette[i].g == color.g && image->palette[i].b == color.b) {
+            return i;
+        }
+    }
+    if (image->palette_size >= 256) return -1;
+    image->palette[image->palette_size] = color;
+    image->palette_alpha[image->palette_size] = alpha;
+    return image->palette_size++;
+}
+
+/* Per-job bump allocator for temporaries (row pointer arrays, histograms,
+ * box sums). Nothing is freed individually: cw_arena_reset() rewinds it after
+ * each job and folds all blocks into one, so a batch of similar files
+ * settles on a single allocation. One arena per thread. */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size, used;
+    max_align_t data[];
+} ArenaBlock;
+
+static _Thread_local ArenaBlock *job_arena = NULL;
+
+void* cw_arena_alloc(size_t bytes) {
+    bytes = (bytes + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    ArenaBlock *block = job_arena;
+    if (!block || block->size - block->used < bytes) {
+        size_t size = bytes > ARENA_BLOCK_SIZE ? bytes : ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + size);
+        if (!block) return NULL;
+        block->size = size;
+        block->used = 0;
+        block->next = job_arena;
+        job_arena = block;
+    }
+    void *result = (unsigned char*)block->data + block->used;
+    block->used += bytes;
+    return result;
+}
+
+void cw_arena_reset(void) {
+    if (!job_arena) return;
+    if (!job_arena->next) {
+        job_arena->used = 0;
+        return;
+    }
+    size_t total = 0;
+    while (job_arena) {
+        ArenaBlock *next = job_arena->next;
+        total += job_arena->size;
+        free(job_arena);
+        job_arena = next;
+    }
+    job_arena = (ArenaBlock*)malloc(sizeof(ArenaBlock) + total);
+    if (job_arena) {
+        job_arena->size = total;
+        job_arena->used = 0;
+        job_arena->next = NULL;
+    }
+}
+
+static void arena_release(void) {
+    while (job_arena) {
+        ArenaBlock *next = job_arena->next;
+        free(job_arena);
+        job_arena = next;
+    }
+}
+
+/* Heap pixel buffers keep their capacity in a header in front of the
+ * pixels. Released buffers wait in a small per-thread pool and are handed
+ * to later images that fit (without wasting more than half), so a batch
+ * reuses the same few image-sized allocations. */
+typedef struct {
+    size_t capacity;
+    max_align_t align[];
+} PixelBlock;
+
+static _Thread_local PixelBlock *pixel_pool[PIXEL_POOL_SLOTS];
+
+static unsigned char* pixel_pool_take(size_t bytes) {
+    int best = -1;
+    for (int i = 0; i < PIXEL_POOL_SLOTS; i++) {
+        PixelBlock *block = pixel_pool[i];
+        if (block && block->capacity >= bytes && block->capacity / 2 <= bytes &&
+            (best < 0 || block->capacity < pixel_pool[best]->capacity)) {
+            best = i;
+        }
+    }
+    if (best < 0) return NULL;
+    PixelBlock *block = pixel_pool[best];
+    pixel_pool[best] = NULL;
+    return (unsigned char*)block->align;
+}
+
+static void pixel_pool_put(PixelBlock *block) {
+    int slot = 0;
+    for (int i = 0; i < PIXEL_POOL_SLOTS; i++) {
+        if (!pixel_pool[i]) {
+            slot = i;
+            break;
+        }
+        if (pixel_pool[i]->capacity < pixel_pool[slot]->capacity) slot = i;
+    }
+    if (pixel_pool[slot] && pixel_pool[slot]->capacity >= block->capacity) {
+        free(block);
+        return;
+    }
+    free(pixel_pool[slot]);
+    pixel_pool[slot] = block;
+}
+
+static void pixel_pool_drain(void) {
+    for (int i = 0; i < PIXEL_POOL_SLOTS; i++) {
+        free(pixel_pool[i]);
+        pixel_pool[i] = NULL;
+    }
+}
+
+/* Pixel buffers of at least scratch_threshold bytes live in an unlinked
+ * sparse file under scratch_dir (default $TMPDIR, then /tmp) mapped shared,
+ * so the kernel can write them back to disk instead of failing the
+ * allocation; a failed scratch file falls back to the heap. */
+static size_t scratch_threshold = (size_t)SCRATCH_THRESHOLD_MIB << 20;
+static const char *scratch_dir = NULL;
+
+static unsigned char* pixels_alloc(size_t bytes, bool zeroed, size_t *mapping_size) {
+    *mapping_size = 0;
+    if (bytes >= scratch_threshold) {
+        const char *dir = scratch_dir ? scratch_dir : getenv("TMPDIR");
+        if (!dir || !*dir) dir = "/tmp";
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/cw-scratch-XXXXXX", dir);
+        void *base = MAP_FAILED;
+        int fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+            if (ftruncate(fd, (off_t)bytes) == 0) {
+                base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+            }
+            int saved_errno = errno;
+            close(fd);
+            errno = saved_errno;
+        }
+        if (base != MAP_FAILED) {
+            /* Nearly every pass walks the rows in order. */
+            madvise(base, bytes, MADV_SEQUENTIAL);
+            *mapping_size = bytes;
+            return (unsigned char*)base;
+        }
+        fprintf(stderr, "Warning: Cannot use a scratch file in %s (%s); using memory.\n", dir, strerror(errno));
+    }
+    unsigned char *pixels = pixel_pool_take(bytes);
+    if (pixels) {
+        if (zeroed) memset(pixels, 0, bytes);
+        return pixels;
+    }
+    PixelBlock *block = (PixelBlock*)(zeroed ? calloc(1, sizeof(PixelBlock) + bytes) : malloc(sizeof(PixelBlock) + bytes));
+    if (!block) return NULL;
+    block->capacity = bytes;
+    return (unsigned char*)block->align;
+}
+
+static void pixels_release(unsigned char *pixels, size_t mapping_size) {
+    if (!pixels) return;
+    if (mapping_size) {
+        munmap(pixels, mapping_size);
+    } else {
+        pixel_pool_put((PixelBlock*)(pixels - offsetof(PixelBlock, align)));
+    }
+}
+
+/* Gives the image a new pixel store of `bytes`, heap or scratch file. */
+static int image_alloc_pixels(Image *image, size_t bytes, bool zeroed) {
+    size_t mapping_size;
+    unsigned char *pixels = pixels_alloc(bytes, zeroed, &mapping_size);
+    if (!pixels) return 0;
+    image->buffer = mapping_size ? NULL : pixels;
+    image->mapping = mapping_size ? pixels : NULL;
+    image->mapping_size = mapping_size;
+    image->data = pixels;
+    return 1;
+}
+
+static void image_release_pixels(Image *image) {
+    pixels_release(image->buffer, 0);
+    if (image->mapping) munmap(image->mapping, image->mapping_size);
+    image->buffer = NULL;
+    image->mapping = NULL;
+    image->mapping_size = 0;
+}
+
+/* Converts a palette image to RGB8 (or RGBA8 when the palette has
+ * transparent entries) in place. */
+static int image_expand_palette(Image *image) {
+    if (image->format != PIXEL_PAL8) return 1;
+    bool has_alpha = false;
+    for (int i = 0; i < image->palette_size; i++) {
+        if (image->palette_alpha[i] != 255) has_alpha = true;
+    }
+    enum PixelFormat format = has_alpha ? PIXEL_RGBA8 : PIXEL_RGB8;
+    int bpp = cw_pixel_format_info(format)->bytes_per_pixel;
+    int row_pixels;
+    int rows = image_storage_rows(image, &row_pixels);
+    size_t mapping_size;
+    unsigned char *buffer = pixels_alloc((size_t)row_pixels * bpp * rows, false, &mapping_size);
+    if (!buffer) {
+        fprintf(stderr, "Memory for palette expansion failed\n");
+        return 0;
+    }
+    for (int y = 0; y < rows; y++) {
+        const unsigned char *src = image_row(image, y);
+        unsigned char *dst = buffer + (size_t)y * row_pixels * bpp;
+        for (int x = 0; x < row_pixels; x++, dst += bpp) {
+            const Rgb *entry = &image->palette[src[x]];
+            dst[0] = entry->r;
+            dst[1] = entry->g;
+            dst[2] = entry->b;
+            if (has_alpha) dst[3] = image->palette_alpha[src[x]];
+        }
+    }
+    image_release_pixels(image);
+    image->buffer = mapping_size ? NULL : buffer;
+    image->mapping = mapping_size ? buffer : NULL;
+    image->mapping_size = mapping_size;
+    image->data = buffer;
+    image->format = format;
+    image->bpp = bpp;
+    image->stride = (ptrdiff_t)row_pixels * bpp;
+    image->palette_size = 0;
+    return 1;
+}
+
+/* Packs a drawing colour for the image. Palette images map it to a palette
+ * entry and only fall back to truecolour when all 256 entries are taken. */
+static int image_color_value(Image *image, Rgb color, PixelValue *value) {
+    if (image->format == PIXEL_PAL8) {
+        int index = palette_find_or_add(image, color, 255);
+        if (index >= 0) {
+            memset(value, 0, sizeof(PixelValue));
+            value->bytes[0] = (unsigned char)index;
+            value->alpha = 255;
+            return 1;
+        }
+        if (!image_expand_palette(image)) return 0;
+    }
+    *value = pixel_value_from_rgb(image->format, color);
+    return 1;
+}
+
+/* Like image_color_value for a colour that may be translucent: blending
+ * produces colours no palette holds, so palette images are expanded to
+ * truecolour first. */
+static int image_paint_value(Image *image, Rgba color, PixelValue *value) {
+    Rgb rgb = {color.r, color.g, color.b};
+    if (color.a == 255) return image_color_value(image, rgb, value);
+    if (!image_expand_palette(image)) return 0;
+    *value = pixel_value_from_rgb(image->format, rgb);
+    value->alpha = color.a;
+    return 1;
+}
+
+static void color_match_init(ColorMatch *match, const Image *image, Rgb color) {
+    memset(match, 0, sizeof(ColorMatch));
+    if (image->format == PIXEL_PAL8) {
+        for (int i = 0; i < image->palette_size; i++) {
+            const Rgb *entry = &image->palette[i];
+            match->index_match[i] = entry->r == color.r && entry->g == color.g && entry->b == color.b;
+        }
+    } else {
+        match->value = pixel_value_from_rgb(image->format, color);
+    }
+}
+
+/* Matches the exact colour of pixel (x, y) at its full sample depth; a
+ * palette image matches every index holding the same colour. */
+static void color_match_at(ColorMatch *match, const Image *image, int x, int y) {
+    const unsigned char *p = image_pixel(image, x, y);
+    if (image->format == PIXEL_PAL8) {
+        color_match_init(match, image, image->palette[p[0]]);
+        return;
+    }
+    memset(match, 0, sizeof(ColorMatch));
+    memcpy(match->value.bytes, p, image->bpp);
+}
+
+/* flags[i] = 1 where pixel (x0 + i, y) has the matched colour, x0..x1. */
+static void image_match_span(const Image *image, int y, int x0, int x1, const ColorMatch *match, unsigned char *flags) {
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    for (int x = x0; x <= x1;) {
+        int count = image_run_length(image, x, x1);
+        format->match_flags(image_pixel(image, x, y), count, match, flags + (x - x0));
+        x += count;
+    }
+}
+
+static inline bool color_match_pixel(const Image *image, const ColorMatch *match, int x, int y) {
+    const unsigned char *p = image_pixel(image, x, y);
+    if (image->format == PIXEL_PAL8) return match->index_match[p[0]];
+    return memcmp(p, match->value.bytes, cw_pixel_format_info(image->format)->color_bytes) == 0;
+}
+
+static void image_copy_palette(Image *dst, const Image *src) {
+    dst->palette_size = src->palette_size;
+    memcpy(dst->palette, src->palette, sizeof(src->palette));
+    memcpy(dst->palette_alpha, src->palette_alpha, sizeof(src->palette_alpha));
+}
+
+Image* cw_image_create(int width, int height, enum PixelFormat format) {
+    if (width <= 0 || height <= 0) return NULL;
+    Image *image = (Image*)calloc(1, sizeof(Image));
+    if (!image) {
+        fprintf(stderr, "Memory for image failed\n");
+        return NULL;
+    }
+    image->width = width;
+    image->height = height;
+    image->format = format;
+    image->bpp = cw_pixel_format_info(format)->bytes_per_pixel;
+    image->stride = (ptrdiff_t)width * image->bpp;
+    if (!image_alloc_pixels(image, (size_t)image->stride * height, false)) {
+        fprintf(stderr, "Memory for %dx%d image failed\n", width, height);
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+static Image* image_create_tiled(int width, int height, enum PixelFormat format) {
+    if (width <= 0 || height <= 0) return NULL;
+    Image *image = (Image*)calloc(1, sizeof(Image));
+    if (!image) {
+        fprintf(stderr, "Memory for image failed\n");
+        return NULL;
+    }
+    image->width = width;
+    image->height = height;
+    image->format = format;
+    image->bpp = cw_pixel_format_info(format)->bytes_per_pixel;
+    image->tiled = true;
+    image->stride = (ptrdiff_t)IMAGE_TILE_SIZE * image->bpp;
+    int row_pixels;
+    int rows = image_storage_rows(image, &row_pixels);
+    if (!image_alloc_pixels(image, (size_t)rows * image->stride, true)) {
+        fprintf(stderr, "Memory for %dx%d tiled image failed\n", width, height);
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+/* Copies the pixels into a new image with the requested layout; the codecs
+ * and most operations only take row-major images. */
+Image* cw_image_convert_layout(const Image *image, bool tiled) {
+    Image *dst = tiled ? image_create_tiled(image->width, image->height, image->format)
+                       : cw_image_create(image->width, image->height, image->format);
+    if (!dst) return NULL;
+    image_copy_palette(dst, image);
+    for (int y = 0; y < image->height; y++) {
+        for (int x = 0; x < image->width;) {
+            int count = image_run_length(image->tiled ? image : dst, x, image->width - 1);
+            memcpy(image_pixel(dst, x, y), image_pixel(image, x, y), (size_t)count * image->bpp);
+            x += count;
+        }
+    }
+    return dst;
+}
+
+/* Row y as contiguous pixels: the row itself, or for a tiled image a copy
+ * gathered into `scratch` (width * bpp bytes). */
+const unsigned char* image_read_row(const Image *image, int y, unsigned char *scratch) {
+    if (!image->tiled) return image_row(image, y);
+    for (int x = 0; x < image->width;) {
+        int count = image_run_length(image, x, image->width - 1);
+        memcpy(scratch + (size_t)x * image->bpp, image_pixel(image, x, y), (size_t)count * image->bpp);
+        x += count;
+    }
+    return scratch;
+}
+
+static void image_free(Image *image) {
+    if (!image) return;
+    image_release_pixels(image);
+    free(image);
+}
+
+/* Fills [x0, x1] on row y, clipped to `clip` (a rectangle inside the
+ * image); a translucent value is blended over the pixels. */
+static void fill_span_clip(Image *image, int y, int x0, int x1, const PixelValue *value, const ClipRect *clip) {
+    if (y < clip->y0 || y > clip->y1 || value->alpha == 0) return;
+    if (x0 < clip->x0) x0 = clip->x0;
+    if (x1 > clip->x1) x1 = clip->x1;
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    while (x0 <= x1) {
+        int count = image_run_length(image, x0, x1);
+        if (value->alpha == 255) format->fill_span(image_pixel(image, x0, y), value, count);
+        else format->blend_span(image_pixel(image, x0, y), value, count, value->alpha);
+        x0 += count;
+    }
+}
+
+static inline ClipRect image_clip_rect(const Image *image) {
+    return (ClipRect){0, 0, image->width - 1, image->height - 1};
+}
+
+/* Fills [x0, x1] on row y, clipped to the image. */
+static void fill_span_safe(Image *image, int y, int x0, int x1, const PixelValue *value) {
+    ClipRect clip = image_clip_rect(image);
+    fill_span_clip(image, y, x0, x1, value, &clip);
+}
+
+/* Sets bits [x0, x1] of a row mask of a clip at most 64 pixels wide. */
+static inline void mask_span(uint64_t *mask, int y, int x0, int x1, const ClipRect *clip) {
+    if (y < clip->y0 || y > clip->y1) return;
+    if (x0 < clip->x0) x0 = clip->x0;
+    if (x1 > clip->x1) x1 = clip->x1;
+    if (x0 > x1) return;
+    int width = x1 - x0 + 1;
+    mask[y - clip->y0] |= (width == 64 ? ~0ULL : ((1ULL << width) - 1)) << (x0 - clip->x0);
+}
+
+/* Stamps a dot into the image, or with `mask` only into the clip's row
+ * masks, so overlapping dots of a translucent line are blended once. */
+static void draw_thick_dot_clip(Image *image, int cx, int cy, int thickness, const PixelValue *value, const ClipRect *clip,
+                                uint64_t *mask) {
+    if (thickness <= 0) return;
+    
+    int x0 = cx - (thickness - 1) / 2;
+    for (int dy = 0; dy < thickness; ++dy) {
+        int current_y = cy + dy - (thickness -1)/2;
+        if (mask) mask_span(mask, current_y, x0, x0 + thickness - 1, clip);
+        else fill_span_clip(image, current_y, x0, x0 + thickness - 1, value, clip);
+    }
+}
+
+/* Bresenham walk from p1 to p2 stamping a thickness x thickness dot at
+ * every step; only the part inside `clip` is drawn. The walk is monotonic
+ * in x and y, so it stops as soon as the dots have moved past the clip. */
+static void draw_line_clip(Image *image, Point p1, Point p2, const PixelValue *value, int thickness, const ClipRect *clip,
+                           uint64_t *mask) {
+    int x1 = p1.x, y1 = p1.y;
+    int x2 = p2.x, y2 = p2.y;
+
+    int dx_abs = abs(x2 - x1);
+    int sx = x1 < x2 ? 1 : -1;
+    int dy_abs = abs(y2 - y1); 
+    int sy = y1 < y2 ? 1 : -1;
+    int err = (dx_abs > dy_abs ? dx_abs : -dy_abs) / 2;
+    int e2;
+    int before = (thickness - 1) / 2, after = thickness - 1 - before;
+
+    while (true) {
+        if (sx > 0 ? x1 - before > clip->x1 : x1 + after < clip->x0) break;
+        if (sy > 0 ? y1 - before > clip->y1 : y1 + after < clip->y0) break;
+        if (x1 + after >= clip->x0 && x1 - before <= clip->x1 && y1 + after >= clip->y0 && y1 - before <= clip->y1) {
+            draw_thick_dot_clip(image, x1, y1, thickness, value, clip, mask);
+        }
+        if (x1 == x2 && y1 == y2) break;
+        e2 = err;
+        if (e2 > -dx_abs) { err -= dy_abs; x1 += sx; }
+        if (e2 <  dy_abs) { err += dx_abs; y1 += sy; }
+    }
+}
+
+static int draw_line_thick(Image *image, Point p1, Point p2, Rgb color, int thickness) {
+    PixelValue value;
+    if (!image_color_value(image, color, &value)) return ERROR_MEMORY;
+    if (thickness <= 0) return ERROR_SUCCESS;
+    ClipRect clip = image_clip_rect(image);
+    draw_line_clip(image, p1, p2, &value, thickness, &clip, NULL);
+    return ERROR_SUCCESS;
+}
+
+/* Edge function of a->b as a*x + b*y + c: >= 0 on the inner side of a
+ * counter-clockwise edge. 64-bit, so canvases of any int size are exact. */
+typedef struct {
+    int64_t a, b, c;
+} TriangleEdge;
+
+static inline TriangleEdge triangle_edge(Point from, Point to) {
+    TriangleEdge edge;
+    edge.a = -((int64_t)to.y - from.y);
+    edge.b = (int64_t)to.x - from.x;
+    edge.c = -edge.a * from.x - edge.b * from.y;
+    return edge;
+}
+
+static inline int64_t edge_at(const TriangleEdge *edge, int x, int y) {
+    return edge->a * x + edge->b * y + edge->c;
+}
+
+/* Filled triangle clipped to a rectangle, split into bands of up to
+ * IMAGE_TILE_SIZE rows on the image tile grid. */
+typedef struct {
+    Image *image;
+    TriangleEdge edges[3];
+    const PixelValue *value;
+    ClipRect box;
+} TriangleFill;
+
+/* A pixel is covered when it is on the inner side of all three edges,
+ * boundary included. */
+static inline bool triangle_covers(const TriangleEdge *edges, int x, int y) {
+    return edge_at(&edges[0], x, y) >= 0 && edge_at(&edges[1], x, y) >= 0 && edge_at(&edges[2], x, y) >= 0;
+}
+
+/* One band: each IMAGE_TILE_SIZE column block is classified from its
+ * corners (edge functions are linear, so the corners bound the block).
+ * Blocks fully inside all edges are filled without tests, blocks fully
+ * outside one edge are skipped, and only the remaining edge blocks are
+ * tested per pixel. The triangle is convex, so each row is one span. */
+static void triangle_fill_band(void *ctx, int band) {
+    TriangleFill *fill = (TriangleFill*)ctx;
+    const TriangleEdge *edges = fill->edges;
+    int y0 = (fill->box.y0 / IMAGE_TILE_SIZE + band) * IMAGE_TILE_SIZE;
+    int y1 = y0 + IMAGE_TILE_SIZE - 1;
+    if (y0 < fill->box.y0) y0 = fill->box.y0;
+    if (y1 > fill->box.y1) y1 = fill->box.y1;
+
+    int accept_x0 = -1, accept_x1 = -1;
+    int scan_x0 = -1, scan_x1 = -1;
+    for (int x0 = fill->box.x0; x0 <= fill->box.x1;) {
+        int x1 = (x0 / IMAGE_TILE_SIZE + 1) * IMAGE_TILE_SIZE - 1;
+        if (x1 > fill->box.x1) x1 = fill->box.x1;
+        bool inside = true, outside = false;
+        for (int k = 0; k < 3; k++) {
+            int64_t c00 = edge_at(&edges[k], x0, y0), c10 = edge_at(&edges[k], x1, y0);
+            int64_t c01 = edge_at(&edges[k], x0, y1), c11 = edge_at(&edges[k], x1, y1);
+            if (c00 < 0 || c10 < 0 || c01 < 0 || c11 < 0) inside = false;
+            if (c00 < 0 && c10 < 0 && c01 < 0 && c11 < 0) outside = true;
+        }
+        if (!outside) {
+            if (scan_x0 < 0) scan_x0 = x0;
+            scan_x1 = x1;
+        }
+        if (inside) {
+            if (accept_x0 < 0) accept_x0 = x0;
+            accept_x1 = x1;
+        }
+        x0 = x1 + 1;
+    }
+    if (scan_x0 < 0) return;
+
+    for (int y = y0; y <= y1; y++) {
+        int span_start = -1, span_end = -1;
+        if (accept_x0 >= 0) {
+            /* Fully covered blocks of a band are contiguous; grow the row's
+             * span from them into the edge blocks on either side. */
+            span_start = accept_x0;
+            span_end = accept_x1;
+            while (span_start > scan_x0 && triangle_covers(edges, span_start - 1, y)) span_start--;
+            while (span_end < scan_x1 && triangle_covers(edges, span_end + 1, y)) span_end++;
+        } else {
+            int64_t w0 = edge_at(&edges[0], scan_x0, y);
+            int64_t w1 = edge_at(&edges[1], scan_x0, y);
+            int64_t w2 = edge_at(&edges[2], scan_x0, y);
+            for (int x = scan_x0; x <= scan_x1; ++x) {
+                if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
+                    if (span_start < 0) span_start = x;
+                    span_end = x;
+                } else if (span_start >= 0) {
+                    break;
+                }
+                w0 += edges[0].a;
+                w1 += edges[1].a;
+                w2 += edges[2].a;
+            }
+        }
+        if (span_start >= 0) fill_span_clip(fill->image, y, span_start, span_end, fill->value, &fill->box);
+    }
+}
+
+/* Fills the triangle inside `clip`, band by band on `pool` (NULL runs the
+ * bands on the calling thread). */
+static void fill_triangle_clip(Image *image, Point v0, Point v1, Point v2, const PixelValue *value, const ClipRect *clip,
+                               ThreadPool *pool) {
+    int minX = v0.x < v1.x ? (v0.x < v2.x ? v0.x : v2.x) : (v1.x < v2.x ? v1.x : v2.x);
+    int minY = v0.y < v1.y ? (v0.y < v2.y ? v0.y : v2.y) : (v1.y < v2.y ? v1.y : v2.y);
+    int maxX = v0.x > v1.x ? (v0.x > v2.x ? v0.x : v2.x) : (v1.x > v2.x ? v1.x : v2.x);
+    int maxY = v0.y > v1.y ? (v0.y > v2.y ? v0.y : v2.y) : (v1.y > v2.y ? v1.y : v2.y);
+
+    TriangleFill fill = {.image = image, .value = value};
+    fill.box.x0 = minX < clip->x0 ? clip->x0 : minX;
+    fill.box.y0 = minY < clip->y0 ? clip->y0 : minY;
+    fill.box.x1 = maxX > clip->x1 ? clip->x1 : maxX;
+    fill.box.y1 = maxY > clip->y1 ? clip->y1 : maxY;
+    if (fill.box.x0 > fill.box.x1 || fill.box.y0 > fill.box.y1) return;
+
+    Point tv0 = v0, tv1 = v1, tv2 = v2;
+    TriangleEdge orientation = triangle_edge(v0, v1);
+    if (edge_at(&orientation, v2.x, v2.y) < 0) { 
+        tv1 = v2;
+        tv2 = v1;
+    }
+    fill.edges[0] = triangle_edge(tv1, tv2);
+    fill.edges[1] = triangle_edge(tv2, tv0);
+    fill.edges[2] = triangle_edge(tv0, tv1);
+
+    int bands = fill.box.y1 / IMAGE_TILE_SIZE - fill.box.y0 / IMAGE_TILE_SIZE + 1;
+    cw_thread_pool_run(pool, bands, triangle_fill_band, &fill);
+}
+
+static int fill_triangle_half_space(Image *image, Point v0, Point v1, Point v2, Rgba color, int threads) {
+    PixelValue value;
+    if (!image_paint_value(image, color, &value)) return ERROR_MEMORY;
+    ClipRect clip = image_clip_rect(image);
+    int minY = v0.y < v1.y ? (v0.y < v2.y ? v0.y : v2.y) : (v1.y < v2.y ? v1.y : v2.y);
+    int maxY = v0.y > v1.y ? (v0.y > v2.y ? v0.y : v2.y) : (v1.y > v2.y ? v1.y : v2.y);
+    if (minY < 0) minY = 0;
+    if (maxY >= image->height) maxY = image->height - 1;
+    /* Threads only pay off once there are several bands to hand out. */
+    ThreadPool *pool = threads > 1 && maxY - minY >= 2 * IMAGE_TILE_SIZE ? cw_thread_pool_create(threads) : NULL;
+    fill_triangle_clip(image, v0, v1, v2, &value, &clip, pool);
+    cw_thread_pool_destroy(pool);
+    return ERROR_SUCCESS;
+}
+
+/* Where a scanline crosses a polygon edge; dir is +1 for an edge going
+ * down and -1 for one going up, summed by the non-zero rule. */
 typedef struct {
-    unsigned char r, g, b;
-} Rgb;
+    double x;
+    int dir;
+} EdgeCrossing;
+
+/* Turns the crossings of one scanline, sorted by x, into the inside
+ * intervals [xs[2k].x, xs[2k + 1].x) in place and returns their number:
+ * alternate crossings for even-odd, runs of non-zero winding otherwise. */
+static int crossing_intervals(EdgeCrossing *xs, int n, bool nonzero) {
+    if (!nonzero) return n / 2;
+    int out = 0, winding = 0;
+    for (int k = 0; k < n; k++) {
+        int next = winding + xs[k].dir;
+        if ((winding == 0) != (next == 0)) xs[out++].x = xs[k].x;
+        winding = next;
+    }
+    return out / 2;
+}
 
+/* Non-horizontal polygon edge a->b and the scanlines row0..row1 it
+ * crosses inside the clip. */
 typedef struct {
-    int x, y;
-} Point;
+    Point a, b;
+    int row0, row1, dir;
+} PolygonEdge;
+
+static int polygon_edge_order(const void *lhs, const void *rhs) {
+    const PolygonEdge *a = (const PolygonEdge*)lhs, *b = (const PolygonEdge*)rhs;
+    return (a->row0 > b->row0) - (a->row0 < b->row0);
+}
+
+/* Fills a closed polygon by the even-odd or non-zero rule, sampling pixel
+ * centres. Edges own their upper end, so shared vertices are counted once.
+ * An active edge table sorted by first row feeds each scanline only the
+ * edges crossing it, kept in crossing order so the per-row insertion sort
+ * does little work. Returns false when the table cannot be allocated. */
+static bool fill_polygon_clip(Image *image, const Point *points, int count, bool nonzero, const PixelValue *value,
+                              const ClipRect *clip) {
+    EdgeCrossing local_xs[64];
+    PolygonEdge local_edges[64];
+    int local_active[64];
+    EdgeCrossing *xs = local_xs;
+    PolygonEdge *edges = local_edges;
+    int *active = local_active;
+    void *heap = NULL;
+    if (count > 64) {
+        heap = malloc((sizeof(EdgeCrossing) + sizeof(PolygonEdge) + sizeof(int)) * count);
+        if (!heap) return false;
+        xs = (EdgeCrossing*)heap;
+        edges = (PolygonEdge*)(xs + count);
+        active = (int*)(edges + count);
+    }
 
-void read_png_file(const char *filename, struct Png *image);
-void write_png_file(const char *filename, struct Png *image, Rgb **rgb_data); 
-void print_png_info(struct Png *image);
-Rgb** png_data_to_rgb_array(struct Png *image);
-void free_rgb_array(Rgb **rgb_data, int height);
-void free_png_read_resources(struct Png *image); 
-void print_help();
-int parse_color_string(const char* optarg_str, Rgb* color_struct);
-int parse_points_string(const char* optarg_str, Point* p1, Point* p2, Point* p3);
+    int edge_count = 0;
+    for (int i = 0; i < count; i++) {
+        Point a = points[i], b = points[i + 1 < count ? i + 1 : 0];
+        if (a.y == b.y) continue;
+        int row0 = a.y < b.y ? a.y : b.y, row1 = (a.y < b.y ? b.y : a.y) - 1;
+        if (row0 < clip->y0) row0 = clip->y0;
+        if (row1 > clip->y1) row1 = clip->y1;
+        if (row0 <= row1) edges[edge_count++] = (PolygonEdge){a, b, row0, row1, b.y > a.y ? 1 : -1};
+    }
+    qsort(edges, edge_count, sizeof(PolygonEdge), polygon_edge_order);
 
-void draw_line_thick(Rgb **pixels, int W, int H, Point p1, Point p2, Rgb color, int thickness);
-void fill_triangle_half_space(Rgb **pixels, int W, int H, Point v0, Point v1, Point v2, Rgb color);
-void operation_draw_triangle(Rgb **pixels, int W, int H, Point p1, Point p2, Point p3, int thickness, Rgb line_color, bool fill, Rgb fill_color);
-void operation_find_recolor_biggest_rect(Rgb **pixels, int W, int H, Rgb old_color, Rgb new_color);
-Rgb** operation_create_collage(Rgb **original_pixels, int orig_W, int orig_H, int N_x, int M_y, int* new_W, int* new_H);
+    int next = 0, active_count = 0;
+    for (int y = clip->y0; next < edge_count || active_count > 0; y++) {
+        if (active_count == 0 && edges[next].row0 > y) y = edges[next].row0;
+        while (next < edge_count && edges[next].row0 <= y) active[active_count++] = next++;
+        for (int k = 0; k < active_count; k++) {
+            int edge = active[k];
+            const PolygonEdge *e = &edges[edge];
+            double x = e->a.x + (double)(y - e->a.y) * (e->b.x - e->a.x) / (e->b.y - e->a.y);
+            int j = k;
+            while (j > 0 && xs[j - 1].x > x) {
+                xs[j] = xs[j - 1];
+                active[j] = active[j - 1];
+                j--;
+            }
+            xs[j] = (EdgeCrossing){x, e->dir};
+            active[j] = edge;
+        }
+        int intervals = crossing_intervals(xs, active_count, nonzero);
+        for (int k = 0; k < intervals; k++) {
+            double left = ceil(xs[2 * k].x), right = floor(xs[2 * k + 1].x);
+            if (right < clip->x0 || left > clip->x1) continue;
+            fill_span_clip(image, y, (int)(left < clip->x0 ? clip->x0 : left), (int)(right > clip->x1 ? clip->x1 : right), value, clip);
+        }
+        int kept = 0;
+        for (int k = 0; k < active_count; k++) {
+            if (edges[active[k]].row1 > y) active[kept++] = active[k];
+        }
+        active_count = kept;
+    }
+    free(heap);
+    return true;
+}
 
+/* Half width of the ellipse with radii rx, ry >= 0 on the integer grid,
+ * dy rows from its centre: the largest w with w^2 ry^2 + dy^2 rx^2 <=
+ * rx^2 ry^2, or -1 when the row misses it. The square root only seeds the
+ * exact search; radii up to 2^30 keep the products inside 128 bits. */
+static long long ellipse_half_width(long long rx, long long ry, long long dy) {
+    if (dy < 0) dy = -dy;
+    if (dy > ry) return -1;
+    __int128 ry2 = (__int128)ry * ry;
+    __int128 limit = (ry2 - (__int128)dy * dy) * rx * rx;
+    double t = ry > 0 ? (double)dy / (double)ry : 0.0;
+    long long w = (long long)((double)rx * sqrt(1.0 - t * t));
+    if (w > rx) w = rx;
+    while (w > 0 && (__int128)w * w * ry2 > limit) w--;
+    while (w < rx && (__int128)(w + 1) * (w + 1) * ry2 <= limit) w++;
+    return w;
+}
+
+/* Whether offset (dx, dy) from the centre lies in the ellipse with radii
+ * rx, ry (boundary included). */
+static bool ellipse_contains(long long rx, long long ry, long long dx, long long dy) {
+    if (dx < 0) dx = -dx;
+    if (dy < 0) dy = -dy;
+    if (dx > rx || dy > ry) return false;
+    return (__int128)dx * dx * ry * ry + (__int128)dy * dy * rx * rx <= (__int128)rx * rx * ry * ry;
+}
+
+/* Fills the pixels whose centres lie in the ellipse with radii `outer`
+ * around `center` but not in the one with radii `inner` (inner.x < 0 for
+ * none): one span per row, or two across a ring's hole. */
+static void fill_ellipse_clip(Image *image, Point center, Point outer, Point inner, const PixelValue *value, const ClipRect *clip) {
+    long long y0 = (long long)center.y - outer.y, y1 = (long long)center.y + outer.y;
+    if (y0 < clip->y0) y0 = clip->y0;
+    if (y1 > clip->y1) y1 = clip->y1;
+    for (long long y = y0; y <= y1; y++) {
+        long long wo = ellipse_half_width(outer.x, outer.y, y - center.y);
+        long long wi = inner.x >= 0 ? ellipse_half_width(inner.x, inner.y, y - center.y) : -1;
+        long long spans[2][2] = {{center.x - wo, center.x + wo}, {1, 0}};
+        if (wi >= 0) {
+            spans[0][1] = center.x - wi - 1;
+            spans[1][0] = center.x + wi + 1;
+            spans[1][1] = center.x + wo;
+        }
+        for (int k = 0; k < 2; k++) {
+            long long x0 = spans[k][0] < clip->x0 ? clip->x0 : spans[k][0];
+            long long x1 = spans[k][1] > clip->x1 ? clip->x1 : spans[k][1];
+            if (x0 <= x1) fill_span_clip(image, (int)y, (int)x0, (int)x1, value, clip);
+        }
+    }
+}
+
+/* Outline of an ellipse with a thickness x thickness brush, as the ring
+ * fill_ellipse_clip draws between `outer` and `inner`. The outer radii are
+ * capped at 4 * SHAPE_MAX_RADIUS, far past any pixel of a real image. */
+static void ellipse_ring(Point radii, int thickness, Point *outer, Point *inner) {
+    int before = (thickness - 1) / 2, after = thickness - 1 - before;
+    long long limit = 4LL * SHAPE_MAX_RADIUS;
+    long long ox = (long long)radii.x + after, oy = (long long)radii.y + after;
+    *outer = (Point){(int)(ox < limit ? ox : limit), (int)(oy < limit ? oy : limit)};
+    *inner = (Point){radii.x - before - 1, radii.y - before - 1};
+    if (inner->x < 0 || inner->y < 0) *inner = (Point){-1, -1};
+}
+
+
+/* Anti-aliased drawing samples every pixel on a 4x4 grid and blends the
+ * colour in with the covered fraction (times its own opacity). Geometry is in 1/8 pixel units:
+ * pixel x spans [8x - 4, 8x + 4) and its samples sit at 8x - 3, -1, +1,
+ * +3, so sample column s (4 per pixel) is at 2s - 3. A coverage mask keeps
+ * one bit per sample, four bits per sample row. */
+#define AA_FULL_MASK 0xFFFF
+
+/* Closed path filled by the even-odd or non-zero rule; points are
+ * multiplied by `scale` to get 1/8 pixel units (8 for pixel coordinates).
+ * Convex paths let whole tiles be accepted or rejected up front. A path
+ * with no points is an ellipse instead: the samples inside radii `outer`
+ * around pixel `center` and not inside `inner` (inner.x < 0 for none),
+ * with the radii in 1/8 units. */
+typedef struct {
+    const Point *points;
+    int count;
+    int scale;
+    bool convex, nonzero;
+    Point center, outer, inner;
+} AaPath;
+
+/* ORs samples s0..s1 of sample row j into masks[] (one per pixel from
+ * clip->x0), clamped to the clip. */
+static void aa_mask_samples(uint16_t *masks, const ClipRect *clip, int j, long long s0, long long s1) {
+    long long first = 4LL * clip->x0, last = 4LL * clip->x1 + 3;
+    if (s0 < first) s0 = first;
+    if (s1 > last) s1 = last;
+    if (s0 > s1) return;
+    int px0 = (int)(s0 >> 2) - clip->x0, px1 = (int)(s1 >> 2) - clip->x0;
+    uint16_t head = (uint16_t)((0xFu << (s0 & 3)) & 0xFu), tail = (uint16_t)((2u << (s1 & 3)) - 1);
+    if (px0 == px1) {
+        masks[px0] |= (uint16_t)((head & tail) << (4 * j));
+        return;
+    }
+    masks[px0] |= (uint16_t)(head << (4 * j));
+    masks[px1] |= (uint16_t)(tail << (4 * j));
+    uint16_t row_bits = (uint16_t)(0xFu << (4 * j));
+    for (int px = px0 + 1; px < px1; px++) masks[px] |= row_bits;
+}
+
+/* ORs into masks[] the samples of row y inside the path: crossings of each
+ * sample row with the edges, taken by the path's fill rule. Sample rows
+ * never pass through a vertex, since those sit on even 1/8 units. An
+ * ellipse covers sample x = 2s - 3 when |x - centre| is within its half
+ * width on that sample row. */
+static void aa_cover_path(const AaPath *path, int y, const ClipRect *clip, EdgeCrossing *xs, uint16_t *masks) {
+    long long first = 4LL * clip->x0, last = 4LL * clip->x1 + 3;
+    for (int j = 0; j < 4; j++) {
+        long long sample_y = 8LL * y + 2 * j - 3;
+        if (path->count == 0) {
+            long long cx = 8LL * path->center.x, dy = sample_y - 8LL * path->center.y;
+            long long wo = ellipse_half_width(path->outer.x, path->outer.y, dy);
+            if (wo < 0) continue;
+            long long wi = path->inner.x >= 0 ? ellipse_half_width(path->inner.x, path->inner.y, dy) : -1;
+            if (wi < 0) {
+                aa_mask_samples(masks, clip, j, (cx - wo + 4) >> 1, (cx + wo + 3) >> 1);
+            } else {
+                aa_mask_samples(masks, clip, j, (cx - wo + 4) >> 1, (cx - wi + 2) >> 1);
+                aa_mask_samples(masks, clip, j, (cx + wi + 5) >> 1, (cx + wo + 3) >> 1);
+            }
+            continue;
+        }
+        int n = 0;
+        for (int i = 0; i < path->count; i++) {
+            Point a = path->points[i], b = path->points[i + 1 < path->count ? i + 1 : 0];
+            long long ay = (long long)a.y * path->scale, by = (long long)b.y * path->scale;
+            if ((ay <= sample_y) == (by <= sample_y)) continue;
+            double ax = (double)a.x * path->scale, bx = (double)b.x * path->scale;
+            double x = ax + (double)(sample_y - ay) * (bx - ax) / (double)(by - ay);
+            int k = n++;
+            while (k > 0 && xs[k - 1].x > x) {
+                xs[k] = xs[k - 1];
+                k--;
+            }
+            xs[k] = (EdgeCrossing){x, by > ay ? 1 : -1};
+        }
+        int intervals = crossing_intervals(xs, n, path->nonzero);
+        for (int k = 0; k < intervals; k++) {
+            double left = ceil((xs[2 * k].x + 3) / 2), right = ceil((xs[2 * k + 1].x + 3) / 2) - 1;
+            long long s0 = left < (double)first ? first : (long long)left;
+            long long s1 = right > (double)last ? last : (long long)right;
+            aa_mask_samples(masks, clip, j, s0, s1);
+        }
+    }
+}
+
+/* Where the samples of `clip` lie against a convex path: -1 when all are
+ * outside one edge (or the path has no area), 1 when all are inside every
+ * edge, 0 otherwise and for paths that are not convex. An ellipse misses
+ * the sample box when the box point nearest its centre is outside it, and
+ * contains the box when all four corners are in it and the nearest point
+ * clears the hole. Exact in 128-bit arithmetic. */
+static int aa_classify(const AaPath *path, const ClipRect *clip) {
+    if (path->count == 0) {
+        long long cx = 8LL * path->center.x, cy = 8LL * path->center.y;
+        long long x0 = 8LL * clip->x0 - 3, x1 = 8LL * clip->x1 + 3, y0 = 8LL * clip->y0 - 3, y1 = 8LL * clip->y1 + 3;
+        long long nx = cx < x0 ? x0 : cx > x1 ? x1 : cx, ny = cy < y0 ? y0 : cy > y1 ? y1 : cy;
+        if (!ellipse_contains(path->outer.x, path->outer.y, nx - cx, ny - cy)) return -1;
+        if (path->inner.x >= 0 && ellipse_contains(path->inner.x, path->inner.y, nx - cx, ny - cy)) return 0;
+        bool corners = ellipse_contains(path->outer.x, path->outer.y, x0 - cx, y0 - cy) &&
+                       ellipse_contains(path->outer.x, path->outer.y, x1 - cx, y0 - cy) &&
+                       ellipse_contains(path->outer.x, path->outer.y, x0 - cx, y1 - cy) &&
+                       ellipse_contains(path->outer.x, path->outer.y, x1 - cx, y1 - cy);
+        return corners ? 1 : 0;
+    }
+    if (!path->convex) return 0;
+    __int128 area = 0;
+    for (int i = 0; i < path->count; i++) {
+        Point a = path->points[i], b = path->points[i + 1 < path->count ? i + 1 : 0];
+        area += (__int128)a.x * b.y - (__int128)b.x * a.y;
+    }
+    if (area == 0) return -1;
+    long long cx[4] = {8LL * clip->x0 - 3, 8LL * clip->x1 + 3, 8LL * clip->x0 - 3, 8LL * clip->x1 + 3};
+    long long cy[4] = {8LL * clip->y0 - 3, 8LL * clip->y0 - 3, 8LL * clip->y1 + 3, 8LL * clip->y1 + 3};
+    bool all_inside = true;
+    for (int i = 0; i < path->count; i++) {
+        Point a = path->points[i], b = path->points[i + 1 < path->count ? i + 1 : 0];
+        long long ax = (long long)a.x * path->scale, ay = (long long)a.y * path->scale;
+        long long dx = (long long)b.x * path->scale - ax, dy = (long long)b.y * path->scale - ay;
+        int inside = 0, outside = 0;
+        for (int k = 0; k < 4; k++) {
+            __int128 cross = (__int128)dx * (cy[k] - ay) - (__int128)dy * (cx[k] - ax);
+            if (area < 0) cross = -cross;
+            if (cross > 0) inside++;
+            else if (cross < 0) outside++;
+        }
+        if (outside == 4) return -1;
+        if (inside != 4) all_inside = false;
+    }
+    return all_inside ? 1 : 0;
+}
+
+/* Draws the union of the paths inside `clip`, which is at most
+ * IMAGE_TILE_SIZE pixels wide: fully covered runs are filled, edge pixels
+ * blended. Convex paths that miss the clip are dropped and one that covers
+ * it fills it outright. Returns false when scratch memory runs out. */
+static bool aa_draw_paths(Image *image, const AaPath *paths, int path_count, const PixelValue *value, const ClipRect *clip) {
+    typedef struct {
+        const AaPath *path;
+        int row0, row1;
+    } AaActive;
+    AaActive local_active[16];
+    AaActive *active = path_count <= 16 ? local_active : (AaActive*)malloc(sizeof(AaActive) * path_count);
+    if (!active) return false;
+    int active_count = 0, max_count = 0, row0 = clip->y1 + 1, row1 = clip->y0 - 1;
+    bool covered = false;
+    for (int p = 0; p < path_count && !covered; p++) {
+        const AaPath *path = &paths[p];
+        long long min_x = LLONG_MAX, max_x = LLONG_MIN, min_y = LLONG_MAX, max_y = LLONG_MIN;
+        if (path->count == 0) {
+            min_x = 8LL * path->center.x - path->outer.x;
+            max_x = 8LL * path->center.x + path->outer.x;
+            min_y = 8LL * path->center.y - path->outer.y;
+            max_y = 8LL * path->center.y + path->outer.y;
+        } else if (path->count < 3) {
+            continue;
+        }
+        for (int i = 0; i < path->count; i++) {
+            long long px = (long long)path->points[i].x * path->scale, py = (long long)path->points[i].y * path->scale;
+            if (px < min_x) min_x = px;
+            if (px > max_x) max_x = px;
+            if (py < min_y) min_y = py;
+            if (py > max_y) max_y = py;
+        }
+        if (max_x < 8LL * clip->x0 - 3 || min_x > 8LL * clip->x1 + 3) continue;
+        /* Rows whose samples (8y - 3 .. 8y + 3) can fall inside. */
+        long long first = (min_y + 4 + (1LL << 40)) / 8 - (1LL << 37);
+        long long last = (max_y + 3 + (1LL << 40)) / 8 - (1LL << 37);
+        if (first < clip->y0) first = clip->y0;
+        if (last > clip->y1) last = clip->y1;
+        if (first > last) continue;
+        int state = aa_classify(path, clip);
+        if (state < 0) continue;
+        if (state > 0) covered = true;
+        active[active_count++] = (AaActive){path, (int)first, (int)last};
+        if (path->count > max_count) max_count = path->count;
+        if (first < row0) row0 = (int)first;
+        if (last > row1) row1 = (int)last;
+    }
+    if (covered) {
+        for (int y = clip->y0; y <= clip->y1; y++) fill_span_clip(image, y, clip->x0, clip->x1, value, clip);
+        active_count = 0;
+    }
+
+    EdgeCrossing local[64];
+    EdgeCrossing *xs = max_count <= 64 ? local : (EdgeCrossing*)malloc(sizeof(EdgeCrossing) * max_count);
+    bool ok = xs != NULL;
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    uint16_t masks[IMAGE_TILE_SIZE];
+    int width = clip->x1 - clip->x0 + 1;
+    for (int y = row0; ok && active_count > 0 && y <= row1; y++) {
+        memset(masks, 0, sizeof(uint16_t) * width);
+        for (int p = 0; p < active_count; p++) {
+            if (y >= active[p].row0 && y <= active[p].row1) aa_cover_path(active[p].path, y, clip, xs, masks);
+        }
+        for (int i = 0; i < width;) {
+            if (masks[i] == AA_FULL_MASK) {
+                int run = i;
+                while (run + 1 < width && masks[run + 1] == AA_FULL_MASK) run++;
+                fill_span_clip(image, y, clip->x0 + i, clip->x0 + run, value, clip);
+                i = run + 1;
+                continue;
+            }
+            if (masks[i]) {
+                /* The value's own opacity scaled by the covered samples. */
+                unsigned alpha = (value->alpha * (unsigned)__builtin_popcount(masks[i]) + 8) / 16;
+                if (alpha) format->blend_span(image_pixel(image, clip->x0 + i, y), value, 1, alpha);
+            }
+            i++;
+        }
+    }
+    if (xs && xs != local) free(xs);
+    if (active != local_active) free(active);
+    return ok;
+}
+
+/* Outline of a thick segment: the convex hull of the thickness x thickness
+ * square brush at both ends, the area draw_line_clip stamps dots over.
+ * Writes the hull in 1/8 pixel units to hull[16] (the last 8 entries are
+ * scratch) and returns its point count. */
+static int aa_stroke_hull(Point p1, Point p2, int thickness, Point *hull) {
+    int before = (thickness - 1) / 2, after = thickness - 1 - before;
+    int lo = -8 * before - 4, hi = 8 * after + 4;
+    Point corners[8];
+    Point ends[2] = {p1, p2};
+    for (int e = 0; e < 2; e++) {
+        int x = ends[e].x * 8, y = ends[e].y * 8;
+        corners[4 * e + 0] = (Point){x + lo, y + lo};
+        corners[4 * e + 1] = (Point){x + hi, y + lo};
+        corners[4 * e + 2] = (Point){x + hi, y + hi};
+        corners[4 * e + 3] = (Point){x + lo, y + hi};
+    }
+    /* Monotone chain over the eight corners, sorted by x then y. */
+    for (int i = 1; i < 8; i++) {
+        Point c = corners[i];
+        int k = i;
+        while (k > 0 && (corners[k - 1].x > c.x || (corners[k - 1].x == c.x && corners[k - 1].y > c.y))) {
+            corners[k] = corners[k - 1];
+            k--;
+        }
+        corners[k] = c;
+    }
+    int n = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        int start = n;
+        for (int step = 0; step < 8; step++) {
+            Point c = corners[pass == 0 ? step : 7 - step];
+            while (n >= start + 2) {
+                Point a = hull[n - 2], b = hull[n - 1];
+                long long cross = (long long)(b.x - a.x) * (c.y - a.y) - (long long)(b.y - a.y) * (c.x - a.x);
+                if (cross > 0) break;
+                n--;
+            }
+            hull[n++] = c;
+        }
+        n--;
+    }
+    return n;
+}
+
+int cw_operation_draw_triangle(Image *image, Point p1, Point p2, Point p3, int thickness, Rgba line_color, bool fill, Rgba fill_color,
+                            bool antialias, int threads) {
+    if (antialias || (thickness > 0 && line_color.a < 255)) {
+        /* Anti-aliased edges and translucent outlines, which must cover
+         * each pixel once, go through the tiled shapes rasteriser. */
+        Point points[3] = {p1, p2, p3};
+        Shape shape = {SHAPE_POLYGON, 0, 3, p1, p1};
+        for (int i = 1; i < 3; i++) {
+            if (points[i].x < shape.min.x) shape.min.x = points[i].x;
+            if (points[i].y < shape.min.y) shape.min.y = points[i].y;
+            if (points[i].x > shape.max.x) shape.max.x = points[i].x;
+            if (points[i].y > shape.max.y) shape.max.y = points[i].y;
+        }
+        ShapeList shapes = {&shape, 1, points, 3};
+        return cw_operation_draw_shapes(image, &shapes, thickness, line_color, fill, fill_color, FILL_EVEN_ODD, antialias, threads);
+    }
+    int status = ERROR_SUCCESS;
+    if (fill) {
+        status = fill_triangle_half_space(image, p1, p2, p3, fill_color, threads);
+    }
+    if (thickness > 0 && status == ERROR_SUCCESS) {
+        Rgb line = {line_color.r, line_color.g, line_color.b};
+        status = draw_line_thick(image, p1, p2, line, thickness);
+        if (status == ERROR_SUCCESS) status = draw_line_thick(image, p2, p3, line, thickness);
+        if (status == ERROR_SUCCESS) status = draw_line_thick(image, p3, p1, line, thickness);
+    }
+    return status;
+}
+
+/* --shapes: primitives are binned by their bounding box (grown by the
+ * outline) into IMAGE_TILE_SIZE tiles, and each tile is rasterised by one
+ * thread with every primitive clipped to it. Within a tile the primitives
+ * are drawn in file order, fill before outline, so the result equals
+ * drawing them one by one. Translucent and anti-aliased outlines are the
+ * union of the strokes of all edges, so corners are not blended twice;
+ * an ellipse outline is a single ring. */
+typedef struct {
+    Image *image;
+    const ShapeList *shapes;
+    int tiles_x;
+    const size_t *bin_start;
+    const int *bin_shapes;
+    PixelValue line_value, fill_value;
+    int thickness;
+    bool fill, nonzero, antialias;
+    atomic_bool failed;
+} ShapeRaster;
+
+static bool shape_raster_aa(const ShapeRaster *raster, const Shape *shape, const ClipRect *clip) {
+    const Point *points = raster->shapes->points + shape->first;
+    int count = shape->count;
+    if (shape->kind == SHAPE_ELLIPSE) {
+        /* Pixel centres bound the fill, the brush edges half a pixel
+         * beyond the hard ring bound the outline. */
+        AaPath path = {.center = points[0], .outer = {8 * points[1].x, 8 * points[1].y}, .inner = {-1, -1}};
+        if (raster->fill && !aa_draw_paths(raster->image, &path, 1, &raster->fill_value, clip)) return false;
+        if (raster->thickness <= 0) return true;
+        Point outer, inner;
+        ellipse_ring(points[1], raster->thickness, &outer, &inner);
+        path.outer = (Point){8 * outer.x + 4, 8 * outer.y + 4};
+        path.inner = (Point){8 * inner.x + 4, 8 * inner.y + 4};
+        return aa_draw_paths(raster->image, &path, 1, &raster->line_value, clip);
+    }
+    if (raster->fill) {
+        AaPath path = {.points = points, .count = count, .scale = 8, .convex = count == 3, .nonzero = raster->nonzero};
+        if (!aa_draw_paths(raster->image, &path, 1, &raster->fill_value, clip)) return false;
+    }
+    if (raster->thickness <= 0) return true;
+    AaPath local[8];
+    Point local_hulls[8][16];
+    AaPath *strokes = count <= 8 ? local : (AaPath*)malloc(sizeof(AaPath) * count);
+    Point (*hulls)[16] = count <= 8 ? local_hulls : (Point(*)[16])malloc(sizeof(Point[16]) * count);
+    bool ok = strokes && hulls;
+    if (ok) {
+        for (int i = 0; i < count; i++) {
+            strokes[i].points = hulls[i];
+            strokes[i].count = aa_stroke_hull(points[i], points[i + 1 < count ? i + 1 : 0], raster->thickness, hulls[i]);
+            strokes[i].scale = 1;
+            strokes[i].convex = true;
+            strokes[i].nonzero = false;
+        }
+        ok = aa_draw_paths(raster->image, strokes, count, &raster->line_value, clip);
+    }
+    if (strokes != local) free(strokes);
+    if (hulls != local_hulls) free(hulls);
+    return ok;
+}
+
+static void shape_raster_tile(void *ctx, int tile) {
+    ShapeRaster *raster = (ShapeRaster*)ctx;
+    Image *image = raster->image;
+    int tx = tile % raster->tiles_x, ty = tile / raster->tiles_x;
+    ClipRect clip = {tx * IMAGE_TILE_SIZE, ty * IMAGE_TILE_SIZE,
+                     tx * IMAGE_TILE_SIZE + IMAGE_TILE_SIZE - 1, ty * IMAGE_TILE_SIZE + IMAGE_TILE_SIZE - 1};
+    if (clip.x1 >= image->width) clip.x1 = image->width - 1;
+    if (clip.y1 >= image->height) clip.y1 = image->height - 1;
+    for (size_t k = raster->bin_start[tile]; k < raster->bin_start[tile + 1]; k++) {
+        const Shape *shape = &raster->shapes->shapes[raster->bin_shapes[k]];
+        const Point *points = raster->shapes->points + shape->first;
+        if (raster->antialias) {
+            if (!shape_raster_aa(raster, shape, &clip)) atomic_store(&raster->failed, true);
+            continue;
+        }
+        if (shape->kind == SHAPE_ELLIPSE) {
+            if (raster->fill) fill_ellipse_clip(image, points[0], points[1], (Point){-1, -1}, &raster->fill_value, &clip);
+            if (raster->thickness > 0) {
+                Point outer, inner;
+                ellipse_ring(points[1], raster->thickness, &outer, &inner);
+                fill_ellipse_clip(image, points[0], outer, inner, &raster->line_value, &clip);
+            }
+            continue;
+        }
+        if (raster->fill) {
+            if (shape->count == 3) {
+                fill_triangle_clip(image, points[0], points[1], points[2], &raster->fill_value, &clip, NULL);
+            } else if (!fill_polygon_clip(image, points, shape->count, raster->nonzero, &raster->fill_value, &clip)) {
+                atomic_store(&raster->failed, true);
+            }
+        }
+        if (raster->thickness <= 0) continue;
+        if (raster->line_value.alpha == 255) {
+            for (int i = 0; i < shape->count; i++) {
+                draw_line_clip(image, points[i], points[i + 1 < shape->count ? i + 1 : 0], &raster->line_value, raster->thickness, &clip, NULL);
+            }
+            continue;
+        }
+        uint64_t mask[IMAGE_TILE_SIZE] = {0};
+        for (int i = 0; i < shape->count; i++) {
+            draw_line_clip(image, points[i], points[i + 1 < shape->count ? i + 1 : 0], &raster->line_value, raster->thickness, &clip, mask);
+        }
+        for (int y = clip.y0; y <= clip.y1; y++) {
+            uint64_t bits = mask[y - clip.y0];
+            while (bits) {
+                int x0 = __builtin_ctzll(bits);
+                uint64_t rest = ~bits >> x0;
+                int run = rest ? __builtin_ctzll(rest) : 64 - x0;
+                fill_span_clip(image, y, clip.x0 + x0, clip.x0 + x0 + run - 1, &raster->line_value, &clip);
+                bits = x0 + run >= 64 ? 0 : bits & (~0ULL << (x0 + run));
+            }
+        }
+    }
+}
+
+int cw_operation_draw_shapes(Image *image, const ShapeList *shapes, int thickness, Rgba line_color, bool fill, Rgba fill_color,
+                          enum FillRule fill_rule, bool antialias, int threads) {
+    int W = image->width, H = image->height;
+    if (W == 0 || H == 0 || shapes->shape_count == 0) return ERROR_SUCCESS;
+
+    /* Resolve both colours before any thread writes: a new colour may
+     * expand the palette, which also changes the value of the fill. */
+    ShapeRaster raster = {.image = image, .shapes = shapes, .thickness = thickness, .fill = fill,
+                          .nonzero = fill_rule == FILL_NON_ZERO, .antialias = antialias};
+    atomic_init(&raster.failed, false);
+    /* Blended edge pixels take colours no palette holds. */
+    if (antialias && !image_expand_palette(image)) return ERROR_MEMORY;
+    if (fill && !image_paint_value(image, fill_color, &raster.fill_value)) return ERROR_MEMORY;
+    if (thickness > 0) {
+        enum PixelFormat before = image->format;
+        if (!image_paint_value(image, line_color, &raster.line_value)) return ERROR_MEMORY;
+        if (fill && image->format != before && !image_paint_value(image, fill_color, &raster.fill_value)) return ERROR_MEMORY;
+    }
+
+    int before = thickness > 0 ? (thickness - 1) / 2 : 0;
+    int after = thickness > 0 ? thickness - 1 - before : 0;
+    int tiles_x = (W + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE;
+    int tiles_y = (H + IMAGE_TILE_SIZE - 1) / IMAGE_TILE_SIZE;
+    int tile_count = tiles_x * tiles_y;
+    int *bounds = (int*)cw_arena_alloc(sizeof(int) * 4 * shapes->shape_count);
+    size_t *bin_start = (size_t*)cw_arena_alloc(sizeof(size_t) * (tile_count + 1));
+    if (!bounds || !bin_start) return ERROR_MEMORY;
+    memset(bin_start, 0, sizeof(size_t) * (tile_count + 1));
+
+    /* Tile range of every primitive, counted per tile, then a second pass
+     * lays the primitive indices out tile by tile in file order. */
+    for (int s = 0; s < shapes->shape_count; s++) {
+        const Shape *shape = &shapes->shapes[s];
+        int *b = bounds + 4 * s;
+        long long x0 = (long long)shape->min.x - before, y0 = (long long)shape->min.y - before;
+        long long x1 = (long long)shape->max.x + after, y1 = (long long)shape->max.y + after;
+        if (x1 < 0 || y1 < 0 || x0 >= W || y0 >= H) {
+            b[0] = b[1] = 1;
+            b[2] = b[3] = 0;
+            continue;
+        }
+        b[0] = (int)(x0 < 0 ? 0 : x0) / IMAGE_TILE_SIZE;
+        b[1] = (int)(y0 < 0 ? 0 : y0) / IMAGE_TILE_SIZE;
+        b[2] = (int)(x1 >= W ? W - 1 : x1) / IMAGE_TILE_SIZE;
+        b[3] = (int)(y1 >= H ? H - 1 : y1) / IMAGE_TILE_SIZE;
+        for (int ty = b[1]; ty <= b[3]; ty++) {
+            for (int tx = b[0]; tx <= b[2]; tx++) bin_start[ty * tiles_x + tx + 1]++;
+        }
+    }
+    for (int t = 0; t < tile_count; t++) bin_start[t + 1] += bin_start[t];
+    int *bin_shapes = (int*)cw_arena_alloc(sizeof(int) * (bin_start[tile_count] ? bin_start[tile_count] : 1));
+    size_t *cursor = (size_t*)cw_arena_alloc(sizeof(size_t) * tile_count);
+    if (!bin_shapes || !cursor) return ERROR_MEMORY;
+    memcpy(cursor, bin_start, sizeof(size_t) * tile_count);
+    for (int s = 0; s < shapes->shape_count; s++) {
+        const int *b = bounds + 4 * s;
+        for (int ty = b[1]; ty <= b[3]; ty++) {
+            for (int tx = b[0]; tx <= b[2]; tx++) bin_shapes[cursor[ty * tiles_x + tx]++] = s;
+        }
+    }
+
+    raster.tiles_x = tiles_x;
+    raster.bin_start = bin_start;
+    raster.bin_shapes = bin_shapes;
+    ThreadPool *pool = threads > 1 ? cw_thread_pool_create(threads) : NULL;
+    cw_thread_pool_run(pool, tile_count, shape_raster_tile, &raster);
+    cw_thread_pool_destroy(pool);
+    return atomic_load(&raster.failed) ? ERROR_MEMORY : ERROR_SUCCESS;
+}
+
+int cw_operation_find_recolor_biggest_rect(Image *image, Rgb old_color, Rgba new_color) {
+    int W = image->width, H = image->height;
+    if (W == 0 || H == 0) return ERROR_SUCCESS;
+
+    /* A translucent colour is blended over the rectangle as it is filled. */
+    PixelValue new_value;
+    if (!image_paint_value(image, new_color, &new_value)) return ERROR_MEMORY;
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    ColorMatch old_match;
+    color_match_init(&old_match, image, old_color);
+
+    int *height_hist = (int*)cw_arena_alloc(sizeof(int) * W); 
+    int *stack = (int*)cw_arena_alloc(sizeof(int) * (W + 1)); 
+    if (!height_hist || !stack) {fprintf(stderr, "Memory allocation failed for histogram height_hist\n"); return ERROR_MEMORY;}
+    memset(height_hist, 0, sizeof(int) * W);
+    
+    unsigned long long max_area = 0;
+    Point best_top_left = {0,0};
+    Point best_bottom_right = {-1,-1}; 
+
+    for (int r = 0; r < H; ++r) {
+        for (int x = 0; x < W;) {
+            int count = image_run_length(image, x, W - 1);
+            format->match_histogram(image_pixel(image, x, r), count, &old_match, height_hist + x);
+            x += count;
+        }
+
+        int top = -1; 
+
+        for (int c_hist = 0; c_hist <= W; ++c_hist) {
+            int current_h_bar = (c_hist == W) ? 0 : height_hist[c_hist]; 
+            while (top != -1 && height_hist[stack[top]] >= current_h_bar) {
+                int h_bar = height_hist[stack[top--]];
+                int w_bar = (top == -1) ? c_hist : (c_hist - stack[top] - 1);
+                unsigned long long area = (unsigned long long)h_bar * (unsigned long long)w_bar;
+                if (area > max_area) {
+                    max_area = area;
+                    best_top_left.x = (top == -1) ? 0 : stack[top] + 1;
+                    best_top_left.y = r - h_bar + 1;
+                    best_bottom_right.x = c_hist - 1;
+                    best_bottom_right.y = r;
+                }
+            }
+            stack[++top] = c_hist;
+        }
+    }
+
+    if (max_area > 0) {
+        for (int y = best_top_left.y; y <= best_bottom_right.y; ++y) {
+            fill_span_safe(image, y, best_top_left.x, best_bottom_right.x, &new_value);
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+
+/* Row segment still to be scanned by the flood fill. */
+typedef struct {
+    int y, x0, x1;
+} FloodSpan;
+
+static inline bool flood_visited(const uint64_t *visited, size_t index) {
+    return visited[index >> 6] >> (index & 63) & 1;
+}
+
+/* First index in [index, end] not yet visited, or end + 1; skips whole
+ * words of the bitmap, since rows are queued again from the row they were
+ * reached from. */
+static inline size_t flood_next_unvisited(const uint64_t *visited, size_t index, size_t end) {
+    while (index <= end) {
+        uint64_t free_bits = ~visited[index >> 6] >> (index & 63);
+        if (free_bits) return index + (size_t)__builtin_ctzll(free_bits);
+        index = (index | 63) + 1;
+    }
+    return end + 1;
+}
+
+/* --flood_fill: recolours the 4-connected region of pixels with the seed's
+ * exact colour. Scanline fill: every segment taken from the stack is
+ * widened to whole runs of the colour, each run is painted once and the
+ * rows above and below it are queued. A visited bitmap stops the fill
+ * when the new colour still matches (same colour, or translucent). */
+int cw_operation_flood_fill(Image *image, Point seed, Rgba new_color) {
+    int W = image->width, H = image->height;
+    if (seed.x < 0 || seed.y < 0 || seed.x >= W || seed.y >= H) {
+        fprintf(stderr, "Error: Seed %d.%d is outside the %dx%d image.\n", seed.x, seed.y, W, H);
+        return ERROR_ARG;
+    }
+    /* Resolved first: a translucent colour converts a palette image. */
+    PixelValue new_value;
+    if (!image_paint_value(image, new_color, &new_value)) return ERROR_MEMORY;
+    ColorMatch match;
+    color_match_at(&match, image, seed.x, seed.y);
+
+    uint64_t *visited = (uint64_t*)calloc(((size_t)W * H + 63) / 64, sizeof(uint64_t));
+    size_t capacity = 256, count = 0;
+    FloodSpan *stack = (FloodSpan*)malloc(sizeof(FloodSpan) * capacity);
+    int status = visited && stack ? ERROR_SUCCESS : ERROR_MEMORY;
+    if (stack) stack[count++] = (FloodSpan){seed.y, seed.x, seed.x};
+    while (status == ERROR_SUCCESS && count > 0) {
+        FloodSpan span = stack[--count];
+        size_t row = (size_t)span.y * W;
+        for (int x = span.x0; x <= span.x1; x++) {
+            x = (int)(flood_next_unvisited(visited, row + x, row + span.x1) - row);
+            if (x > span.x1 || !color_match_pixel(image, &match, x, span.y)) continue;
+            int left = x, right = x;
+            while (left > 0 && !flood_visited(visited, row + left - 1) && color_match_pixel(image, &match, left - 1, span.y)) left--;
+            while (right + 1 < W && !flood_visited(visited, row + right + 1) && color_match_pixel(image, &match, right + 1, span.y)) right++;
+            for (size_t i = row + left; i <= row + right; i++) visited[i >> 6] |= 1ULL << (i & 63);
+            fill_span_safe(image, span.y, left, right, &new_value);
+            if (count + 2 > capacity) {
+                FloodSpan *grown = (FloodSpan*)realloc(stack, sizeof(FloodSpan) * capacity * 2);
+                if (!grown) {
+                    status = ERROR_MEMORY;
+                    break;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            if (span.y > 0) stack[count++] = (FloodSpan){span.y - 1, left, right};
+            if (span.y + 1 < H) stack[count++] = (FloodSpan){span.y + 1, left, right};
+            x = right;
+        }
+    }
+    if (status == ERROR_MEMORY) fprintf(stderr, "Memory allocation failed for flood fill\n");
+    free(visited);
+    free(stack);
+    return status;
+}
+
+/* Horizontal run of matching pixels. Runs of one component form a
+ * union-find tree whose root is the component's first run in raster order,
+ * so the labelling does not depend on how the rows were split. */
+typedef struct {
+    int x0, x1;
+    size_t parent;
+} BlobRun;
+
+static size_t blob_find(BlobRun *runs, size_t i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+static void blob_union(BlobRun *runs, size_t a, size_t b) {
+    a = blob_find(runs, a);
+    b = blob_find(runs, b);
+    if (a < b) runs[b].parent = a;
+    else if (b < a) runs[a].parent = b;
+}
+
+/* Joins the runs [a, a_end) of one row with the 4-connected runs
+ * [b, b_end) of the row below; both lists are sorted by x. */
+static void blob_union_rows(BlobRun *runs, size_t a, size_t a_end, size_t b, size_t b_end) {
+    while (a < a_end && b < b_end) {
+        if (runs[a].x0 <= runs[b].x1 && runs[b].x0 <= runs[a].x1) blob_union(runs, a, b);
+        if (runs[a].x1 < runs[b].x1) a++;
+        else b++;
+    }
+}
+
+/* Labelling of horizontal strips of rows, one task each: every strip
+ * collects its runs and joins them on its own, with indices local to the
+ * strip; row_start[y] is the first run of row y within its strip. */
+typedef struct {
+    const Image *image;
+    const ColorMatch *match;
+    int strip_rows;
+    size_t *row_start;
+    BlobRun **strip_runs;
+    size_t *strip_count;
+    atomic_bool failed;
+} BlobLabel;
+
+static void blob_label_strip(void *ctx, int strip) {
+    BlobLabel *label = (BlobLabel*)ctx;
+    const Image *image = label->image;
+    int W = image->width;
+    int y0 = strip * label->strip_rows;
+    int y1 = y0 + label->strip_rows < image->height ? y0 + label->strip_rows : image->height;
+    unsigned char *flags = (unsigned char*)malloc(W);
+    size_t capacity = (size_t)W, count = 0;
+    BlobRun *runs = (BlobRun*)malloc(sizeof(BlobRun) * capacity);
+    bool ok = flags && runs;
+    size_t previous = 0;
+    for (int y = y0; ok && y < y1; y++) {
+        image_match_span(image, y, 0, W - 1, label->match, flags);
+        size_t first = count;
+        label->row_start[y] = first;
+        for (int x = 0; x < W; x++) {
+            if (!flags[x]) continue;
+            int start = x;
+            while (x + 1 < W && flags[x + 1]) x++;
+            if (count == capacity) {
+                BlobRun *grown = (BlobRun*)realloc(runs, sizeof(BlobRun) * capacity * 2);
+                if (!grown) {
+                    ok = false;
+                    break;
+                }
+                runs = grown;
+                capacity *= 2;
+            }
+            runs[count] = (BlobRun){start, x, count};
+            count++;
+        }
+        if (ok && y > y0) blob_union_rows(runs, previous, first, first, count);
+        previous = first;
+    }
+    free(flags);
+    if (!ok) {
+        free(runs);
+        runs = NULL;
+        atomic_store(&label->failed, true);
+    }
+    label->strip_runs[strip] = runs;
+    label->strip_count[strip] = count;
+}
+
+/* --biggest_blob: recolours the largest 4-connected region of old_color
+ * (the first in raster order on a tie). Rows are labelled in parallel
+ * strips by run-based union-find; the strips are then concatenated and
+ * joined across each boundary row pair, component sizes are summed at the
+ * roots and the winning component's runs are painted. */
+int cw_operation_recolor_biggest_blob(Image *image, Rgb old_color, Rgba new_color, int threads) {
+    int W = image->width, H = image->height;
+    if (W == 0 || H == 0) return ERROR_SUCCESS;
+
+    PixelValue new_value;
+    if (!image_paint_value(image, new_color, &new_value)) return ERROR_MEMORY;
+    ColorMatch match;
+    color_match_init(&match, image, old_color);
+
+    int strip_rows = (H + threads - 1) / threads;
+    if (strip_rows < IMAGE_TILE_SIZE) strip_rows = IMAGE_TILE_SIZE;
+    int strips = (H + strip_rows - 1) / strip_rows;
+    size_t *row_start = (size_t*)cw_arena_alloc(sizeof(size_t) * (H + 1));
+    BlobRun **strip_runs = (BlobRun**)cw_arena_alloc(sizeof(BlobRun*) * strips);
+    size_t *strip_count = (size_t*)cw_arena_alloc(sizeof(size_t) * strips);
+    if (!row_start || !strip_runs || !strip_count) return ERROR_MEMORY;
+    BlobLabel label = {.image = image, .match = &match, .strip_rows = strip_rows, .row_start = row_start,
+                       .strip_runs = strip_runs, .strip_count = strip_count};
+    atomic_init(&label.failed, false);
+    ThreadPool *pool = strips > 1 ? cw_thread_pool_create(threads) : NULL;
+    cw_thread_pool_run(pool, strips, blob_label_strip, &label);
+    cw_thread_pool_destroy(pool);
+
+    size_t total = 0;
+    for (int s = 0; s < strips; s++) total += strip_count[s];
+    BlobRun *runs = atomic_load(&label.failed) ? NULL : (BlobRun*)malloc(sizeof(BlobRun) * (total ? total : 1));
+    unsigned long long *area = runs ? (unsigned long long*)calloc(total ? total : 1, sizeof(unsigned long long)) : NULL;
+    int status = area ? ERROR_SUCCESS : ERROR_MEMORY;
+    if (status == ERROR_SUCCESS) {
+        size_t base = 0;
+        for (int s = 0; s < strips; s++) {
+            for (size_t i = 0; i < strip_count[s]; i++) {
+                runs[base + i] = strip_runs[s][i];
+                runs[base + i].parent += base;
+            }
+            int y_end = (s + 1) * strip_rows < H ? (s + 1) * strip_rows : H;
+            for (int y = s * strip_rows; y < y_end; y++) row_start[y] += base;
+            base += strip_count[s];
+        }
+        row_start[H] = total;
+        for (int s = 1; s < strips; s++) {
+            int y = s * strip_rows;
+            blob_union_rows(runs, row_start[y - 1], row_start[y], row_start[y], row_start[y + 1]);
+        }
+
+        size_t best = 0;
+        unsigned long long best_area = 0;
+        for (size_t i = 0; i < total; i++) {
+            size_t root = blob_find(runs, i);
+            area[root] += (unsigned long long)(runs[i].x1 - runs[i].x0 + 1);
+            if (area[root] > best_area || (area[root] == best_area && root < best)) {
+                best = root;
+                best_area = area[root];
+            }
+        }
+        for (int y = 0; best_area > 0 && y < H; y++) {
+            for (size_t i = row_start[y]; i < row_start[y + 1]; i++) {
+                if (blob_find(runs, i) == best) fill_span_safe(image, y, runs[i].x0, runs[i].x1, &new_value);
+            }
+        }
+    } else {
+        fprintf(stderr, "Memory allocation failed for connected components\n");
+    }
+    for (int s = 0; s < strips; s++) free(strip_runs[s]);
+    free(runs);
+    free(area);
+    return status;
+}
+
+
+/* Tiles the image N_x by M_y times into *result. ERROR_ARG when the
+ * collage would be empty or wider or taller than INT_MAX pixels. */
+int cw_operation_create_collage(Image *original, int N_x, int M_y, Image **result) {
+    long long new_W = (long long)original->width * N_x;
+    long long new_H = (long long)original->height * M_y;
+    if (new_W <= 0 || new_H <= 0 || new_W > INT_MAX || new_H > INT_MAX) {
+        fprintf(stderr, "Error: A %lldx%lld collage is out of range.\n", new_W, new_H);
+        return ERROR_ARG;
+    }
+
+    Image *collage = cw_image_create((int)new_W, (int)new_H, original->format);
+    if (!collage) {
+        fprintf(stderr, "Memory for collage rows failed\n");
+        return ERROR_MEMORY;
+    }
+    image_copy_palette(collage, original);
+
+    size_t tile_row_bytes = (size_t)original->width * original->bpp;
+    for (int tile_m = 0; tile_m < M_y; ++tile_m) { 
+        for (int y_in_tile = 0; y_in_tile < original->height; ++y_in_tile) {
+            const unsigned char *src = image_row(original, y_in_tile);
+            unsigned char *dst = image_row(collage, tile_m * original->height + y_in_tile);
+            for (int tile_n = 0; tile_n < N_x; ++tile_n) { 
+                memcpy(dst + tile_n * tile_row_bytes, src, tile_row_bytes);
+            }
+        }
+    }
+    *result = collage;
+    return ERROR_SUCCESS;
+}
+
+
+/* Clips the inclusive rectangle spanned by two corners to a width x height
+ * image; returns false when nothing is left. */
+static bool clip_region(int width, int height, Point a, Point b, int *x0, int *y0, int *x1, int *y1) {
+    *x0 = a.x < b.x ? a.x : b.x;
+    *x1 = a.x < b.x ? b.x : a.x;
+    *y0 = a.y < b.y ? a.y : b.y;
+    *y1 = a.y < b.y ? b.y : a.y;
+    if (*x0 < 0) *x0 = 0;
+    if (*y0 < 0) *y0 = 0;
+    if (*x1 >= width) *x1 = width - 1;
+    if (*y1 >= height) *y1 = height - 1;
+    return *x0 <= *x1 && *y0 <= *y1;
+}
+
+typedef unsigned char v16qu __attribute__((vector_size(16)));
+
+/* XORs a span of `bytes` bytes with a 16-byte mask. Every pixel size whose
+ * mask is not all ones (4 and 8 bytes) divides 16, so the mask lines up
+ * with pixels in every vector. */
+static void xor_span(unsigned char *p, size_t bytes, v16qu mask) {
+    size_t i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        v16qu v;
+        memcpy(&v, p + i, 16);
+        v ^= mask;
+        memcpy(p + i, &v, 16);
+    }
+    for (; i < bytes; i++) p[i] ^= mask[i % 16];
+}
+
+static inline unsigned char luma8(int r, int g, int b) {
+    return (unsigned char)((77 * r + 150 * g + 29 * b + 128) >> 8);
+}
+
+static inline unsigned short luma16(unsigned r, unsigned g, unsigned b) {
+    return (unsigned short)(((uint64_t)19595 * r + (uint64_t)38470 * g + (uint64_t)7471 * b + 32768) >> 16);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+
+/* 16 pixels of a packed 3-byte layout per iteration: pshufb splits the 48
+ * bytes into three channel vectors, the weighted sum runs in 16-bit lanes
+ * and the result is shuffled back to three equal samples per pixel.
+ * w0..w2 are the weights of the channels in memory order. */
+__attribute__((target("ssse3")))
+static int gray_span_3x8_ssse3(unsigned char *p, int count, int w0, int w1, int w2) {
+    const __m128i gather[3][3] = {
+        {_mm_setr_epi8(0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 1, 4, 7, 10, 13)},
+        {_mm_setr_epi8(1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14)},
+        {_mm_setr_epi8(2, 5, 8, 11, 14, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128),
+         _mm_setr_epi8(-128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15)},
+    };
+    const __m128i scatter[3] = {
+        _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5),
+        _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10),
+        _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15),
+    };
+    const __m128i weights[3] = {_mm_set1_epi16(w0), _mm_set1_epi16(w1), _mm_set1_epi16(w2)};
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i zero = _mm_setzero_si128();
+
+    int done = 0;
+    for (; done + 16 <= count; done += 16, p += 48) {
+        __m128i in[3] = {
+            _mm_loadu_si128((const __m128i*)p),
+            _mm_loadu_si128((const __m128i*)(p + 16)),
+            _mm_loadu_si128((const __m128i*)(p + 32)),
+        };
+        __m128i sum_lo = round, sum_hi = round;
+        for (int c = 0; c < 3; c++) {
+            __m128i ch = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(in[0], gather[c][0]),
+                                                   _mm_shuffle_epi8(in[1], gather[c][1])),
+                                      _mm_shuffle_epi8(in[2], gather[c][2]));
+            sum_lo = _mm_add_epi16(sum_lo, _mm_mullo_epi16(_mm_unpacklo_epi8(ch, zero), weights[c]));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_mullo_epi16(_mm_unpackhi_epi8(ch, zero), weights[c]));
+        }
+        __m128i y = _mm_packus_epi16(_mm_srli_epi16(sum_lo, 8), _mm_srli_epi16(sum_hi, 8));
+        for (int j = 0; j < 3; j++) {
+            _mm_storeu_si128((__m128i*)(p + 16 * j), _mm_shuffle_epi8(y, scatter[j]));
+        }
+    }
+    return done;
+}
+
+/* 4 RGBA pixels per iteration with plain SSE2: each 32-bit lane holds one
+ * pixel, channels are split with shifts and masks, alpha is kept. */
+static int gray_span_rgba8_sse2(unsigned char *p, int count) {
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000u);
+    const __m128i wr = _mm_set1_epi32(77), wg = _mm_set1_epi32(150), wb = _mm_set1_epi32(29);
+    const __m128i round = _mm_set1_epi32(128);
+    int done = 0;
+    for (; done + 4 <= count; done += 4, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i r = _mm_and_si128(v, byte_mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), byte_mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), byte_mask);
+        __m128i y = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(r, wr), _mm_mullo_epi16(g, wg)),
+                                  _mm_add_epi32(_mm_mullo_epi16(b, wb), round));
+        y = _mm_srli_epi32(y, 8);
+        __m128i out = _mm_or_si128(_mm_and_si128(v, alpha_mask),
+                                   _mm_or_si128(y, _mm_or_si128(_mm_slli_epi32(y, 8), _mm_slli_epi32(y, 16))));
+        _mm_storeu_si128((__m128i*)p, out);
+    }
+    return done;
+}
+
+static bool cpu_has_ssse3(void) {
+    static atomic_int cached = -1;
+    int value = atomic_load_explicit(&cached, memory_order_relaxed);
+    if (value < 0) {
+        value = __builtin_cpu_supports("ssse3") ? 1 : 0;
+        atomic_store_explicit(&cached, value, memory_order_relaxed);
+    }
+    return value == 1;
+}
+#endif
+
+/* Converts `count` pixels starting at p to gray in place (direct formats). */
+static void gray_span(enum PixelFormat format, unsigned char *p, int count) {
+    int done = 0;
+    switch (format) {
+        case PIXEL_RGB8:
+        case PIXEL_BGR8: {
+            int wr = 77, wb = 29;
+            if (format == PIXEL_BGR8) { wr = 29; wb = 77; }
+#if defined(__x86_64__) || defined(__i386__)
+            if (cpu_has_ssse3()) done = gray_span_3x8_ssse3(p, count, wr, 150, wb);
+#endif
+            for (unsigned char *px = p + done * 3; done < count; done++, px += 3) {
+                unsigned char y = (unsigned char)((wr * px[0] + 150 * px[1] + wb * px[2] + 128) >> 8);
+                px[0] = px[1] = px[2] = y;
+            }
+            break;
+        }
+        case PIXEL_RGBA8:
+#if defined(__x86_64__) || defined(__i386__)
+            done = gray_span_rgba8_sse2(p, count);
+#endif
+            for (unsigned char *px = p + done * 4; done < count; done++, px += 4) {
+                px[0] = px[1] = px[2] = luma8(px[0], px[1], px[2]);
+            }
+            break;
+        case PIXEL_RGB16:
+        case PIXEL_RGBA16: {
+            int bpp = cw_pixel_format_info(format)->bytes_per_pixel;
+            for (unsigned char *px = p; done < count; done++, px += bpp) {
+                unsigned short y = luma16((px[0] << 8) | px[1], (px[2] << 8) | px[3], (px[4] << 8) | px[5]);
+                px[0] = px[2] = px[4] = (unsigned char)(y >> 8);
+                px[1] = px[3] = px[5] = (unsigned char)(y & 0xff);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* Palette images are edited through a 256-entry index remap: the colours
+ * used inside the region are transformed once and looked up (or added) in
+ * the palette. Returns false when the palette cannot hold the new colours;
+ * the caller then expands the image and uses the direct-colour path. */
+static bool remap_palette_region(Image *image, int x0, int y0, int x1, int y1, bool gray) {
+    bool used[256] = {false};
+    for (int y = y0; y <= y1; y++) {
+        const unsigned char *row = image_row(image, y);
+        for (int x = x0; x <= x1; x++) used[row[x]] = true;
+    }
+
+    Image saved_palette;
+    image_copy_palette(&saved_palette, image);
+    unsigned char remap[256];
+    for (int i = 0; i < 256; i++) {
+        remap[i] = (unsigned char)i;
+        if (!used[i] || i >= saved_palette.palette_size) continue;
+        Rgb c = saved_palette.palette[i];
+        if (gray) {
+            c.r = c.g = c.b = luma8(c.r, c.g, c.b);
+        } else {
+            c.r ^= 0xff; c.g ^= 0xff; c.b ^= 0xff;
+        }
+        int index = palette_find_or_add(image, c, saved_palette.palette_alpha[i]);
+        if (index < 0) {
+            image_copy_palette(image, &saved_palette);
+            return false;
+        }
+        remap[i] = (unsigned char)index;
+    }
+
+    for (int y = y0; y <= y1; y++) {
+        unsigned char *row = image_row(image, y);
+        for (int x = x0; x <= x1; x++) row[x] = remap[row[x]];
+    }
+    return true;
+}
+
+int cw_operation_invert_region(Image *image, Point left_up, Point right_down) {
+    int x0, y0, x1, y1;
+    if (!clip_region(image->width, image->height, left_up, right_down, &x0, &y0, &x1, &y1)) return ERROR_SUCCESS;
+    if (image->format == PIXEL_PAL8) {
+        if (remap_palette_region(image, x0, y0, x1, y1, false)) return ERROR_SUCCESS;
+        if (!image_expand_palette(image)) return ERROR_MEMORY;
+    }
+
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    v16qu mask;
+    for (int i = 0; i < 16; i++) mask[i] = (i % format->bytes_per_pixel) < format->color_bytes ? 0xff : 0x00;
+    size_t span_bytes = (size_t)(x1 - x0 + 1) * image->bpp;
+    for (int y = y0; y <= y1; y++) {
+        xor_span(image_row(image, y) + (size_t)x0 * image->bpp, span_bytes, mask);
+    }
+    return ERROR_SUCCESS;
+}
+
+int cw_operation_grayscale_region(Image *image, Point left_up, Point right_down) {
+    int x0, y0, x1, y1;
+    if (!clip_region(image->width, image->height, left_up, right_down, &x0, &y0, &x1, &y1)) return ERROR_SUCCESS;
+    if (image->format == PIXEL_PAL8) {
+        if (remap_palette_region(image, x0, y0, x1, y1, true)) return ERROR_SUCCESS;
+        if (!image_expand_palette(image)) return ERROR_MEMORY;
+    }
+
+    for (int y = y0; y <= y1; y++) {
+        gray_span(image->format, image_row(image, y) + (size_t)x0 * image->bpp, x1 - x0 + 1);
+    }
+    return ERROR_SUCCESS;
+}
+
+static inline uint64_t* region_cell(const RegionTable *table, int x, int y) {
+    return table->sums + ((size_t)y * (table->width + 1) + x) * table->planes;
+}
+
+typedef struct {
+    RegionTable *table;
+    const Image *image;
+    const ColorMatch *matches;
+    int strip_rows;
+    const uint64_t *carry;
+    atomic_bool failed;
+} RegionBuild;
+
+/* Fills grid row y + 1 from image row y. The first row of a strip starts
+ * from zero rather than from the row above, which another strip owns; the
+ * carry pass adds those sums afterwards. */
+static void region_table_row(RegionTable *table, const Image *image, const ColorMatch *matches, int y, bool strip_start,
+                             unsigned char *scratch, unsigned char *flags) {
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    const unsigned char *row = image_read_row(image, y, scratch);
+    int W = table->width, channels = table->channels, planes = table->planes;
+    for (int c = 0; c < table->color_count; c++) format->match_flags(row, W, &matches[c], flags + (size_t)c * W);
+
+    int step = format->bit_depth / 8;
+    int offset[4] = {0, step, 2 * step, 3 * step};
+    if (format->bgr_order) {
+        offset[0] = 2 * step;
+        offset[2] = 0;
+    }
+    uint64_t run[4 + REGION_MAX_COLORS] = {0};
+    uint64_t *cell = region_cell(table, 0, y + 1);
+    const uint64_t *above = region_cell(table, 0, y);
+    memset(cell, 0, sizeof(uint64_t) * planes);
+    for (int x = 0; x < W; x++) {
+        if (image->format == PIXEL_PAL8) {
+            const Rgb *entry = &image->palette[row[x]];
+            run[0] += entry->r;
+            run[1] += entry->g;
+            run[2] += entry->b;
+            if (channels == 4) run[3] += image->palette_alpha[row[x]];
+        } else {
+            const unsigned char *px = row + (size_t)x * image->bpp;
+            for (int p = 0; p < channels; p++) {
+                run[p] += step == 1 ? px[offset[p]] : (unsigned)px[offset[p]] << 8 | px[offset[p] + 1];
+            }
+        }
+        for (int c = 0; c < table->color_count; c++) run[channels + c] += flags[(size_t)c * W + x];
+        cell += planes;
+        above += planes;
+        for (int p = 0; p < planes; p++) cell[p] = (strip_start ? 0 : above[p]) + run[p];
+    }
+}
+
+static void region_build_strip(void *ctx, int strip) {
+    RegionBuild *build = (RegionBuild*)ctx;
+    RegionTable *table = build->table;
+    const Image *image = build->image;
+    int y0 = strip * build->strip_rows;
+    int y1 = y0 + build->strip_rows < table->height ? y0 + build->strip_rows : table->height;
+    unsigned char *scratch = image->tiled ? (unsigned char*)malloc((size_t)table->width * image->bpp) : NULL;
+    unsigned char *flags = (unsigned char*)malloc((size_t)table->width * table->color_count + 1);
+    if ((image->tiled && !scratch) || !flags) {
+        atomic_store(&build->failed, true);
+    } else {
+        for (int y = y0; y < y1; y++) region_table_row(table, image, build->matches, y, y == y0, scratch, flags);
+    }
+    free(scratch);
+    free(flags);
+}
+
+/* Adds the column sums of everything above a strip to each of its rows. */
+static void region_carry_strip(void *ctx, int strip) {
+    RegionBuild *build = (RegionBuild*)ctx;
+    RegionTable *table = build->table;
+    if (strip == 0) return;
+    size_t row_values = (size_t)(table->width + 1) * table->planes;
+    const uint64_t *carry = build->carry + (size_t)(strip - 1) * row_values;
+    int y0 = strip * build->strip_rows;
+    int y1 = y0 + build->strip_rows < table->height ? y0 + build->strip_rows : table->height;
+    for (int y = y0 + 1; y <= y1; y++) {
+        uint64_t *cell = region_cell(table, 0, y);
+        for (size_t i = 0; i < row_values; i++) cell[i] += carry[i];
+    }
+}
+
+/* Builds the summed-area tables of an image (--region_stats), tracking the
+ * pixels of up to REGION_MAX_COLORS colours. Strips of rows are summed on
+ * the thread pool as if each started the image; the last row of every
+ * strip then gives the carry added to the strips below it. */
+static RegionTable* region_table_build(const Image *image, const Rgb *colors, int color_count, int threads) {
+    RegionTable *table = (RegionTable*)calloc(1, sizeof(RegionTable));
+    if (!table) {
+        fprintf(stderr, "Memory allocation failed for region table\n");
+        return NULL;
+    }
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    bool has_alpha = format->has_alpha;
+    for (int i = 0; image->format == PIXEL_PAL8 && i < image->palette_size; i++) {
+        if (image->palette_alpha[i] != 255) has_alpha = true;
+    }
+    int W = image->width, H = image->height;
+    table->width = W;
+    table->height = H;
+    table->channels = has_alpha ? 4 : 3;
+    table->color_count = color_count;
+    table->planes = table->channels + color_count;
+    table->sample_max = format->bit_depth == 16 ? 65535 : 255;
+    size_t row_values = (size_t)(W + 1) * table->planes;
+    if ((size_t)(W + 1) * (H + 1) <= SIZE_MAX / sizeof(uint64_t) / table->planes) {
+        table->sums = (uint64_t*)pixels_alloc(row_values * (H + 1) * sizeof(uint64_t), false, &table->mapping_size);
+    }
+    if (!table->sums) {
+        fprintf(stderr, "Memory allocation failed for region table\n");
+        free(table);
+        return NULL;
+    }
+    memset(table->sums, 0, row_values * sizeof(uint64_t));
+
+    ColorMatch matches[REGION_MAX_COLORS];
+    for (int c = 0; c < color_count; c++) color_match_init(&matches[c], image, colors[c]);
+    int strip_rows = (H + threads - 1) / threads;
+    if (strip_rows < IMAGE_TILE_SIZE) strip_rows = IMAGE_TILE_SIZE;
+    int strips = (H + strip_rows - 1) / strip_rows;
+    uint64_t *carry = strips > 1 ? (uint64_t*)malloc(sizeof(uint64_t) * row_values * (strips - 1)) : NULL;
+    RegionBuild build = {.table = table, .image = image, .matches = matches, .strip_rows = strip_rows, .carry = carry};
+    atomic_init(&build.failed, strips > 1 && !carry);
+    ThreadPool *pool = strips > 1 ? cw_thread_pool_create(threads) : NULL;
+    if (!atomic_load(&build.failed)) cw_thread_pool_run(pool, strips, region_build_strip, &build);
+    if (!atomic_load(&build.failed) && strips > 1) {
+        for (int s = 1; s < strips; s++) {
+            uint64_t *dst = carry + (size_t)(s - 1) * row_values;
+            const uint64_t *last = region_cell(table, 0, s * strip_rows);
+            for (size_t i = 0; i < row_values; i++) dst[i] = last[i] + (s > 1 ? dst[i - row_values] : 0);
+        }
+        cw_thread_pool_run(pool, strips, region_carry_strip, &build);
+    }
+    cw_thread_pool_destroy(pool);
+    free(carry);
+    if (atomic_load(&build.failed)) {
+        fprintf(stderr, "Memory allocation failed for region table\n");
+        region_table_free(table);
+        return NULL;
+    }
+    return table;
+}
+
+/* Statistics of the inclusive rectangle spanned by two corners, clipped to
+ * the image, from four cells of the table. Means are scaled to 0-255;
+ * counts (may be NULL) gets one entry per tracked colour. */
+static void region_table_query(const RegionTable *table, Point left_up, Point right_down, RegionStats *stats, unsigned long long *counts) {
+    memset(stats, 0, sizeof(*stats));
+    if (counts) memset(counts, 0, sizeof(*counts) * table->color_count);
+    int x0, y0, x1, y1;
+    if (!clip_region(table->width, table->height, left_up, right_down, &x0, &y0, &x1, &y1)) return;
+    const uint64_t *a = region_cell(table, x0, y0), *b = region_cell(table, x1 + 1, y0);
+    const uint64_t *c = region_cell(table, x0, y1 + 1), *d = region_cell(table, x1 + 1, y1 + 1);
+    uint64_t sum[4 + REGION_MAX_COLORS];
+    for (int p = 0; p < table->planes; p++) sum[p] = d[p] - b[p] - c[p] + a[p];
+    stats->pixels = (unsigned long long)(x1 - x0 + 1) * (unsigned long long)(y1 - y0 + 1);
+    double scale = 255.0 / ((double)stats->pixels * table->sample_max);
+    stats->r = (double)sum[0] * scale;
+    stats->g = (double)sum[1] * scale;
+    stats->b = (double)sum[2] * scale;
+    stats->a = table->channels == 4 ? (double)sum[3] * scale : 255.0;
+    for (int i = 0; counts && i < table->color_count; i++) counts[i] = sum[table->channels + i];
+}
+
+static void region_table_free(RegionTable *table) {
+    if (!table) return;
+    pixels_release((unsigned char*)table->sums, table->mapping_size);
+    free(table);
+}
+
+
+/* Fills `count` pixels with one value. After the first pixel every memcpy
+ * doubles the filled prefix, so long spans run at memcpy (SIMD) speed for
+ * any pixel size. */
+static void fill_pattern(unsigned char *dst, const PixelValue *value, int bpp, size_t count) {
+    if (count == 0) return;
+    size_t total = count * bpp;
+    size_t filled = bpp;
+    memcpy(dst, value->bytes, bpp);
+    while (filled < total) {
+        size_t chunk = filled < total - filled ? filled : total - filled;
+        memcpy(dst + filled, dst, chunk);
+        filled += chunk;
+    }
+}
+
+/* Changes the canvas by the given amount on each side: positive values add
+ * background, negative values crop. Cropping only moves the origin of the
+ * existing rows (same buffer and stride), so a pure crop sets *result to
+ * `image` itself in O(1). Extending allocates the new canvas once, fills
+ * the borders and copies each source row with one memcpy. ERROR_ARG when
+ * the crop removes the whole image or the canvas outgrows INT_MAX, and
+ * ERROR_MEMORY when allocation fails; `image` is unchanged on failure. */
+int cw_operation_resize_canvas(Image *image, int left, int right, int above, int below, Rgb background, Image **result) {
+    long long crop_left = left < 0 ? -(long long)left : 0, crop_right = right < 0 ? -(long long)right : 0;
+    long long crop_above = above < 0 ? -(long long)above : 0, crop_below = below < 0 ? -(long long)below : 0;
+    if (crop_left + crop_right >= image->width || crop_above + crop_below >= image->height) {
+        fprintf(stderr, "Error: Cropping would remove the whole image.\n");
+        return ERROR_ARG;
+    }
+    int ext_left = left > 0 ? left : 0, ext_right = right > 0 ? right : 0;
+    int ext_above = above > 0 ? above : 0, ext_below = below > 0 ? below : 0;
+    long long new_W = image->width - crop_left - crop_right + ext_left + ext_right;
+    long long new_H = image->height - crop_above - crop_below + ext_above + ext_below;
+    if (new_W > INT_MAX || new_H > INT_MAX) {
+        fprintf(stderr, "Error: A %lldx%lld canvas is out of range.\n", new_W, new_H);
+        return ERROR_ARG;
+    }
+
+    Image *extended = NULL;
+    PixelValue fill;
+    if (ext_left + ext_right + ext_above + ext_below > 0) {
+        if (!image_color_value(image, background, &fill)) return ERROR_MEMORY;
+        extended = cw_image_create((int)new_W, (int)new_H, image->format);
+        if (!extended) {
+            fprintf(stderr, "Memory for extended canvas failed\n");
+            return ERROR_MEMORY;
+        }
+    }
+
+    image->data += (ptrdiff_t)crop_above * image->stride + (ptrdiff_t)crop_left * image->bpp;
+    image->width -= (int)(crop_left + crop_right);
+    image->height -= (int)(crop_above + crop_below);
+    if (!extended) {
+        *result = image;
+        return ERROR_SUCCESS;
+    }
+    image_copy_palette(extended, image);
+
+    int bpp = image->bpp;
+    size_t row_bytes = (size_t)image->width * bpp;
+    size_t full_row_bytes = (size_t)extended->width * bpp;
+    const unsigned char *background_row = NULL;
+    for (int y = 0; y < extended->height; y++) {
+        unsigned char *dst = image_row(extended, y);
+        if (y >= ext_above && y < ext_above + image->height) {
+            fill_pattern(dst, &fill, bpp, ext_left);
+            memcpy(dst + (size_t)ext_left * bpp, image_row(image, y - ext_above), row_bytes);
+            fill_pattern(dst + (size_t)ext_left * bpp + row_bytes, &fill, bpp, ext_right);
+        } else if (background_row) {
+            memcpy(dst, background_row, full_row_bytes);
+        } else {
+            fill_pattern(dst, &fill, bpp, extended->width);
+            background_row = dst;
+        }
+    }
+    *result = extended;
+    return ERROR_SUCCESS;
+}
+
+
+#define RESAMPLE_PRECISION 14
+#define RESAMPLE_STRIP_ROWS 32
+/* Largest reduction one filter pass takes on. Past it the footprint spans
+ * so many taps that 14-bit weights round away, so the axis is first
+ * area-averaged down to this many samples per output (see resample_pass). */
+#define RESAMPLE_MAX_FACTOR 8
+
+static double resample_filter_box(double x) {
+    return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double resample_filter_bilinear(double x) {
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double resample_sinc(double x) {
+    if (x == 0.0) return 1.0;
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double resample_filter_lanczos(double x) {
+    return (x > -3.0 && x < 3.0) ? resample_sinc(x) * resample_sinc(x / 3.0) : 0.0;
+}
+
+static const struct {
+    double support;
+    double (*fn)(double);
+} resample_filters[RESAMPLE_FILTER_COUNT] = {
+    [RESAMPLE_BOX]      = {0.5, resample_filter_box},
+    [RESAMPLE_BILINEAR] = {1.0, resample_filter_bilinear},
+    [RESAMPLE_LANCZOS]  = {3.0, resample_filter_lanczos},
+};
+
+static void free_resample_coeffs(ResampleCoeffs *coeffs) {
+    free(coeffs->start);
+    free(coeffs->count);
+    free(coeffs->weights);
+    memset(coeffs, 0, sizeof(ResampleCoeffs));
+}
+
+/* Precomputes, for every output sample, the first input sample, the number
+ * of taps and fixed-point weights that sum to exactly 1 << RESAMPLE_PRECISION.
+ * When downscaling the filter is stretched over the input footprint. */
+static int compute_resample_coeffs(ResampleCoeffs *coeffs, int in_size, int out_size, enum ResampleFilter filter) {
+    memset(coeffs, 0, sizeof(ResampleCoeffs));
+    double scale = (double)in_size / out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double support = resample_filters[filter].support * filter_scale;
+    int taps = (int)ceil(support) * 2 + 1;
+
+    coeffs->in_size = in_size;
+    coeffs->out_size = out_size;
+    coeffs->taps = taps;
+    coeffs->start = (int*)malloc(sizeof(int) * out_size);
+    coeffs->count = (int*)malloc(sizeof(int) * out_size);
+    coeffs->weights = (int16_t*)calloc((size_t)out_size * taps, sizeof(int16_t));
+    double *w = (double*)malloc(sizeof(double) * taps);
+    if (!coeffs->start || !coeffs->count || !coeffs->weights || !w) {
+        fprintf(stderr, "Memory allocation failed for resample coefficients\n");
+        free(w);
+        free_resample_coeffs(coeffs);
+        return 0;
+    }
+
+    for (int o = 0; o < out_size; o++) {
+        double center = (o + 0.5) * scale;
+        int lo = (int)(center - support + 0.5);
+        int hi = (int)(center + support + 0.5);
+        if (lo < 0) lo = 0;
+        if (hi > in_size) hi = in_size;
+        if (hi - lo > taps) hi = lo + taps;
+        if (hi <= lo) {
+            lo = lo < in_size ? lo : in_size - 1;
+            hi = lo + 1;
+        }
+
+        double total = 0.0;
+        for (int i = lo; i < hi; i++) {
+            w[i - lo] = resample_filters[filter].fn((i - center + 0.5) / filter_scale);
+            total += w[i - lo];
+        }
+        int16_t *fixed = coeffs->weights + (size_t)o * taps;
+        int fixed_total = 0, peak = 0;
+        for (int i = 0; i < hi - lo; i++) {
+            double normalized = total != 0.0 ? w[i] / total : (i == 0 ? 1.0 : 0.0);
+            fixed[i] = (int16_t)lround(normalized * (1 << RESAMPLE_PRECISION));
+            fixed_total += fixed[i];
+            if (fixed[i] > fixed[peak]) peak = i;
+        }
+        fixed[peak] += (1 << RESAMPLE_PRECISION) - fixed_total;
+        coeffs->start[o] = lo;
+        coeffs->count[o] = hi - lo;
+    }
+    free(w);
+    return 1;
+}
+
+static inline unsigned char resample_clamp8(int v) {
+    v >>= RESAMPLE_PRECISION;
+    return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline unsigned resample_clamp16(int64_t v) {
+    v >>= RESAMPLE_PRECISION;
+    return (unsigned)(v < 0 ? 0 : (v > 65535 ? 65535 : v));
+}
+
+#if defined(__SSE2__)
+/* Weights k and k + 1 in the two 16-bit halves of every 32-bit lane. */
+static inline __m128i resample_weight_pair(const int16_t *w) {
+    int32_t pair;
+    memcpy(&pair, w, sizeof(pair));
+    return _mm_set1_epi32(pair);
+}
+
+/* Interleaves the channels of two pixels held as 16-bit lanes 0-3 and
+ * `second`-(second + 3) into (a0, b0, a1, b1, ...) for pmaddwd. */
+#define RESAMPLE_PAIR16(v, second) _mm_unpacklo_epi16((v), _mm_srli_si128((v), 2 * (second)))
+
+/* One output row of the horizontal pass for RGBA8 / BGRA8: each step loads
+ * two neighbouring taps with one 8-byte load and weights both with a
+ * single pmaddwd. */
+static void resample_row_h8x4_sse2(const unsigned char *src, unsigned char *dst, const ResampleCoeffs *coeffs) {
+    const __m128i zero = _mm_setzero_si128();
+    for (int o = 0; o < coeffs->out_size; o++) {
+        const int16_t *w = coeffs->weights + (size_t)o * coeffs->taps;
+        const unsigned char *p = src + (size_t)coeffs->start[o] * 4;
+        int n = coeffs->count[o], k = 0;
+        __m128i sum = _mm_set1_epi32(1 << (RESAMPLE_PRECISION - 1));
+        for (; k + 2 <= n; k += 2, p += 8) {
+            __m128i pair = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(RESAMPLE_PAIR16(pair, 4), resample_weight_pair(w + k)));
+        }
+        if (k < n) {
+            int32_t pixel;
+            memcpy(&pixel, p, 4);
+            __m128i single = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(single, _mm_set1_epi32((uint16_t)w[k])));
+        }
+        sum = _mm_srai_epi32(sum, RESAMPLE_PRECISION);
+        int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(sum, sum), zero));
+        memcpy(dst + (size_t)o * 4, &packed, 4);
+    }
+}
+
+/* Same for RGB8 / BGR8. A tap pair is one 8-byte load (two pixels and two
+ * spare bytes) and a single tap a 4-byte load while that stays inside the
+ * row; only the taps at the very end of the row are gathered byte by byte. */
+static void resample_row_h8x3_sse2(const unsigned char *src, unsigned char *dst, const ResampleCoeffs *coeffs) {
+    const __m128i zero = _mm_setzero_si128();
+    const unsigned char *end = src + (size_t)coeffs->in_size * 3;
+    for (int o = 0; o < coeffs->out_size; o++) {
+        const int16_t *w = coeffs->weights + (size_t)o * coeffs->taps;
+        const unsigned char *p = src + (size_t)coeffs->start[o] * 3;
+        int n = coeffs->count[o], k = 0;
+        __m128i sum = _mm_set1_epi32(1 << (RESAMPLE_PRECISION - 1));
+        for (; k + 2 <= n; k += 2, p += 6) {
+            __m128i pair;
+            if (end - p >= 8) {
+                pair = _mm_loadl_epi64((const __m128i*)p);
+            } else {
+                int64_t bytes = 0;
+                memcpy(&bytes, p, 6);
+                pair = _mm_cvtsi64_si128(bytes);
+            }
+            pair = _mm_unpacklo_epi8(pair, zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(RESAMPLE_PAIR16(pair, 3), resample_weight_pair(w + k)));
+        }
+        if (k < n) {
+            int32_t pixel = 0;
+            if (end - p >= 4) memcpy(&pixel, p, 4);
+            else memcpy(&pixel, p, 3);
+            __m128i single = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(pixel), zero), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(single, _mm_set1_epi32((uint16_t)w[k])));
+        }
+        sum = _mm_srai_epi32(sum, RESAMPLE_PRECISION);
+        int32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(sum, sum), zero));
+        memcpy(dst + (size_t)o * 3, &packed, 3);
+    }
+}
 
-void set_pixel_safe(Rgb **pixels, int W, int H, int x, int y, Rgb color) {
-    if (x >= 0 && x < W && y >= 0 && y < H) {
-        pixels[y][x] = color;
+/* One output row of the vertical pass for 8-bit samples, 8 bytes at a
+ * time: bytes of two source rows are interleaved and weighted with pmaddwd.
+ * Returns the number of bytes done; the caller finishes the tail. */
+static size_t resample_col8_sse2(const unsigned char *const *rows, const int16_t *w, int n, unsigned char *dst, size_t bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << (RESAMPLE_PRECISION - 1));
+    size_t x = 0;
+    for (; x + 8 <= bytes; x += 8) {
+        __m128i sum_lo = round, sum_hi = round;
+        int k = 0;
+        for (; k + 2 <= n; k += 2) {
+            __m128i ab = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + x)),
+                                           _mm_loadl_epi64((const __m128i*)(rows[k + 1] + x)));
+            __m128i weights = _mm_set1_epi32((int)((uint16_t)w[k] | ((uint32_t)(uint16_t)w[k + 1] << 16)));
+            sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi8(ab, zero), weights));
+            sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi8(ab, zero), weights));
+        }
+        if (k < n) {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + x)), zero);
+            __m128i weights = _mm_set1_epi32((uint16_t)w[k]);
+            sum_lo = _mm_add_epi32(sum_lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), weights));
+            sum_hi = _mm_add_epi32(sum_hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), weights));
+        }
+        sum_lo = _mm_srai_epi32(sum_lo, RESAMPLE_PRECISION);
+        sum_hi = _mm_srai_epi32(sum_hi, RESAMPLE_PRECISION);
+        _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(_mm_packs_epi32(sum_lo, sum_hi), zero));
     }
+    return x;
 }
+#endif
 
-void draw_thick_dot(Rgb **pixels, int W, int H, int cx, int cy, int thickness, Rgb color) {
-    if (thickness <= 0) return;
-    
-    for (int dy = 0; dy < thickness; ++dy) {
-        for (int dx = 0; dx < thickness; ++dx) {
-            int current_x = cx + dx - (thickness -1 )/2;
-            int current_y = cy + dy - (thickness -1)/2;
-            set_pixel_safe(pixels, W, H, current_x, current_y, color);
+static void resample_row_h(const unsigned char *src, unsigned char *dst, const PixelFormatInfo *format, const ResampleCoeffs *coeffs) {
+    int bpp = format->bytes_per_pixel;
+    if (format->bit_depth == 8) {
+#if defined(__SSE2__)
+        if (bpp == 4) {
+            resample_row_h8x4_sse2(src, dst, coeffs);
+            return;
+        }
+        if (bpp == 3) {
+            resample_row_h8x3_sse2(src, dst, coeffs);
+            return;
+        }
+#endif
+        for (int o = 0; o < coeffs->out_size; o++) {
+            const int16_t *w = coeffs->weights + (size_t)o * coeffs->taps;
+            const unsigned char *p = src + (size_t)coeffs->start[o] * bpp;
+            for (int c = 0; c < bpp; c++) {
+                int sum = 1 << (RESAMPLE_PRECISION - 1);
+                for (int k = 0; k < coeffs->count[o]; k++) sum += w[k] * p[k * bpp + c];
+                dst[(size_t)o * bpp + c] = resample_clamp8(sum);
+            }
+        }
+        return;
+    }
+    for (int o = 0; o < coeffs->out_size; o++) {
+        const int16_t *w = coeffs->weights + (size_t)o * coeffs->taps;
+        const unsigned char *p = src + (size_t)coeffs->start[o] * bpp;
+        for (int c = 0; c < bpp; c += 2) {
+            int64_t sum = 1 << (RESAMPLE_PRECISION - 1);
+            for (int k = 0; k < coeffs->count[o]; k++) sum += (int64_t)w[k] * ((p[k * bpp + c] << 8) | p[k * bpp + c + 1]);
+            unsigned v = resample_clamp16(sum);
+            dst[(size_t)o * bpp + c] = (unsigned char)(v >> 8);
+            dst[(size_t)o * bpp + c + 1] = (unsigned char)(v & 0xff);
         }
     }
 }
 
+static void resample_row_v(const unsigned char *const *rows, const int16_t *w, int n, unsigned char *dst, size_t bytes, int bit_depth) {
+    size_t x = 0;
+    if (bit_depth == 8) {
+#if defined(__SSE2__)
+        x = resample_col8_sse2(rows, w, n, dst, bytes);
+#endif
+        for (; x < bytes; x++) {
+            int sum = 1 << (RESAMPLE_PRECISION - 1);
+            for (int k = 0; k < n; k++) sum += w[k] * rows[k][x];
+            dst[x] = resample_clamp8(sum);
+        }
+        return;
+    }
+    for (; x < bytes; x += 2) {
+        int64_t sum = 1 << (RESAMPLE_PRECISION - 1);
+        for (int k = 0; k < n; k++) sum += (int64_t)w[k] * ((rows[k][x] << 8) | rows[k][x + 1]);
+        unsigned v = resample_clamp16(sum);
+        dst[x] = (unsigned char)(v >> 8);
+        dst[x + 1] = (unsigned char)(v & 0xff);
+    }
+}
 
-void draw_line_thick(Rgb **pixels, int W, int H, Point p1, Point p2, Rgb color, int thickness) {
-    int x1 = p1.x, y1 = p1.y;
-    int x2 = p2.x, y2 = p2.y;
+typedef struct {
+    const Image *src;
+    Image *dst;
+    const ResampleCoeffs *coeffs;
+    int rows;
+    atomic_bool failed;
+} ResampleJob;
 
-    int dx_abs = abs(x2 - x1);
-    int sx = x1 < x2 ? 1 : -1;
-    int dy_abs = abs(y2 - y1); 
-    int sy = y1 < y2 ? 1 : -1;
-    int err = (dx_abs > dy_abs ? dx_abs : -dy_abs) / 2;
-    int e2;
+static void resample_h_strip(void *ctx, int strip) {
+    ResampleJob *job = (ResampleJob*)ctx;
+    const PixelFormatInfo *format = cw_pixel_format_info(job->src->format);
+    int end = (strip + 1) * RESAMPLE_STRIP_ROWS < job->rows ? (strip + 1) * RESAMPLE_STRIP_ROWS : job->rows;
+    for (int y = strip * RESAMPLE_STRIP_ROWS; y < end; y++) {
+        resample_row_h(image_row(job->src, y), image_row(job->dst, y), format, job->coeffs);
+    }
+}
 
-    while (true) {
-        draw_thick_dot(pixels, W, H, x1, y1, thickness, color); 
-        if (x1 == x2 && y1 == y2) break;
-        e2 = err;
-        if (e2 > -dx_abs) { err -= dy_abs; x1 += sx; }
-        if (e2 <  dy_abs) { err += dx_abs; y1 += sy; }
+static void resample_v_strip(void *ctx, int strip) {
+    ResampleJob *job = (ResampleJob*)ctx;
+    const unsigned char **rows = (const unsigned char**)malloc(sizeof(*rows) * job->coeffs->taps);
+    if (!rows) {
+        atomic_store(&job->failed, true);
+        return;
+    }
+    size_t bytes = (size_t)job->dst->width * job->dst->bpp;
+    int bit_depth = cw_pixel_format_info(job->dst->format)->bit_depth;
+    int end = (strip + 1) * RESAMPLE_STRIP_ROWS < job->rows ? (strip + 1) * RESAMPLE_STRIP_ROWS : job->rows;
+    for (int y = strip * RESAMPLE_STRIP_ROWS; y < end; y++) {
+        int n = job->coeffs->count[y];
+        for (int k = 0; k < n; k++) rows[k] = image_row(job->src, job->coeffs->start[y] + k);
+        resample_row_v(rows, job->coeffs->weights + (size_t)y * job->coeffs->taps, n, image_row(job->dst, y), bytes, bit_depth);
     }
+    free(rows);
 }
 
-static inline int edge_function(Point a, Point b, Point c) {
-    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+/* Resamples one axis into a new image, one strip of rows per pool task.
+ * A reduction by 2 * RESAMPLE_MAX_FACTOR or more is first area-averaged to
+ * RESAMPLE_MAX_FACTOR samples per output, which keeps the taps per output
+ * sample bounded. */
+static Image* resample_pass(const Image *src, int out_w, int out_h, enum ResampleFilter filter, bool horizontal, ThreadPool *pool) {
+    int in_size = horizontal ? src->width : src->height, out_size = horizontal ? out_w : out_h;
+    Image *reduced = NULL;
+    if (in_size / out_size >= 2 * RESAMPLE_MAX_FACTOR) {
+        reduced = image_area_reduce_axis(src, out_size * RESAMPLE_MAX_FACTOR, horizontal);
+        if (!reduced) return NULL;
+        src = reduced;
+    }
+    ResampleCoeffs coeffs;
+    Image *dst = NULL;
+    if (compute_resample_coeffs(&coeffs, horizontal ? src->width : src->height, horizontal ? out_w : out_h, filter)) {
+        dst = cw_image_create(out_w, out_h, src->format);
+        if (dst) {
+            ResampleJob job = {.src = src, .dst = dst, .coeffs = &coeffs, .rows = out_h};
+            atomic_init(&job.failed, false);
+            int strips = (out_h + RESAMPLE_STRIP_ROWS - 1) / RESAMPLE_STRIP_ROWS;
+            cw_thread_pool_run(pool, strips, horizontal ? resample_h_strip : resample_v_strip, &job);
+            if (atomic_load(&job.failed)) {
+                image_free(dst);
+                dst = NULL;
+            }
+        }
+        free_resample_coeffs(&coeffs);
+    }
+    image_free(reduced);
+    return dst;
 }
 
-void fill_triangle_half_space(Rgb **pixels, int W, int H, Point v0, Point v1, Point v2, Rgb color) {
-    int minX = v0.x < v1.x ? (v0.x < v2.x ? v0.x : v2.x) : (v1.x < v2.x ? v1.x : v2.x);
-    int minY = v0.y < v1.y ? (v0.y < v2.y ? v0.y : v2.y) : (v1.y < v2.y ? v1.y : v2.y);
-    int maxX = v0.x > v1.x ? (v0.x > v2.x ? v0.x : v2.x) : (v1.x > v2.x ? v1.x : v2.x);
-    int maxY = v0.y > v1.y ? (v0.y > v2.y ? v0.y : v2.y) : (v1.y > v2.y ? v1.y : v2.y);
+/* Separable resampling: a horizontal pass into an intermediate image of
+ * the new width, then a vertical pass; an axis whose size does not change
+ * is skipped. A zero target size keeps the aspect ratio. */
+Image* cw_operation_scale(Image *image, int new_W, int new_H, enum ResampleFilter filter, int threads) {
+    if (new_W <= 0 && new_H <= 0) {
+        fprintf(stderr, "Error: --scale needs a width or a height.\n");
+        return NULL;
+    }
+    if (new_W <= 0) new_W = (int)lround((double)image->width * new_H / image->height);
+    if (new_H <= 0) new_H = (int)lround((double)image->height * new_W / image->width);
+    if (new_W < 1) new_W = 1;
+    if (new_H < 1) new_H = 1;
+    if (new_W == image->width && new_H == image->height) return image;
+    if (!image_expand_palette(image)) return NULL;
 
-    minX = minX < 0 ? 0 : minX;
-    minY = minY < 0 ? 0 : minY;
-    maxX = maxX >= W ? W - 1 : maxX;
-    maxY = maxY >= H ? H - 1 : maxY;
-    
-    Point tv0 = v0, tv1 = v1, tv2 = v2;
-    if (edge_function(v0,v1,v2) < 0) { 
-        tv1 = v2;
-        tv2 = v1;
+    ThreadPool *pool = threads > 1 ? cw_thread_pool_create(threads) : NULL;
+    Image *current = image;
+    if (new_W != image->width) {
+        current = resample_pass(image, new_W, image->height, filter, true, pool);
     }
+    if (current && new_H != image->height) {
+        Image *vertical = resample_pass(current, new_W, new_H, filter, false, pool);
+        if (current != image) image_free(current);
+        current = vertical;
+    }
+    cw_thread_pool_destroy(pool);
+    if (!current) fprintf(stderr, "Memory for scaled image failed\n");
+    return current;
+}
 
-    for (int y = minY; y <= maxY; ++y) {
-        for (int x = minX; x <= maxX; ++x) {
-            Point p = {x, y};
-            int w0 = edge_function(tv1, tv2, p);
-            int w1 = edge_function(tv2, tv0, p);
-            int w2 = edge_function(tv0, tv1, p);
+/* Integer box reduction fed one source row at a time: every output pixel
+ * is the rounded mean of a factor x factor block (smaller at the right and
+ * bottom edges), so only one row of sums is ever held. */
+typedef struct {
+    int in_width, out_width;
+    int channels, sample_bytes, factor;
+    int rows;
+    uint64_t *sums;
+} BoxReducer;
+
+static int box_reducer_init(BoxReducer *box, int in_width, int channels, int sample_bytes, int factor) {
+    box->in_width = in_width;
+    box->out_width = (in_width + factor - 1) / factor;
+    box->channels = channels;
+    box->sample_bytes = sample_bytes;
+    box->factor = factor;
+    box->rows = 0;
+    box->sums = (uint64_t*)cw_arena_alloc(sizeof(uint64_t) * box->out_width * channels);
+    if (box->sums) memset(box->sums, 0, sizeof(uint64_t) * box->out_width * channels);
+    return box->sums != NULL;
+}
 
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                set_pixel_safe(pixels, W, H, x, y, color);
+static void box_reducer_add_row(BoxReducer *box, const unsigned char *row) {
+    int channels = box->channels;
+    for (int ox = 0; ox < box->out_width; ox++) {
+        uint64_t *sum = box->sums + (size_t)ox * channels;
+        int x1 = (ox + 1) * box->factor;
+        if (x1 > box->in_width) x1 = box->in_width;
+        const unsigned char *p = row + (size_t)ox * box->factor * channels * box->sample_bytes;
+        for (int x = ox * box->factor; x < x1; x++) {
+            for (int c = 0; c < channels; c++) {
+                sum[c] += box->sample_bytes == 2 ? (unsigned)((p[0] << 8) | p[1]) : p[0];
+                p += box->sample_bytes;
             }
         }
     }
+    box->rows++;
 }
 
+static void box_reducer_emit(BoxReducer *box, unsigned char *out) {
+    int channels = box->channels;
+    for (int ox = 0; ox < box->out_width; ox++) {
+        int x1 = (ox + 1) * box->factor;
+        if (x1 > box->in_width) x1 = box->in_width;
+        uint64_t count = (uint64_t)(x1 - ox * box->factor) * box->rows;
+        uint64_t *sum = box->sums + (size_t)ox * channels;
+        for (int c = 0; c < channels; c++) {
+            uint64_t v = (sum[c] + count / 2) / count;
+            if (box->sample_bytes == 2) {
+                *out++ = (unsigned char)(v >> 8);
+            }
+            *out++ = (unsigned char)v;
+            sum[c] = 0;
+        }
+    }
+    box->rows = 0;
+}
 
-void operation_draw_triangle(Rgb **pixels, int W, int H, Point p1, Point p2, Point p3, int thickness, Rgb line_color, bool fill, Rgb fill_color) {
-    if (fill) {
-        fill_triangle_half_space(pixels, W, H, p1, p2, p3, fill_color);
+/* Reduces an already decoded image (BMP input, interlaced PNG) with the
+ * same box as the streaming PNG path. */
+Image* cw_image_box_reduce(Image *image, int factor) {
+    if (factor <= 1) return image;
+    if (!image_expand_palette(image)) return NULL;
+    const PixelFormatInfo *info = cw_pixel_format_info(image->format);
+    int sample_bytes = info->bit_depth / 8;
+    int channels = info->bytes_per_pixel / sample_bytes;
+    BoxReducer box;
+    if (!box_reducer_init(&box, image->width, channels, sample_bytes, factor)) {
+        fprintf(stderr, "Memory for box reduction failed\n");
+        return NULL;
     }
-    if (thickness > 0) {
-        draw_line_thick(pixels, W, H, p1, p2, line_color, thickness);
-        draw_line_thick(pixels, W, H, p2, p3, line_color, thickness);
-        draw_line_thick(pixels, W, H, p3, p1, line_color, thickness);
+    Image *dst = cw_image_create(box.out_width, (image->height + factor - 1) / factor, image->format);
+    if (!dst) {
+        fprintf(stderr, "Memory for reduced image failed\n");
+        return NULL;
+    }
+    for (int y = 0; y < image->height; y++) {
+        box_reducer_add_row(&box, image_row(image, y));
+        if (box.rows == factor || y == image->height - 1) box_reducer_emit(&box, image_row(dst, y / factor));
     }
+    return dst;
 }
 
-void operation_find_recolor_biggest_rect(Rgb **pixels, int W, int H, Rgb old_color, Rgb new_color) {
-    if (W == 0 || H == 0) return;
-
-    int *height_hist = (int*)calloc(W, sizeof(int)); 
-    if (!height_hist) {fprintf(stderr, "Memory allocation failed for histogram height_hist\n"); return;}
-    
-    int max_area = 0;
-    Point best_top_left = {0,0};
-    Point best_bottom_right = {-1,-1}; 
+static inline unsigned area_sample(const unsigned char *row, size_t index, int sample_bytes) {
+    return sample_bytes == 2 ? (unsigned)(row[2 * index] << 8 | row[2 * index + 1]) : row[index];
+}
 
-    for (int r = 0; r < H; ++r) {
-        for (int c = 0; c < W; ++c) {
-            if (pixels[r][c].r == old_color.r && pixels[r][c].g == old_color.g && pixels[r][c].b == old_color.b) {
-                height_hist[c]++;
-            } else {
-                height_hist[c] = 0;
-            }
-        }
+static inline void area_store(unsigned char *row, size_t index, int sample_bytes, uint64_t sum, uint64_t total) {
+    uint64_t v = (sum + total / 2) / total;
+    if (sample_bytes == 2) {
+        row[2 * index] = (unsigned char)(v >> 8);
+        row[2 * index + 1] = (unsigned char)v;
+    } else {
+        row[index] = (unsigned char)v;
+    }
+}
 
-        int *stack = (int*)malloc(sizeof(int) * (W + 1)); 
-        if(!stack) {fprintf(stderr, "Memory allocation failed for stack\n"); free(height_hist); return;}
-        int top = -1; 
+/* Area-averages a row-major, non-palette image down to out_size columns
+ * (or rows): output j is the mean over input span [j * in / out,
+ * (j + 1) * in / out), pixels cut by an edge weighted by their overlap.
+ * Positions are kept in units of 1 / (in * out), so the weights are exact
+ * integers for any ratio and the sums fit in 64 bits. */
+static Image* image_area_reduce_axis(const Image *image, int out_size, bool horizontal) {
+    const PixelFormatInfo *info = cw_pixel_format_info(image->format);
+    int sample_bytes = info->bit_depth / 8;
+    int channels = info->bytes_per_pixel / sample_bytes;
+    uint64_t in = horizontal ? image->width : image->height, out = out_size;
+    Image *dst = cw_image_create(horizontal ? out_size : image->width, horizontal ? image->height : out_size, image->format);
+    size_t sum_count = horizontal ? (size_t)channels : (size_t)image->width * channels;
+    uint64_t *sums = dst ? (uint64_t*)cw_arena_alloc(sizeof(uint64_t) * sum_count) : NULL;
+    if (!sums) {
+        image_free(dst);
+        return NULL;
+    }
+    memset(sums, 0, sizeof(uint64_t) * sum_count);
 
-        for (int c_hist = 0; c_hist <= W; ++c_hist) {
-            int current_h_bar = (c_hist == W) ? 0 : height_hist[c_hist]; 
-            while (top != -1 && height_hist[stack[top]] >= current_h_bar) {
-                int h_bar = height_hist[stack[top--]];
-                int w_bar = (top == -1) ? c_hist : (c_hist - stack[top] - 1);
-                if (h_bar * w_bar > max_area) {
-                    max_area = h_bar * w_bar;
-                    best_top_left.x = (top == -1) ? 0 : stack[top] + 1;
-                    best_top_left.y = r - h_bar + 1;
-                    best_bottom_right.x = c_hist - 1;
-                    best_bottom_right.y = r;
+    if (horizontal) {
+        for (int y = 0; y < image->height; y++) {
+            const unsigned char *src = image_row(image, y);
+            unsigned char *row = image_row(dst, y);
+            uint64_t pos = 0;
+            size_t i = 0;
+            for (size_t j = 0; j < out; j++) {
+                uint64_t end = (j + 1) * in;
+                while (pos < end) {
+                    uint64_t pixel_end = (i + 1) * out;
+                    uint64_t stop = pixel_end < end ? pixel_end : end;
+                    for (int c = 0; c < channels; c++) sums[c] += (stop - pos) * area_sample(src, i * channels + c, sample_bytes);
+                    pos = stop;
+                    if (pos == pixel_end) i++;
+                }
+                for (int c = 0; c < channels; c++) {
+                    area_store(row, j * channels + c, sample_bytes, sums[c], in);
+                    sums[c] = 0;
                 }
             }
-            stack[++top] = c_hist;
         }
-        free(stack);
+        return dst;
     }
-    free(height_hist);
-
-    if (max_area > 0) {
-        for (int y = best_top_left.y; y <= best_bottom_right.y; ++y) {
-            for (int x = best_top_left.x; x <= best_bottom_right.x; ++x) {
-                set_pixel_safe(pixels, W, H, x, y, new_color);
+    uint64_t pos = 0;
+    int j = 0;
+    for (uint64_t i = 0; i < in; i++) {
+        const unsigned char *src = image_row(image, (int)i);
+        uint64_t pixel_end = (i + 1) * out;
+        while (pos < pixel_end) {
+            uint64_t end = (uint64_t)(j + 1) * in;
+            uint64_t stop = pixel_end < end ? pixel_end : end;
+            for (size_t k = 0; k < sum_count; k++) sums[k] += (stop - pos) * area_sample(src, k, sample_bytes);
+            pos = stop;
+            if (pos == end) {
+                unsigned char *row = image_row(dst, j++);
+                for (size_t k = 0; k < sum_count; k++) {
+                    area_store(row, k, sample_bytes, sums[k], in);
+                    sums[k] = 0;
+                }
             }
         }
     }
+    return dst;
 }
 
 
-Rgb** operation_create_collage(Rgb **original_pixels, int orig_W, int orig_H, int N_x, int M_y, int* new_W_ptr, int* new_H_ptr) {
-    *new_W_ptr = orig_W * N_x;
-    *new_H_ptr = orig_H * M_y;
+int cw_default_thread_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
 
-    if (*new_W_ptr == 0 || *new_H_ptr == 0) { 
-        *new_W_ptr = 0; *new_H_ptr = 0; return NULL;
+static void thread_pool_drain(ThreadPool *pool) {
+    int index;
+    while ((index = atomic_fetch_add(&pool->next_index, 1)) < pool->task_count) {
+        pool->task(pool->task_ctx, index);
     }
+}
 
-    Rgb** collage_pixels = (Rgb**)malloc(sizeof(Rgb*) * (*new_H_ptr));
-    if (!collage_pixels) {
-        fprintf(stderr, "Memory for collage rows failed\n");
-        *new_W_ptr = 0; *new_H_ptr = 0; return NULL;
-    }
+static void* thread_pool_worker(void *arg) {
+    ThreadPool *pool = (ThreadPool*)arg;
+    unsigned long seen_generation = 0;
 
-    for (int y = 0; y < *new_H_ptr; ++y) {
-        collage_pixels[y] = (Rgb*)malloc(sizeof(Rgb) * (*new_W_ptr));
-        if (!collage_pixels[y]) {
-            fprintf(stderr, "Memory for collage row %d failed\n", y);
-            for (int k=0; k<y; ++k) free(collage_pixels[k]);
-            free(collage_pixels);
-            *new_W_ptr = 0; *new_H_ptr = 0; return NULL;
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->generation == seen_generation) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
         }
+        if (pool->shutdown) break;
+        seen_generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        thread_pool_drain(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0) pthread_cond_signal(&pool->work_done);
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    for (int tile_m = 0; tile_m < M_y; ++tile_m) { 
-        for (int tile_n = 0; tile_n < N_x; ++tile_n) { 
-            for (int y_in_tile = 0; y_in_tile < orig_H; ++y_in_tile) {
-                for (int x_in_tile = 0; x_in_tile < orig_W; ++x_in_tile) {
-                    int target_y = tile_m * orig_H + y_in_tile;
-                    int target_x = tile_n * orig_W + x_in_tile;
-                    collage_pixels[target_y][target_x] = original_pixels[y_in_tile][x_in_tile];
-                }
+/* The calling thread always takes part in cw_thread_pool_run, so a pool of
+ * N threads starts N - 1 workers. */
+ThreadPool* cw_thread_pool_create(int threads) {
+    ThreadPool *pool = (ThreadPool*)calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        fprintf(stderr, "Memory allocation failed for thread pool\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    atomic_init(&pool->next_index, 0);
+
+    if (threads > 1) {
+        pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * (threads - 1));
+        if (!pool->threads) {
+            fprintf(stderr, "Memory allocation failed for thread pool workers\n");
+            cw_thread_pool_destroy(pool);
+            return NULL;
+        }
+        for (int i = 0; i < threads - 1; i++) {
+            if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
+                fprintf(stderr, "Warning: could only start %d worker thread(s).\n", i);
+                break;
             }
+            pool->thread_count++;
         }
     }
-    return collage_pixels;
+    return pool;
 }
 
+void cw_thread_pool_run(ThreadPool *pool, int count, ThreadPoolTask task, void *ctx) {
+    if (count <= 0) return;
+    if (!pool || pool->thread_count == 0 || count == 1) {
+        for (int i = 0; i < count; i++) task(ctx, i);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->task_ctx = ctx;
+    pool->task_count = count;
+    atomic_store(&pool->next_index, 0);
+    pool->busy_workers = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
 
-void read_png_file(const char *filename, struct Png *image) {
-    image->status = ERROR_SUCCESS;
-    image->row_pointers = NULL;
-    image->png_ptr_read = NULL;
-    image->info_ptr_read = NULL;
-    image->original_height_for_row_pointers = 0; 
+    thread_pool_drain(pool);
 
-    png_byte header[8];
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void cw_thread_pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool);
+}
+
+static unsigned long long png_raw_data_size(png_uint_32 width, png_uint_32 height, int bits_per_pixel, int interlace_type) {
+    if (interlace_type != PNG_INTERLACE_ADAM7) {
+        return (unsigned long long)height * (1 + ((unsigned long long)width * bits_per_pixel + 7) / 8);
+    }
+    unsigned long long total = 0;
+    for (int pass = 0; pass < 7; pass++) {
+        png_uint_32 pass_w = PNG_PASS_COLS(width, pass);
+        png_uint_32 pass_h = PNG_PASS_ROWS(height, pass);
+        if (pass_w == 0 || pass_h == 0) continue;
+        total += (unsigned long long)pass_h * (1 + ((unsigned long long)pass_w * bits_per_pixel + 7) / 8);
+    }
+    return total;
+}
+
+static void png_header_count_chunk(struct PngHeader *header, const png_byte type[4], png_uint_32 length) {
+    header->chunk_count++;
+    for (int i = 0; i < header->chunk_type_count; i++) {
+        if (memcmp(header->chunk_types[i].type, type, 4) == 0) {
+            header->chunk_types[i].count++;
+            header->chunk_types[i].bytes += length;
+            return;
+        }
+    }
+    if (header->chunk_type_count < PNG_HEADER_MAX_CHUNK_TYPES) {
+        PngChunkStat *stat = &header->chunk_types[header->chunk_type_count++];
+        memcpy(stat->type, type, 4);
+        stat->type[4] = '\0';
+        stat->count = 1;
+        stat->bytes = length;
+    }
+}
+
+/* Reads only the PNG header (png_read_info) and then walks the chunk list by
+ * seeking over chunk payloads, so IDAT is never inflated and memory use does
+ * not depend on the image size. */
+int cw_read_png_header(const char *filename, struct PngHeader *header) {
+    memset(header, 0, sizeof(struct PngHeader));
+    header->status = ERROR_SUCCESS;
+
+    png_byte sig[8];
     FILE *fp = fopen(filename, "rb");
     if (!fp) {
         fprintf(stderr, "Error: Cannot open file %s for reading.\n", filename);
-        image->status = ERROR_FILE;
-        return;
+        header->status = ERROR_FILE;
+        return header->status;
     }
 
-    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) {
+    if (fread(sig, 1, 8, fp) != 8 || png_sig_cmp(sig, 0, 8)) {
         fprintf(stderr, "Error: %s is not a valid PNG file.\n", filename);
-        image->status = ERROR_PNG_FORMAT;
+        header->status = ERROR_PNG_FORMAT;
+        fclose(fp);
+        return header->status;
+    }
+
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) {
+        fprintf(stderr, "Error: png_create_read_struct failed.\n");
+        header->status = ERROR_MEMORY;
         fclose(fp);
+        return header->status;
+    }
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+        fprintf(stderr, "Error: png_create_info_struct failed.\n");
+        header->status = ERROR_MEMORY;
+        png_destroy_read_struct(&png_ptr, NULL, NULL);
+        fclose(fp);
+        return header->status;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        fprintf(stderr, "Error: libpng error while reading header of %s.\n", filename);
+        header->status = ERROR_PNG_FORMAT;
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        fclose(fp);
+        return header->status;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, 8);
+    png_read_info(png_ptr, info_ptr);
+
+    header->width = png_get_image_width(png_ptr, info_ptr);
+    header->height = png_get_image_height(png_ptr, info_ptr);
+    header->color_type = png_get_color_type(png_ptr, info_ptr);
+    header->bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    header->interlace_type = png_get_interlace_type(png_ptr, info_ptr);
+    header->number_of_passes = header->interlace_type == PNG_INTERLACE_ADAM7 ? 7 : 1;
+    int bits_per_pixel = png_get_channels(png_ptr, info_ptr) * header->bit_depth;
+    header->raw_bytes = png_raw_data_size(header->width, header->height, bits_per_pixel, header->interlace_type);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+    if (fseek(fp, 8, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Cannot seek in %s.\n", filename);
+        header->status = ERROR_FILE;
+        fclose(fp);
+        return header->status;
+    }
+
+    long long offset = 8;
+    png_byte chunk_header[8];
+    bool seen_iend = false;
+    while (!seen_iend && fread(chunk_header, 1, 8, fp) == 8) {
+        png_uint_32 length = png_get_uint_32(chunk_header);
+        if (length > PNG_UINT_31_MAX) {
+            fprintf(stderr, "Error: Invalid chunk length in %s at offset %lld.\n", filename, offset);
+            header->status = ERROR_PNG_FORMAT;
+            break;
+        }
+        png_header_count_chunk(header, chunk_header + 4, length);
+        if (memcmp(chunk_header + 4, "IDAT", 4) == 0) header->idat_bytes += length;
+        if (memcmp(chunk_header + 4, "IEND", 4) == 0) seen_iend = true;
+        offset += 12 + (long long)length;
+        if (fseek(fp, offset, SEEK_SET) != 0) {
+            fprintf(stderr, "Error: Cannot seek in %s.\n", filename);
+            header->status = ERROR_FILE;
+            break;
+        }
+    }
+    if (header->status == ERROR_SUCCESS && !seen_iend) {
+        fprintf(stderr, "Warning: %s has no IEND chunk (file may be truncated).\n", filename);
+    }
+
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        header->file_size = ftell(fp);
+    }
+    fclose(fp);
+    return header->status;
+}
+
+/* libpng I/O over byte buffers: reads walk a fixed source, writes append
+ * to a sink that grows by doubling. Running off either end raises a libpng
+ * error, which lands in the caller's setjmp. */
+typedef struct {
+    const unsigned char *data;
+    size_t size, offset;
+} PngMemorySource;
+
+typedef struct {
+    unsigned char *data;
+    size_t size, capacity;
+} PngMemorySink;
+
+static void png_memory_read(png_structp png_ptr, png_bytep out, png_size_t length) {
+    PngMemorySource *source = (PngMemorySource*)png_get_io_ptr(png_ptr);
+    if (source->size - source->offset < length) png_error(png_ptr, "PNG data ends early");
+    memcpy(out, source->data + source->offset, length);
+    source->offset += length;
+}
+
+static void png_memory_write(png_structp png_ptr, png_bytep in, png_size_t length) {
+    PngMemorySink *sink = (PngMemorySink*)png_get_io_ptr(png_ptr);
+    if (sink->capacity - sink->size < length) {
+        size_t capacity = sink->capacity ? sink->capacity : 4096;
+        while (capacity - sink->size < length) capacity *= 2;
+        unsigned char *grown = (unsigned char*)realloc(sink->data, capacity);
+        if (!grown) png_error(png_ptr, "out of memory for PNG output");
+        sink->data = grown;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + sink->size, in, length);
+    sink->size += length;
+}
+
+static void png_memory_flush(png_structp png_ptr) {
+    (void)png_ptr;
+}
+
+/* Decode-time box reduction by decode_scale: rows are averaged as they
+ * come out of libpng, so a thumbnail never needs the full-size image. */
+static void read_png_reduced(struct Png *image) {
+    int factor = image->decode_scale;
+    int sample_bytes = image->bit_depth / 8;
+    int channels = (int)(image->row_bytes / ((size_t)image->width * sample_bytes));
+    int out_height = (image->height + factor - 1) / factor;
+    bool interlaced = image->number_of_passes > 1;
+
+    BoxReducer box;
+    if (!box_reducer_init(&box, image->width, channels, sample_bytes, factor)) {
+        fprintf(stderr, "Error: Malloc for box reduction failed.\n");
+        image->status = ERROR_MEMORY;
+        return;
+    }
+    size_t out_row_bytes = (size_t)box.out_width * channels * sample_bytes;
+
+    /* Interlaced rows are only final after the last pass, so such images
+     * are decoded whole and reduced in place; otherwise one row is held. */
+    png_bytep row = NULL;
+    if (interlaced) {
+        image->pixels = pixels_alloc(image->row_bytes * image->height, false, &image->pixels_mapping_size);
+        image->row_pointers = (png_bytep*)cw_arena_alloc(sizeof(png_bytep) * image->height);
+    } else {
+        image->pixels = pixels_alloc(out_row_bytes * out_height, false, &image->pixels_mapping_size);
+        row = (png_bytep)cw_arena_alloc(image->row_bytes);
+    }
+    if (!image->pixels || (interlaced ? !image->row_pointers : !row)) {
+        fprintf(stderr, "Error: Malloc for reduced image rows failed.\n");
+        image->status = ERROR_MEMORY;
+        return;
+    }
+
+    if (setjmp(png_jmpbuf(image->png_ptr_read))) {
+        fprintf(stderr, "Error: libpng error during read_image.\n");
+        image->status = ERROR_PNG_FORMAT;
         return;
     }
+    if (interlaced) {
+        for (int y = 0; y < image->height; y++) {
+            image->row_pointers[y] = image->pixels + (size_t)y * image->row_bytes;
+        }
+        png_read_image(image->png_ptr_read, image->row_pointers);
+    }
+    for (int y = 0; y < image->height; y++) {
+        if (!interlaced) png_read_row(image->png_ptr_read, row, NULL);
+        box_reducer_add_row(&box, interlaced ? image->row_pointers[y] : row);
+        if (box.rows == factor || y == image->height - 1) {
+            box_reducer_emit(&box, image->pixels + (size_t)(y / factor) * out_row_bytes);
+        }
+    }
+    image->row_pointers = NULL;
+
+    image->width = box.out_width;
+    image->height = out_height;
+    image->original_height_for_row_pointers = out_height;
+    image->row_bytes = out_row_bytes;
+}
+
+/* Decodes from fp or, when source is set, from memory; the signature has
+ * already been checked by the caller. */
+static void read_png_stream(struct Png *image, FILE *fp, PngMemorySource *source) {
+    image->status = ERROR_SUCCESS;
+    image->row_pointers = NULL;
+    image->pixels = NULL;
+    image->png_ptr_read = NULL;
+    image->info_ptr_read = NULL;
+    image->original_height_for_row_pointers = 0; 
 
     image->png_ptr_read = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!image->png_ptr_read) {
         fprintf(stderr, "Error: png_create_read_struct failed.\n");
         image->status = ERROR_MEMORY;
-        fclose(fp);
         return;
     }
 
@@ -263,7 +3310,6 @@ void read_png_file(const char *filename, struct Png *image) {
         fprintf(stderr, "Error: png_create_info_struct failed.\n");
         image->status = ERROR_MEMORY;
         png_destroy_read_struct(&image->png_ptr_read, NULL, NULL);
-        fclose(fp);
         return;
     }
 
@@ -271,11 +3317,14 @@ void read_png_file(const char *filename, struct Png *image) {
         fprintf(stderr, "Error: libpng error during init_io.\n");
         image->status = ERROR_PNG_FORMAT;
         png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-        fclose(fp);
         return;
     }
 
-    png_init_io(image->png_ptr_read, fp);
+    if (source) {
+        png_set_read_fn(image->png_ptr_read, source, png_memory_read);
+    } else {
+        png_init_io(image->png_ptr_read, fp);
+    }
     png_set_sig_bytes(image->png_ptr_read, 8);
     png_read_info(image->png_ptr_read, image->info_ptr_read);
     
@@ -286,13 +3335,29 @@ void read_png_file(const char *filename, struct Png *image) {
     image->bit_depth = png_get_bit_depth(image->png_ptr_read, image->info_ptr_read);
     image->number_of_passes = png_set_interlace_handling(image->png_ptr_read);
     
-    if (image->bit_depth == 16)
-        png_set_strip_16(image->png_ptr_read);
-    if (image->color_type == PNG_COLOR_TYPE_PALETTE)
+    /* Palette images stay indexed: sub-byte indices are unpacked to one
+     * byte per pixel and PLTE/tRNS are kept as the image palette. Indices
+     * cannot be averaged, so a reduced decode expands them instead. */
+    if (image->color_type == PNG_COLOR_TYPE_PALETTE && image->decode_scale > 1) {
         png_set_palette_to_rgb(image->png_ptr_read);
+    } else if (image->color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_packing(image->png_ptr_read);
+        png_colorp plte = NULL;
+        int plte_size = 0;
+        if (png_get_PLTE(image->png_ptr_read, image->info_ptr_read, &plte, &plte_size) && plte_size <= 256) {
+            image->palette_size = plte_size;
+            memcpy(image->palette, plte, sizeof(png_color) * plte_size);
+        }
+        memset(image->palette_alpha, 255, sizeof(image->palette_alpha));
+        png_bytep trns = NULL;
+        int trns_count = 0;
+        if (png_get_tRNS(image->png_ptr_read, image->info_ptr_read, &trns, &trns_count, NULL) && trns) {
+            memcpy(image->palette_alpha, trns, trns_count < 256 ? trns_count : 256);
+        }
+    }
     if (image->color_type == PNG_COLOR_TYPE_GRAY && image->bit_depth < 8)
         png_set_expand_gray_1_2_4_to_8(image->png_ptr_read);
-    if (png_get_valid(image->png_ptr_read, image->info_ptr_read, PNG_INFO_tRNS))
+    if ((image->color_type != PNG_COLOR_TYPE_PALETTE || image->decode_scale > 1) && png_get_valid(image->png_ptr_read, image->info_ptr_read, PNG_INFO_tRNS))
         png_set_tRNS_to_alpha(image->png_ptr_read);
     if (image->color_type == PNG_COLOR_TYPE_GRAY || image->color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(image->png_ptr_read);
@@ -308,11 +3373,11 @@ void read_png_file(const char *filename, struct Png *image) {
     image->color_type = png_get_color_type(image->png_ptr_read, image->info_ptr_read);
     image->bit_depth = png_get_bit_depth(image->png_ptr_read, image->info_ptr_read);
 
-    if (image->color_type != PNG_COLOR_TYPE_RGB && image->color_type != PNG_COLOR_TYPE_RGB_ALPHA) {
-        fprintf(stderr, "Error: Only RGB and RGBA color types are supported by this program after conversion (got %d).\n", image->color_type);
+    if (image->color_type != PNG_COLOR_TYPE_RGB && image->color_type != PNG_COLOR_TYPE_RGB_ALPHA &&
+        image->color_type != PNG_COLOR_TYPE_PALETTE) {
+        fprintf(stderr, "Error: Only RGB, RGBA and palette color types are supported by this program after conversion (got %d).\n", image->color_type);
         image->status = ERROR_PNG_FORMAT; 
         png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-        fclose(fp);
         return;
     }
 
@@ -320,67 +3385,115 @@ void read_png_file(const char *filename, struct Png *image) {
         image->original_height_for_row_pointers = image->height;
     }
 
-    image->row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image->original_height_for_row_pointers); 
-    if (!image->row_pointers && image->original_height_for_row_pointers > 0) { 
-        fprintf(stderr, "Error: Malloc for row_pointers failed.\n");
+    /* One contiguous buffer in the decoded PNG layout; cw_png_data_to_image
+     * adopts it as the working image without converting. */
+    image->row_bytes = png_get_rowbytes(image->png_ptr_read, image->info_ptr_read);
+    if (image->row_bytes == 0) {
+        fprintf(stderr, "Error: Calculated row bytes is zero.\n");
+        image->status = ERROR_PNG_FORMAT;
+        png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
+        return;
+    }
+    if (image->decode_scale > 1) {
+        read_png_reduced(image);
+        return;
+    }
+    image->pixels = pixels_alloc(image->row_bytes * image->original_height_for_row_pointers, false, &image->pixels_mapping_size);
+    image->row_pointers = (png_bytep*)cw_arena_alloc(sizeof(png_bytep) * image->original_height_for_row_pointers); 
+    if (!image->pixels || !image->row_pointers) { 
+        fprintf(stderr, "Error: Malloc for %d image rows failed.\n", image->original_height_for_row_pointers);
         image->status = ERROR_MEMORY;
+        if (image->pixels) pixels_release(image->pixels, image->pixels_mapping_size);
+        image->pixels = NULL;
+        image->row_pointers = NULL;
         png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-        fclose(fp);
         return;
     } 
 
     for (int y = 0; y < image->original_height_for_row_pointers; y++) { 
-        size_t row_bytes_alloc = png_get_rowbytes(image->png_ptr_read, image->info_ptr_read);
-        if (row_bytes_alloc == 0) {
-             fprintf(stderr, "Error: Calculated row bytes is zero for allocation at row %d.\n", y);
-             image->status = ERROR_PNG_FORMAT;
-             for(int k=0; k<y; ++k) { if(image->row_pointers[k]) free(image->row_pointers[k]); }
-             if(image->row_pointers) { free(image->row_pointers); image->row_pointers = NULL; }
-             png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-             fclose(fp);
-             return;
-        }
-        image->row_pointers[y] = (png_byte*)malloc(row_bytes_alloc);
-        if (!image->row_pointers[y]) {
-            fprintf(stderr, "Error: Malloc for row %d failed.\n", y);
-            image->status = ERROR_MEMORY;
-            for(int k=0; k<y; ++k) { if(image->row_pointers[k]) free(image->row_pointers[k]); }
-            if(image->row_pointers) {
-                free(image->row_pointers); 
-                image->row_pointers = NULL; 
-            }
-            png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-            fclose(fp);
-            return;
-        }
+        image->row_pointers[y] = image->pixels + (size_t)y * image->row_bytes;
     }
 
     if (setjmp(png_jmpbuf(image->png_ptr_read))) {
         fprintf(stderr, "Error: libpng error during read_image.\n");
         image->status = ERROR_PNG_FORMAT;
         png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL); 
-        fclose(fp);
         return;
     }
     if(image->original_height_for_row_pointers > 0) { 
         png_read_image(image->png_ptr_read, image->row_pointers);
     }
-    fclose(fp);
 }
 
-void write_png_file(const char *filename, struct Png *image_props, Rgb **rgb_data) {
-    FILE *fp = fopen(filename, "wb");
+
+void cw_read_png_file(const char *filename, struct Png *image) {
+    image->status = ERROR_SUCCESS;
+    image->png_ptr_read = NULL;
+    image->info_ptr_read = NULL;
+    png_byte header[8];
+    FILE *fp = fopen(filename, "rb");
     if (!fp) {
-        fprintf(stderr, "Error: Cannot open file %s for writing.\n", filename);
-        image_props->status = ERROR_FILE;
+        fprintf(stderr, "Error: Cannot open file %s for reading.\n", filename);
+        image->status = ERROR_FILE;
+        return;
+    }
+
+    if (fread(header, 1, 8, fp) != 8 || png_sig_cmp(header, 0, 8)) {
+        fprintf(stderr, "Error: %s is not a valid PNG file.\n", filename);
+        image->status = ERROR_PNG_FORMAT;
+        fclose(fp);
+        return;
+    }
+    read_png_stream(image, fp, NULL);
+    fclose(fp);
+}
+
+/* Same as cw_read_png_file for a PNG held in memory; the buffer only has to
+ * outlive the call. */
+static void read_png_memory(const unsigned char *data, size_t size, struct Png *image) {
+    image->status = ERROR_SUCCESS;
+    image->png_ptr_read = NULL;
+    image->info_ptr_read = NULL;
+    if (size < 8 || png_sig_cmp((png_const_bytep)data, 0, 8)) {
+        fprintf(stderr, "Error: Input buffer is not a valid PNG file.\n");
+        image->status = ERROR_PNG_FORMAT;
         return;
     }
+    PngMemorySource source = {data, size, 8};
+    read_png_stream(image, NULL, &source);
+}
+
+/* Writes IHDR/PLTE/tRNS for an indexed image with the smallest bit depth
+ * that holds its palette; libpng packs the one-byte indices. */
+static void write_png_palette(png_structp png_ptr, png_infop info_ptr, const Image *pixels) {
+    int bit_depth = 8;
+    if (pixels->palette_size <= 2) bit_depth = 1;
+    else if (pixels->palette_size <= 4) bit_depth = 2;
+    else if (pixels->palette_size <= 16) bit_depth = 4;
+
+    png_color plte[256];
+    memset(plte, 0, sizeof(plte));
+    int trns_count = 0;
+    for (int i = 0; i < pixels->palette_size; i++) {
+        plte[i].red = pixels->palette[i].r;
+        plte[i].green = pixels->palette[i].g;
+        plte[i].blue = pixels->palette[i].b;
+        if (pixels->palette_alpha[i] != 255) trns_count = i + 1;
+    }
+    png_set_IHDR(png_ptr, info_ptr, pixels->width, pixels->height, bit_depth, PNG_COLOR_TYPE_PALETTE,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(png_ptr, info_ptr, plte, pixels->palette_size > 0 ? pixels->palette_size : 1);
+    if (trns_count > 0) {
+        png_set_tRNS(png_ptr, info_ptr, (png_bytep)pixels->palette_alpha, trns_count, NULL);
+    }
+}
 
+/* Encodes to fp or, when sink is set, appends to memory. */
+static void write_png_stream(struct Png *image_props, const Image *pixels, FILE *fp, PngMemorySink *sink) {
     png_structp png_ptr_write = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
     if (!png_ptr_write) {
         fprintf(stderr, "Error: png_create_write_struct failed.\n");
         image_props->status = ERROR_MEMORY;
-        fclose(fp);
         return;
     }
 
@@ -389,445 +3502,1165 @@ void write_png_file(const char *filename, struct Png *image_props, Rgb **rgb_dat
         fprintf(stderr, "Error: png_create_info_struct failed.\n");
         image_props->status = ERROR_MEMORY;
         png_destroy_write_struct(&png_ptr_write, NULL);
-        fclose(fp);
         return;
     }
 
+    /* Rows go to libpng one at a time straight from the working image,
+     * which is already in PNG sample layout for every supported format;
+     * only a tiled image needs a row buffer to gather each row into. */
+    unsigned char *row_buffer = NULL;
+    if (pixels && pixels->tiled) {
+        row_buffer = (unsigned char*)cw_arena_alloc((size_t)pixels->width * pixels->bpp);
+        if(!row_buffer){
+            fprintf(stderr, "Error: Malloc for the PNG row buffer failed.\n");
+            image_props->status = ERROR_MEMORY;
+            png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
+            return;
+        }
+    }
+
     if (setjmp(png_jmpbuf(png_ptr_write))) {
-        fprintf(stderr, "Error: libpng error during write init_io/IHDR.\n");
+        fprintf(stderr, "Error: libpng error during png_write_row.\n");
         image_props->status = ERROR_PNG_FORMAT;
         png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-        fclose(fp);
         return;
     }
 
-    png_init_io(png_ptr_write, fp);
-    png_set_IHDR(png_ptr_write, info_ptr_write, image_props->width, image_props->height,
-                 image_props->bit_depth, image_props->color_type,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (sink) {
+        png_set_write_fn(png_ptr_write, sink, png_memory_write, png_memory_flush);
+    } else {
+        png_init_io(png_ptr_write, fp);
+    }
+    if (pixels && pixels->format == PIXEL_PAL8) {
+        write_png_palette(png_ptr_write, info_ptr_write, pixels);
+    } else if (pixels) {
+        const PixelFormatInfo *format = cw_pixel_format_info(pixels->format);
+        png_set_IHDR(png_ptr_write, info_ptr_write, pixels->width, pixels->height,
+                     format->bit_depth, format->png_color_type,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    } else {
+        png_set_IHDR(png_ptr_write, info_ptr_write, image_props->width, image_props->height,
+                     image_props->bit_depth, image_props->color_type,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    }
     png_write_info(png_ptr_write, info_ptr_write);
+    if (png_get_bit_depth(png_ptr_write, info_ptr_write) < 8) {
+        png_set_packing(png_ptr_write);
+    }
+    if (pixels && cw_pixel_format_info(pixels->format)->bgr_order) {
+        png_set_bgr(png_ptr_write);
+    }
 
-    if(image_props->height == 0 || image_props->width == 0){ 
-        png_write_end(png_ptr_write, NULL);
-        png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-        fclose(fp);
-        return;
+    for (int y = 0; pixels && y < pixels->height; y++) {
+        png_write_row(png_ptr_write, image_read_row(pixels, y, row_buffer));
     }
+    png_write_end(png_ptr_write, NULL);
 
-    png_bytep *write_row_pointers = NULL;
-    if (image_props->height > 0) {
-        write_row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * image_props->height);
-        if(!write_row_pointers){
-            fprintf(stderr, "Error: Malloc for write_row_pointers failed.\n");
-            image_props->status = ERROR_MEMORY;
-            png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-            fclose(fp);
-            return;
-        }
+    png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
+}
+
+void cw_write_png_file(const char *filename, struct Png *image_props, const Image *pixels) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open file %s for writing.\n", filename);
+        image_props->status = ERROR_FILE;
+        return;
     }
-    
-    int channels = (image_props->color_type == PNG_COLOR_TYPE_RGB_ALPHA) ? 4 : 3;
-    size_t row_bytes = image_props->width * channels; 
-
-    for (int y = 0; y < image_props->height; y++) {
-        if (row_bytes == 0) {
-            fprintf(stderr, "Error: Calculated row_bytes is zero for writing at row %d.\n", y);
-            image_props->status = ERROR_PNG_FORMAT;
-            for(int k=0; k<y; ++k) if(write_row_pointers && write_row_pointers[k]) free(write_row_pointers[k]);
-            if(write_row_pointers) free(write_row_pointers);
-            png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-            fclose(fp);
-            return;
-        }
-        write_row_pointers[y] = (png_byte*)malloc(row_bytes);
-        if(!write_row_pointers[y]){
-            fprintf(stderr, "Error: Malloc for write_row_pointers[%d] failed.\n", y);
-            image_props->status = ERROR_MEMORY;
-            for(int k=0; k<y; ++k) if(write_row_pointers[k]) free(write_row_pointers[k]);
-            if(write_row_pointers)free(write_row_pointers);
-            png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-            fclose(fp);
-            return;
-        }
-        for (int x = 0; x < image_props->width; x++) {
-            png_bytep px = &(write_row_pointers[y][x * channels]);
-            px[0] = rgb_data[y][x].r;
-            px[1] = rgb_data[y][x].g;
-            px[2] = rgb_data[y][x].b;
-            if (channels == 4) {
-                px[3] = 255; 
-            }
-        }
+    write_png_stream(image_props, pixels, fp, NULL);
+    if (fclose(fp) != 0 && image_props->status == ERROR_SUCCESS) {
+        fprintf(stderr, "Error: Cannot finish writing %s: %s.\n", filename, strerror(errno));
+        image_props->status = ERROR_FILE;
     }
+}
 
-    if (setjmp(png_jmpbuf(png_ptr_write))) {
-        fprintf(stderr, "Error: libpng error during png_write_image.\n");
-        image_props->status = ERROR_PNG_FORMAT;
-        if (write_row_pointers) {
-            for (int y_clean = 0; y_clean < image_props->height; y_clean++) if(write_row_pointers[y_clean]) free(write_row_pointers[y_clean]); 
-            free(write_row_pointers);
+/* Encodes into a malloc'd buffer handed to the caller in *data. */
+static int write_png_memory(const Image *pixels, unsigned char **data, size_t *size) {
+    struct Png props;
+    memset(&props, 0, sizeof(props));
+    PngMemorySink sink = {NULL, 0, 0};
+    write_png_stream(&props, pixels, NULL, &sink);
+    if (props.status != ERROR_SUCCESS) {
+        free(sink.data);
+        sink.data = NULL;
+        sink.size = 0;
+    }
+    *data = sink.data;
+    *size = sink.size;
+    return props.status;
+}
+
+
+void cw_json_print_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char*)str; *c; c++) {
+        switch (*c) {
+            case '"': fputs("\\\"", out); break;
+            case '\\': fputs("\\\\", out); break;
+            case '\n': fputs("\\n", out); break;
+            case '\r': fputs("\\r", out); break;
+            case '\t': fputs("\\t", out); break;
+            default:
+                if (*c < 0x20) fprintf(out, "\\u%04x", *c);
+                else fputc(*c, out);
         }
-        png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
-        fclose(fp);
-        return;
     }
-    if (image_props->height > 0 && write_row_pointers) {
-        png_write_image(png_ptr_write, write_row_pointers);
+    fputc('"', out);
+}
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Wraps the decoded rows as an Image. The decoder already produced the
+ * layout of the matching pixel format, so the buffer is adopted as-is. */
+Image* cw_png_data_to_image(struct Png *image) {
+    if (!image || !image->pixels || image->status != ERROR_SUCCESS || image->height == 0 || image->width == 0) {
+        return NULL; 
     }
-    png_write_end(png_ptr_write, NULL);
 
-    if (write_row_pointers) {
-        for (int y = 0; y < image_props->height; y++) {
-            if(write_row_pointers[y]) free(write_row_pointers[y]);
+    enum PixelFormat format;
+    if (!pixel_format_from_png(image->color_type, image->bit_depth, &format)) {
+        fprintf(stderr, "Error: Unsupported pixel layout (color type %d, bit depth %d).\n", image->color_type, image->bit_depth);
+        image->status = ERROR_PNG_FORMAT;
+        return NULL;
+    }
+    
+    Image *result = (Image*)calloc(1, sizeof(Image));
+    if (!result) {
+        fprintf(stderr, "Memory for image failed\n");
+        image->status = ERROR_MEMORY;
+        return NULL;
+    }
+    result->width = image->width;
+    result->height = image->height;
+    result->format = format;
+    result->bpp = cw_pixel_format_info(format)->bytes_per_pixel;
+    result->stride = (ptrdiff_t)image->row_bytes;
+    result->buffer = image->pixels_mapping_size ? NULL : image->pixels;
+    result->mapping = image->pixels_mapping_size ? image->pixels : NULL;
+    result->mapping_size = image->pixels_mapping_size;
+    result->data = image->pixels;
+    image->pixels = NULL;
+    image->pixels_mapping_size = 0;
+    if (format == PIXEL_PAL8) {
+        result->palette_size = image->palette_size;
+        for (int i = 0; i < image->palette_size; i++) {
+            result->palette[i].r = image->palette[i].red;
+            result->palette[i].g = image->palette[i].green;
+            result->palette[i].b = image->palette[i].blue;
         }
-        free(write_row_pointers);
+        memcpy(result->palette_alpha, image->palette_alpha, sizeof(result->palette_alpha));
     }
-    png_destroy_write_struct(&png_ptr_write, &info_ptr_write);
+    return result;
+}
+
+void cw_free_png_read_resources(struct Png *image) {
+    if (!image) return;
+    image->row_pointers = NULL;
+    if (image->pixels) pixels_release(image->pixels, image->pixels_mapping_size);
+    image->pixels = NULL;
+    image->pixels_mapping_size = 0;
+    if (image->png_ptr_read || image->info_ptr_read) {
+        png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
+        image->png_ptr_read = NULL;
+        image->info_ptr_read = NULL;
+    }
+}
+
+#define BMP_FILE_HEADER_SIZE 14
+#define BMP_INFO_HEADER_SIZE 40
+#define BMP_STAGING_ROWS 64
+
+static inline uint32_t bmp_get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t bmp_get_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline void bmp_put_le32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = (v >> 24) & 0xff;
+}
+
+static inline void bmp_put_le16(unsigned char *p, uint16_t v) {
+    p[0] = v & 0xff; p[1] = (v >> 8) & 0xff;
+}
+
+static inline size_t bmp_row_size(int width) {
+    return (((size_t)width * 24 + 31) / 32) * 4;
+}
+
+bool cw_is_bmp_file(const char *filename) {
+    unsigned char sig[2];
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) return false;
+    bool is_bmp = fread(sig, 1, 2, fp) == 2 && sig[0] == 'B' && sig[1] == 'M';
     fclose(fp);
+    return is_bmp;
 }
 
+static bool has_bmp_extension(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    return dot && strcasecmp(dot, ".bmp") == 0;
+}
 
-void print_png_info(struct Png *image) {
-    if (!image || (image->status != ERROR_SUCCESS && image->width == 0 && image->height == 0 && image->bit_depth == 0)) {
-        fprintf(stderr, "Cannot display info due to previous error or invalid image data structure.\n");
-        return;
+/* Wraps the pixel array of an uncompressed 24-bit BMP held in a writable
+ * mapping as a BGR8 image without copying: bottom-up files get a negative
+ * stride. The image takes over the mapping; on failure it is unmapped. */
+static int bmp_adopt_mapping(unsigned char *base, size_t file_size, const char *filename, Image **result) {
+    if (file_size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE) {
+        fprintf(stderr, "Error: %s is not a valid BMP file.\n", filename);
+        munmap(base, file_size);
+        return ERROR_BMP_FORMAT;
+    }
+    uint32_t pixel_offset = bmp_get_le32(base + 10);
+    uint32_t info_size = bmp_get_le32(base + 14);
+    int32_t width = (int32_t)bmp_get_le32(base + 18);
+    int32_t height = (int32_t)bmp_get_le32(base + 22);
+    uint16_t planes = bmp_get_le16(base + 26);
+    uint16_t bits_per_pixel = bmp_get_le16(base + 28);
+    uint32_t compression = bmp_get_le32(base + 30);
+
+    if (base[0] != 'B' || base[1] != 'M' || info_size < BMP_INFO_HEADER_SIZE || planes != 1 ||
+        width <= 0 || height == 0 || height == INT32_MIN) {
+        fprintf(stderr, "Error: %s is not a valid BMP file.\n", filename);
+        munmap(base, file_size);
+        return ERROR_BMP_FORMAT;
+    }
+    if (bits_per_pixel != 24 || compression != 0) {
+        fprintf(stderr, "Error: Only uncompressed 24-bit BMP files are supported (got %d bpp, compression %u).\n",
+                bits_per_pixel, compression);
+        munmap(base, file_size);
+        return ERROR_BMP_FORMAT;
+    }
+
+    int rows = height < 0 ? -height : height;
+    size_t row_size = bmp_row_size(width);
+    if (pixel_offset > file_size || (file_size - pixel_offset) / row_size < (size_t)rows) {
+        fprintf(stderr, "Error: %s is truncated.\n", filename);
+        munmap(base, file_size);
+        return ERROR_BMP_FORMAT;
+    }
+
+    Image *image = (Image*)calloc(1, sizeof(Image));
+    if (!image) {
+        fprintf(stderr, "Memory for image failed\n");
+        munmap(base, file_size);
+        return ERROR_MEMORY;
     }
-    printf("Width: %d\n", image->width);
-    printf("Height: %d\n", image->height); 
-    printf("Bit depth: %d\n", image->bit_depth);
-    const char* ct_str;
-    switch(image->color_type){
-        case PNG_COLOR_TYPE_GRAY: ct_str = "Grayscale"; break;
-        case PNG_COLOR_TYPE_GRAY_ALPHA: ct_str = "Grayscale with Alpha"; break;
-        case PNG_COLOR_TYPE_PALETTE: ct_str = "Palette"; break;
-        case PNG_COLOR_TYPE_RGB: ct_str = "RGB"; break;
-        case PNG_COLOR_TYPE_RGB_ALPHA: ct_str = "RGBA"; break;
-        default: ct_str = "Unknown"; break;
-    }
-    printf("Color type: %s (%d)\n", ct_str, image->color_type);
-    if (image->png_ptr_read && image->info_ptr_read) { 
-        printf("Number of passes (interlace): %d\n", image->number_of_passes);
+    image->width = width;
+    image->height = rows;
+    image->format = PIXEL_BGR8;
+    image->bpp = 3;
+    image->mapping = base;
+    image->mapping_size = file_size;
+    if (height > 0) {
+        image->stride = -(ptrdiff_t)row_size;
+        image->data = base + pixel_offset + (size_t)(rows - 1) * row_size;
     } else {
-        printf("Number of passes (interlace): N/A (info not fully read)\n");
+        image->stride = (ptrdiff_t)row_size;
+        image->data = base + pixel_offset;
     }
+    *result = image;
+    return ERROR_SUCCESS;
 }
 
-Rgb** png_data_to_rgb_array(struct Png *image) {
-    if (!image || !image->row_pointers || image->status != ERROR_SUCCESS || image->height == 0 || image->width == 0) {
-        return NULL; 
+/* Reads only the 54-byte BMP header for --info. Any bit depth and
+ * compression are reported; an uncompressed pixel array that runs past
+ * the end of the file is an error, as when loading. */
+int cw_read_bmp_header(const char *filename, struct PngHeader *header) {
+    memset(header, 0, sizeof(struct PngHeader));
+    header->bmp = true;
+    header->status = ERROR_SUCCESS;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s for reading.\n", filename);
+        header->status = ERROR_FILE;
+        return header->status;
     }
-    
-    Rgb **arr = (Rgb**)malloc(sizeof(Rgb*) * image->height);
-    if (!arr) {
-        fprintf(stderr, "Memory for Rgb** failed\n");
-        image->status = ERROR_MEMORY;
-        return NULL;
+    unsigned char raw[BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE];
+    struct stat st;
+    bool complete = fstat(fd, &st) == 0 && read(fd, raw, sizeof(raw)) == (ssize_t)sizeof(raw);
+    close(fd);
+    if (!complete) {
+        fprintf(stderr, "Error: %s is not a valid BMP file.\n", filename);
+        header->status = ERROR_BMP_FORMAT;
+        return header->status;
+    }
+    uint32_t pixel_offset = bmp_get_le32(raw + 10);
+    uint32_t info_size = bmp_get_le32(raw + 14);
+    int32_t width = (int32_t)bmp_get_le32(raw + 18);
+    int32_t height = (int32_t)bmp_get_le32(raw + 22);
+    uint16_t planes = bmp_get_le16(raw + 26);
+    if (raw[0] != 'B' || raw[1] != 'M' || info_size < BMP_INFO_HEADER_SIZE || planes != 1 ||
+        width <= 0 || height == 0 || height == INT32_MIN) {
+        fprintf(stderr, "Error: %s is not a valid BMP file.\n", filename);
+        header->status = ERROR_BMP_FORMAT;
+        return header->status;
+    }
+    header->file_size = st.st_size;
+    header->width = width;
+    header->height = height < 0 ? -height : height;
+    header->bmp_top_down = height < 0;
+    header->bmp_bits_per_pixel = bmp_get_le16(raw + 28);
+    header->bmp_compression = bmp_get_le32(raw + 30);
+    header->bmp_pixel_offset = pixel_offset;
+    header->raw_bytes = (((unsigned long long)width * header->bmp_bits_per_pixel + 31) / 32) * 4 * header->height;
+    if (header->bmp_compression == 0 && (pixel_offset > (unsigned long long)st.st_size ||
+                                         (unsigned long long)st.st_size - pixel_offset < header->raw_bytes)) {
+        fprintf(stderr, "Error: %s is truncated.\n", filename);
+        header->status = ERROR_BMP_FORMAT;
     }
+    return header->status;
+}
 
-    int channels = (image->color_type == PNG_COLOR_TYPE_RGB_ALPHA) ? 4 : 3;
+/* Maps the file privately, so edits are copy-on-write and never reach the
+ * input file. */
+static int read_bmp_file(const char *filename, Image **result) {
+    *result = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s for reading.\n", filename);
+        return ERROR_FILE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE) {
+        fprintf(stderr, "Error: %s is not a valid BMP file.\n", filename);
+        close(fd);
+        return ERROR_BMP_FORMAT;
+    }
+    size_t file_size = (size_t)st.st_size;
+    unsigned char *base = (unsigned char*)mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map file %s: %s.\n", filename, strerror(errno));
+        return ERROR_FILE;
+    }
+    return bmp_adopt_mapping(base, file_size, filename, result);
+}
 
-    for (int y = 0; y < image->height; y++) {
-        arr[y] = (Rgb*)malloc(sizeof(Rgb) * image->width);
-        if (!arr[y]) {
-            fprintf(stderr, "Memory for Rgb* row %d failed\n", y);
-            for (int k = 0; k < y; k++) if(arr[k]) free(arr[k]);
-            free(arr);
-            image->status = ERROR_MEMORY;
-            return NULL;
+/* Copies an in-memory BMP into an anonymous mapping the image then owns. */
+static int read_bmp_memory(const unsigned char *data, size_t size, Image **result) {
+    *result = NULL;
+    if (size < BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE) {
+        fprintf(stderr, "Error: Input buffer is not a valid BMP file.\n");
+        return ERROR_BMP_FORMAT;
+    }
+    unsigned char *base = (unsigned char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map %zu bytes for BMP input: %s.\n", size, strerror(errno));
+        return ERROR_MEMORY;
+    }
+    memcpy(base, data, size);
+    return bmp_adopt_mapping(base, size, "Input buffer", result);
+}
+
+static void bmp_pack_row(unsigned char *dst, const Image *image, int y, unsigned char *scratch) {
+    const unsigned char *src = image_read_row(image, y, scratch);
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    for (int x = 0; x < image->width; x++, dst += 3) {
+        if (image->format == PIXEL_PAL8) {
+            const Rgb *entry = &image->palette[src[x]];
+            dst[0] = entry->b; dst[1] = entry->g; dst[2] = entry->r;
+            continue;
         }
-        png_bytep row = image->row_pointers[y];
-        for (int x = 0; x < image->width; x++) {
-            png_bytep px = &(row[x * channels]);
-            arr[y][x].r = px[0];
-            arr[y][x].g = px[1];
-            arr[y][x].b = px[2];
+        const unsigned char *px = src + (size_t)x * image->bpp;
+        int step = format->bit_depth / 8;
+        if (format->bgr_order) {
+            dst[0] = px[0]; dst[1] = px[step]; dst[2] = px[2 * step];
+        } else {
+            dst[0] = px[2 * step]; dst[1] = px[step]; dst[2] = px[0];
         }
     }
-    return arr;
 }
 
-void free_rgb_array(Rgb **rgb_data, int height) {
-    if (!rgb_data) return;
-    for (int i = 0; i < height; i++) {
-        if(rgb_data[i]) free(rgb_data[i]); 
+static int bmp_write_all(int fd, off_t offset, struct iovec *iov, int iov_count) {
+    while (iov_count > 0) {
+        ssize_t written = pwritev(fd, iov, iov_count, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        offset += written;
+        while (iov_count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
-    free(rgb_data);
+    return 1;
 }
 
-void free_png_read_resources(struct Png *image) {
-    if (!image) return;
-    if (image->row_pointers) {
-        for (int y = 0; y < image->original_height_for_row_pointers; y++) { 
-            if (image->row_pointers[y]) free(image->row_pointers[y]); 
+static void bmp_put_header(unsigned char *header, const Image *image, size_t pixel_bytes) {
+    size_t header_size = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE;
+    memset(header, 0, header_size);
+    header[0] = 'B';
+    header[1] = 'M';
+    bmp_put_le32(header + 2, (uint32_t)(header_size + pixel_bytes));
+    bmp_put_le32(header + 10, (uint32_t)header_size);
+    bmp_put_le32(header + 14, BMP_INFO_HEADER_SIZE);
+    bmp_put_le32(header + 18, (uint32_t)image->width);
+    bmp_put_le32(header + 22, (uint32_t)image->height);
+    bmp_put_le16(header + 26, 1);
+    bmp_put_le16(header + 28, 24);
+    bmp_put_le32(header + 34, (uint32_t)pixel_bytes);
+}
+
+/* Writes a bottom-up 24-bit BMP with one positioned write. A BGR8 image
+ * whose rows are already laid out bottom-up with BMP padding (e.g. one
+ * read by read_bmp_file) is written straight from its buffer; any other
+ * image is packed into a single header + pixels staging buffer first.
+ * The data goes to a temporary file next to the target, renamed over it
+ * once complete: the image may be a private mapping of the target itself,
+ * whose untouched pages fault once that file is truncated. */
+static int write_bmp_file(const char *filename, const Image *image) {
+    size_t row_size = bmp_row_size(image->width);
+    size_t pixel_bytes = row_size * image->height;
+    if (pixel_bytes + BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE > UINT32_MAX) {
+        fprintf(stderr, "Error: Image is too large for BMP.\n");
+        return ERROR_BMP_FORMAT;
+    }
+
+    unsigned char header[BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE];
+    bmp_put_header(header, image, pixel_bytes);
+
+    size_t path_size = strlen(filename) + sizeof(".XXXXXX");
+    char *temp_path = (char*)cw_arena_alloc(path_size);
+    if (!temp_path) {
+        fprintf(stderr, "Memory for BMP output failed\n");
+        return ERROR_MEMORY;
+    }
+    snprintf(temp_path, path_size, "%s.XXXXXX", filename);
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot open file %s for writing.\n", filename);
+        return ERROR_FILE;
+    }
+    /* mkstemp creates the file 0600; keep the mode of a file being
+     * replaced. */
+    struct stat target;
+    fchmod(fd, stat(filename, &target) == 0 ? target.st_mode & 07777 : 0644);
+
+    /* Bottom-up BGR rows with BMP padding already are the file layout and go
+     * out in one call; anything else is packed BMP_STAGING_ROWS rows at a
+     * time in file order. */
+    int status = ERROR_SUCCESS;
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    if (image->format == PIXEL_BGR8 && image->stride == -(ptrdiff_t)row_size) {
+        iov[1].iov_base = image_row(image, image->height - 1);
+        iov[1].iov_len = pixel_bytes;
+        if (!bmp_write_all(fd, 0, iov, 2)) status = ERROR_FILE;
+    } else {
+        int chunk_rows = image->height < BMP_STAGING_ROWS ? image->height : BMP_STAGING_ROWS;
+        unsigned char *staging = (unsigned char*)cw_arena_alloc(row_size * chunk_rows);
+        unsigned char *scratch = image->tiled ? (unsigned char*)cw_arena_alloc((size_t)image->width * image->bpp) : NULL;
+        if (!staging || (image->tiled && !scratch)) {
+            fprintf(stderr, "Memory for BMP output failed\n");
+            close(fd);
+            unlink(temp_path);
+            return ERROR_MEMORY;
+        }
+        off_t offset = 0;
+        if (!bmp_write_all(fd, offset, iov, 1)) status = ERROR_FILE;
+        offset += sizeof(header);
+        for (int first = 0; status == ERROR_SUCCESS && first < image->height; first += chunk_rows) {
+            int rows = image->height - first < chunk_rows ? image->height - first : chunk_rows;
+            memset(staging, 0, row_size * rows);
+            for (int i = 0; i < rows; i++) {
+                bmp_pack_row(staging + (size_t)i * row_size, image, image->height - 1 - (first + i), scratch);
+            }
+            iov[1].iov_base = staging;
+            iov[1].iov_len = row_size * rows;
+            if (!bmp_write_all(fd, offset, iov + 1, 1)) status = ERROR_FILE;
+            offset += (off_t)(row_size * rows);
         }
-        free(image->row_pointers);
-        image->row_pointers = NULL;
     }
-    if (image->png_ptr_read || image->info_ptr_read) {
-        png_destroy_read_struct(&image->png_ptr_read, &image->info_ptr_read, NULL);
-        image->png_ptr_read = NULL;
-        image->info_ptr_read = NULL;
+    if (status != ERROR_SUCCESS) {
+        fprintf(stderr, "Error: Writing %s failed: %s.\n", filename, strerror(errno));
+    }
+    if (close(fd) != 0 && status == ERROR_SUCCESS) {
+        fprintf(stderr, "Error: Closing %s failed: %s.\n", filename, strerror(errno));
+        status = ERROR_FILE;
     }
+    if (status == ERROR_SUCCESS && rename(temp_path, filename) != 0) {
+        fprintf(stderr, "Error: Cannot replace %s: %s.\n", filename, strerror(errno));
+        status = ERROR_FILE;
+    }
+    if (status != ERROR_SUCCESS) unlink(temp_path);
+    return status;
 }
 
-int parse_color_string(const char* optarg_str, Rgb* color_struct) {
-    int r_int, g_int, b_int;
-    if (!optarg_str) { 
-        fprintf(stderr, "Error: Color string is NULL.\n");
-        return 0;
+/* Encodes a BMP into a malloc'd buffer handed to the caller in *data. */
+static int write_bmp_memory(const Image *image, unsigned char **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+    size_t row_size = bmp_row_size(image->width);
+    size_t pixel_bytes = row_size * image->height;
+    size_t header_size = BMP_FILE_HEADER_SIZE + BMP_INFO_HEADER_SIZE;
+    if (pixel_bytes + header_size > UINT32_MAX) {
+        fprintf(stderr, "Error: Image is too large for BMP.\n");
+        return ERROR_BMP_FORMAT;
     }
-    if (sscanf(optarg_str, "%d.%d.%d", &r_int, &g_int, &b_int) != 3 ||
-        r_int < 0 || r_int > 255 || g_int < 0 || g_int > 255 || b_int < 0 || b_int > 255) {
-        fprintf(stderr, "Error: Incorrect color format '%s'. Expected rrr.ggg.bbb with components in 0-255.\n", optarg_str);
-        return 0; 
+    unsigned char *buffer = (unsigned char*)malloc(header_size + pixel_bytes);
+    unsigned char *scratch = image->tiled ? (unsigned char*)cw_arena_alloc((size_t)image->width * image->bpp) : NULL;
+    if (!buffer || (image->tiled && !scratch)) {
+        fprintf(stderr, "Memory for BMP output failed\n");
+        free(buffer);
+        return ERROR_MEMORY;
     }
-    color_struct->r = (unsigned char)r_int;
-    color_struct->g = (unsigned char)g_int;
-    color_struct->b = (unsigned char)b_int;
-    return 1; 
+    bmp_put_header(buffer, image, pixel_bytes);
+    unsigned char *row = buffer + header_size;
+    for (int y = image->height - 1; y >= 0; y--, row += row_size) {
+        memset(row + row_size - 4, 0, 4);
+        bmp_pack_row(row, image, y, scratch);
+    }
+    *data = buffer;
+    *size = header_size + pixel_bytes;
+    return ERROR_SUCCESS;
 }
 
-int parse_points_string(const char* optarg_str, Point* p1, Point* p2, Point* p3) {
-    if (!optarg_str) { 
-        fprintf(stderr, "Error: Points string is NULL.\n");
-        return 0;
+/* Appends a shape to the list, growing both arrays by doubling. */
+bool cw_shape_list_push(ShapeList *shapes, const Point *points, int count, int *shape_capacity, int *point_capacity) {
+    if (shapes->shape_count == *shape_capacity) {
+        int capacity = *shape_capacity ? *shape_capacity * 2 : 256;
+        Shape *grown = (Shape*)realloc(shapes->shapes, sizeof(Shape) * capacity);
+        if (!grown) return false;
+        shapes->shapes = grown;
+        *shape_capacity = capacity;
     }
-    if (sscanf(optarg_str, "%d.%d.%d.%d.%d.%d", &p1->x, &p1->y, &p2->x, &p2->y, &p3->x, &p3->y) != 6) {
-        fprintf(stderr, "Error: Incorrect points format '%s'. Expected x1.y1.x2.y2.x3.y3.\n", optarg_str);
-        return 0; 
+    while (shapes->point_count + count > *point_capacity) {
+        int capacity = *point_capacity ? *point_capacity * 2 : 1024;
+        Point *grown = (Point*)realloc(shapes->points, sizeof(Point) * capacity);
+        if (!grown) return false;
+        shapes->points = grown;
+        *point_capacity = capacity;
     }
-    return 1; 
+    Shape *shape = &shapes->shapes[shapes->shape_count++];
+    shape->kind = SHAPE_POLYGON;
+    shape->first = shapes->point_count;
+    shape->count = count;
+    shape->min = shape->max = points[0];
+    for (int i = 0; i < count; i++) {
+        Point p = points[i];
+        shapes->points[shapes->point_count++] = p;
+        if (p.x < shape->min.x) shape->min.x = p.x;
+        if (p.y < shape->min.y) shape->min.y = p.y;
+        if (p.x > shape->max.x) shape->max.x = p.x;
+        if (p.y > shape->max.y) shape->max.y = p.y;
+    }
+    return true;
 }
 
-void print_help() {
-    puts("Usage: program_name [operation] [operation_args] [-i input.png] [-o output.png]");
-    puts("\nOperations (only one per execution):");
-    puts("  --triangle                  Draw a triangle.");
-    puts("      --points <x1.y1.x2.y2.x3.y3> Vertex coordinates (required).");
-    puts("      --thickness <int>       Line thickness, >0 (required).");
-    puts("      --color <r.g.b>         Line color, 0-255 (required).");
-    puts("      --fill                  (Optional) Flag to fill the triangle.");
-    puts("      --fill_color <r.g.b>    (Optional) Fill color if --fill is used.");
-    puts("\n  --biggest_rect              Find and recolor the largest rectangle of a specific color.");
-    puts("      --old_color <r.g.b>     Color of the rectangle to find (required).");
-    puts("      --new_color <r.g.b>     Color to repaint with (required).");
-    puts("\n  --collage                   Create a collage from the input image.");
-    puts("      --number_x <int>        Number of repetitions along X-axis, >0 (required).");
-    puts("      --number_y <int>        Number of repetitions along Y-axis, >0 (required).");
-    puts("\nOther options:");
-    puts("  -i, --input <file.png>      Input PNG file name.");
-    puts("  -o, --output <file.png>     Output PNG file name (default: out.png).");
-    puts("      --info                  Show information about the input PNG file.");
-    puts("  -h, --help                  Show this help message.");
+/* Radii within 0..SHAPE_MAX_RADIUS and a bounding box that fits in int. */
+bool cw_ellipse_in_range(Point center, Point radii) {
+    if (radii.x < 0 || radii.y < 0 || radii.x > SHAPE_MAX_RADIUS || radii.y > SHAPE_MAX_RADIUS) return false;
+    return (long long)center.x - radii.x >= INT_MIN && (long long)center.x + radii.x <= INT_MAX &&
+           (long long)center.y - radii.y >= INT_MIN && (long long)center.y + radii.y <= INT_MAX;
 }
 
+/* Appends an ellipse stored as its centre and radii; see cw_ellipse_in_range. */
+bool cw_shape_list_push_ellipse(ShapeList *shapes, Point center, Point radii, int *shape_capacity, int *point_capacity) {
+    Point points[2] = {center, radii};
+    if (!cw_shape_list_push(shapes, points, 2, shape_capacity, point_capacity)) return false;
+    Shape *shape = &shapes->shapes[shapes->shape_count - 1];
+    shape->kind = SHAPE_ELLIPSE;
+    shape->min = (Point){center.x - radii.x, center.y - radii.y};
+    shape->max = (Point){center.x + radii.x, center.y + radii.y};
+    return true;
+}
 
-int main(int argc, char *argv[]) {
-    printf("Course work for option 4.19, created by Omelyash Egor\n");
+void cw_free_shape_list(ShapeList *shapes) {
+    free(shapes->shapes);
+    free(shapes->points);
+    memset(shapes, 0, sizeof(*shapes));
+}
 
-    char *input_filename = NULL;
-    char *output_filename = "out.png"; 
 
-    int op_triangle_flag = 0;
-    int op_biggest_rect_flag = 0;
-    int op_collage_flag = 0;
-    int info_flag = 0;
-    int help_flag = 0;
+/* Starts timing a stage; stats is NULL unless --stats was given. */
+static void job_stats_begin(JobStats *stats) {
+    if (!stats) return;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    stats->wall_start = clock_seconds(CLOCK_MONOTONIC);
+    stats->cpu_start = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                       (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+}
 
-    char* points_str = NULL; Point p1={0}, p2={0}, p3={0}; 
-    int thickness = 0;
-    char* line_color_str = NULL; Rgb line_color={0}; 
-    int fill_flag = 0;
-    char* fill_color_str = NULL; Rgb fill_color={0}; 
+/* Closes the stage opened by job_stats_begin. CPU time covers every
+ * thread of the process, so a parallel stage can exceed its wall time. */
+static void job_stats_end(JobStats *stats, enum JobStage stage, unsigned long long bytes) {
+    if (!stats) return;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpu = (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+                 (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+    stats->stage[stage].done = true;
+    stats->stage[stage].wall += clock_seconds(CLOCK_MONOTONIC) - stats->wall_start;
+    stats->stage[stage].cpu += cpu - stats->cpu_start;
+    stats->stage[stage].peak_rss_kib = usage.ru_maxrss;
+    stats->stage[stage].bytes += bytes;
+}
 
-    char* old_color_str = NULL; Rgb old_color={0}; 
-    char* new_color_str = NULL; Rgb new_color={0}; 
+static unsigned long long file_size_bytes(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? (unsigned long long)st.st_size : 0;
+}
 
-    int number_x = 0, number_y = 0;
+static unsigned long long image_pixel_bytes(const Image *image) {
+    return image ? (unsigned long long)image->width * image->height * image->bpp : 0;
+}
 
-    struct Png image_data;
-    memset(&image_data, 0, sizeof(struct Png)); 
-    image_data.status = ERROR_SUCCESS;
-
-
-    const struct option long_options[] = {
-        {"help", no_argument, NULL, 'h'},
-        {"input", required_argument, NULL, 'i'},
-        {"output", required_argument, NULL, 'o'},
-        {"info", no_argument, NULL, 256}, 
-
-        {"triangle", no_argument, NULL, 257},
-        {"points", required_argument, NULL, 'p'}, 
-        {"thickness", required_argument, NULL, 't'},
-        {"color", required_argument, NULL, 'c'},
-        {"fill", no_argument, NULL, 258},
-        {"fill_color", required_argument, NULL, 'f'},
-
-        {"biggest_rect", no_argument, NULL, 259},
-        {"old_color", required_argument, NULL, 'O'}, 
-        {"new_color", required_argument, NULL, 'N'},
-
-        {"collage", no_argument, NULL, 260},
-        {"number_x", required_argument, NULL, 'x'},
-        {"number_y", required_argument, NULL, 'y'},
-        {0, 0, 0, 0}
-    };
+static const char *const job_stage_names[STAGE_COUNT] = {
+    "read", "convert", "operation", "write"
+};
 
-    int opt;
-
-    while ((opt = getopt_long(argc, argv, "hi:o:p:t:c:f:O:N:x:y:", long_options, NULL)) != -1) {
-        switch (opt) {
-            case 'h': help_flag = 1; break;
-            case 'i': input_filename = optarg; break;
-            case 'o': output_filename = optarg; break;
-            case 256: info_flag = 1; break; 
-
-            case 257: op_triangle_flag = 1; break; 
-            case 'p': points_str = optarg; break;
-            case 't': thickness = atoi(optarg); break;
-            case 'c': line_color_str = optarg; break;
-            case 258: fill_flag = 1; break; 
-            case 'f': fill_color_str = optarg; break;
-
-            case 259: op_biggest_rect_flag = 1; break; 
-            case 'O': old_color_str = optarg; break;
-            case 'N': new_color_str = optarg; break;
-
-            case 260: op_collage_flag = 1; break; 
-            case 'x': number_x = atoi(optarg); break;
-            case 'y': number_y = atoi(optarg); break;
-            
-            case '?': 
-                fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
-                image_data.status = ERROR_ARG;
-                goto cleanup_and_exit;
-            default: 
-                image_data.status = ERROR_ARG; 
-                goto cleanup_and_exit;
+static void print_job_stats(FILE *out, const char *input_filename, const char *output_filename, const JobStats *stats, bool json_output) {
+    if (json_output) {
+        fprintf(out, "{\"file\":");
+        cw_json_print_string(out, input_filename);
+        fprintf(out, ",\"output\":");
+        cw_json_print_string(out, output_filename);
+        fprintf(out, ",\"stages\":[");
+        bool first = true;
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            if (!stats->stage[i].done) continue;
+            fprintf(out, "%s{\"stage\":\"%s\",\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"peak_rss_kib\":%ld,\"bytes\":%llu}",
+                    first ? "" : ",", job_stage_names[i], stats->stage[i].wall * 1e3, stats->stage[i].cpu * 1e3,
+                    stats->stage[i].peak_rss_kib, stats->stage[i].bytes);
+            first = false;
         }
+        fprintf(out, "]}\n");
+        return;
     }
-    
-    if (optind < argc && input_filename == NULL) {
-        input_filename = argv[optind];
+    fprintf(out, "Stats for %s -> %s\n", input_filename, output_filename);
+    fprintf(out, "  %-10s %10s %10s %14s %14s\n", "stage", "wall ms", "cpu ms", "peak RSS KiB", "bytes");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        if (!stats->stage[i].done) continue;
+        fprintf(out, "  %-10s %10.3f %10.3f %14ld %14llu\n", job_stage_names[i], stats->stage[i].wall * 1e3,
+                stats->stage[i].cpu * 1e3, stats->stage[i].peak_rss_kib, stats->stage[i].bytes);
+    }
+}
+
+/* Reads all of fp into a malloc'd buffer; used for standard input, which
+ * can be neither mapped nor seeked. */
+static int read_stream_all(FILE *fp, unsigned char **data, size_t *size) {
+    size_t capacity = 64 * 1024, used = 0;
+    unsigned char *buffer = (unsigned char*)malloc(capacity);
+    while (buffer) {
+        used += fread(buffer + used, 1, capacity - used, fp);
+        if (used < capacity) break;
+        capacity *= 2;
+        unsigned char *grown = (unsigned char*)realloc(buffer, capacity);
+        if (!grown) free(buffer);
+        buffer = grown;
+    }
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed for standard input\n");
+        return ERROR_MEMORY;
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "Error: Cannot read standard input.\n");
+        free(buffer);
+        return ERROR_FILE;
     }
+    *data = buffer;
+    *size = used;
+    return ERROR_SUCCESS;
+}
+
+/* Width and height from the IHDR chunk of an in-memory PNG. */
+static bool png_memory_dimensions(const unsigned char *data, size_t size, int *width, int *height) {
+    if (size < 24 || png_sig_cmp((png_const_bytep)data, 0, 8) || memcmp(data + 12, "IHDR", 4) != 0) return false;
+    png_uint_32 w = png_get_uint_32(data + 16), h = png_get_uint_32(data + 20);
+    if (w > PNG_UINT_31_MAX || h > PNG_UINT_31_MAX) return false;
+    *width = (int)w;
+    *height = (int)h;
+    return true;
+}
 
+/* Reads a PNG or BMP input, from the named file or, when data is set, from
+ * memory (name is then only used in messages), into a working image,
+ * reducing it on the way in when the job asks for (or implies) a decode
+ * scale. The caller has started the "read" stage; "read" counts the input
+ * bytes and "convert" the working image bytes. */
+static int load_image(const char *name, const unsigned char *data, size_t size, const JobOptions *job, Image **result, JobStats *stats) {
+    *result = NULL;
+    int num_ops = job->op_triangle_flag + job->op_biggest_rect_flag + job->op_collage_flag +
+                  job->op_inverse_flag + job->op_gray_flag + job->op_resize_flag + job->op_shapes_flag +
+                  job->op_flood_flag + job->op_blob_flag;
+    int decode_scale = job->decode_scale;
+    unsigned long long input_bytes = data ? size : file_size_bytes(name);
+    Image *pixels = NULL;
 
-    if (help_flag || (argc == 1 && !input_filename) ) { 
-        print_help();
-        image_data.status = ERROR_SUCCESS; 
-        goto cleanup_and_exit;
+    if (data ? size >= 2 && data[0] == 'B' && data[1] == 'M' : cw_is_bmp_file(name)) {
+        int status = data ? read_bmp_memory(data, size, &pixels) : read_bmp_file(name, &pixels);
+        if (status != ERROR_SUCCESS) {
+            fprintf(stderr, "Failed to read BMP file '%s'.\n", name);
+            return status;
+        }
+        if (decode_scale > 1) {
+            Image *reduced = cw_image_box_reduce(pixels, decode_scale);
+            image_free(pixels);
+            if (!reduced) return ERROR_MEMORY;
+            pixels = reduced;
+        }
+        /* The BMP mapping is the working image: nothing to convert. */
+        job_stats_end(stats, STAGE_READ, input_bytes);
+        job_stats_begin(stats);
+        job_stats_end(stats, STAGE_CONVERT, image_pixel_bytes(pixels));
+        *result = pixels;
+        return ERROR_SUCCESS;
     }
 
-    if (!input_filename && (info_flag || op_triangle_flag || op_biggest_rect_flag || op_collage_flag)) {
-         fprintf(stderr, "Error: Input file is required for this operation.\n");
-         image_data.status = ERROR_FILE;
-         goto cleanup_and_exit;
+    /* A box --scale by a whole factor on its own is done entirely while
+     * decoding; the resampler then finds the size already right. */
+    if (!decode_scale && job->scale_flag && num_ops == 0 && job->scale_filter == RESAMPLE_BOX) {
+        struct PngHeader header;
+        int width = 0, height = 0;
+        bool known = false;
+        if (data) {
+            known = png_memory_dimensions(data, size, &width, &height);
+        } else if (cw_read_png_header(name, &header) == ERROR_SUCCESS) {
+            width = header.width;
+            height = header.height;
+            known = true;
+        }
+        if (known && width > 0 && height > 0) {
+            int factor = job->scale_w > 0 ? width / job->scale_w : height / job->scale_h;
+            if (factor > 1 && width % factor == 0 && height % factor == 0 &&
+                (job->scale_w == 0 || width / factor == job->scale_w) &&
+                (job->scale_h == 0 || height / factor == job->scale_h)) {
+                decode_scale = factor;
+            }
+        }
     }
+    struct Png image_data;
+    memset(&image_data, 0, sizeof(struct Png)); 
+    image_data.decode_scale = decode_scale;
+    if (data) {
+        read_png_memory(data, size, &image_data);
+    } else {
+        cw_read_png_file(name, &image_data);
+    }
+    if (image_data.status != ERROR_SUCCESS) {
+        fprintf(stderr, "Failed to read PNG file '%s'.\n", name);
+        cw_free_png_read_resources(&image_data);
+        return image_data.status;
+    }
+    job_stats_end(stats, STAGE_READ, input_bytes);
+    job_stats_begin(stats);
+    pixels = cw_png_data_to_image(&image_data);
+    int status = image_data.status;
+    cw_free_png_read_resources(&image_data);
+    if (!pixels) {
+        fprintf(stderr, "Failed to convert PNG to working image.\n");
+        return status != ERROR_SUCCESS ? status : ERROR_PNG_FORMAT;
+    }
+    job_stats_end(stats, STAGE_CONVERT, image_pixel_bytes(pixels));
+    *result = pixels;
+    return ERROR_SUCCESS;
+}
+
+/* Loads an input file; "-" reads the image from standard input. */
+int cw_load_image_file(const char *filename, const JobOptions *job, Image **result, JobStats *stats) {
+    job_stats_begin(stats);
+    if (strcmp(filename, "-") != 0) return load_image(filename, NULL, 0, job, result, stats);
+    unsigned char *data = NULL;
+    size_t size = 0;
+    *result = NULL;
+    int status = read_stream_all(stdin, &data, &size);
+    if (status != ERROR_SUCCESS) return status;
+    status = load_image("standard input", data, size, job, result, stats);
+    free(data);
+    return status;
+}
 
+static int load_image_memory(const unsigned char *data, size_t size, const JobOptions *job, Image **result) {
+    return load_image("input buffer", data, size, job, result, NULL);
+}
 
-    int num_ops = op_triangle_flag + op_biggest_rect_flag + op_collage_flag;
-    if (num_ops > 1) {
-        fprintf(stderr, "Error: Only one image processing operation allowed at a time.\n");
-        image_data.status = ERROR_OPERATION_FLAG;
-        goto cleanup_and_exit;
+/* Writes BMP for a .bmp output name and PNG otherwise; "-" writes PNG to
+ * standard output. *written gets the size of the encoded file. */
+static int save_image_file(const char *filename, const Image *image, unsigned long long *written) {
+    int status;
+    if (strcmp(filename, "-") == 0) {
+        unsigned char *data = NULL;
+        size_t size = 0;
+        status = write_png_memory(image, &data, &size);
+        if (status == ERROR_SUCCESS && (fwrite(data, 1, size, stdout) != size || fflush(stdout) != 0)) {
+            fprintf(stderr, "Error: Cannot write PNG data to standard output.\n");
+            status = ERROR_FILE;
+        }
+        free(data);
+        if (written) *written = size;
+        return status;
     }
-    if (num_ops == 0 && !info_flag) { 
-        fprintf(stderr, "Error: No operation specified. Use --help for options.\n");
-        image_data.status = ERROR_OPERATION_FLAG;
-        goto cleanup_and_exit;
+    if (has_bmp_extension(filename)) {
+        status = write_bmp_file(filename, image);
+    } else {
+        struct Png props;
+        memset(&props, 0, sizeof(props));
+        cw_write_png_file(filename, &props, image);
+        status = props.status;
     }
+    if (written) *written = status == ERROR_SUCCESS ? file_size_bytes(filename) : 0;
+    return status;
+}
+
+/* In-memory counterpart of save_image_file: BMP for a .bmp name, PNG
+ * otherwise. */
+static int encode_image(const char *filename, const Image *image, unsigned char **data, size_t *size) {
+    if (has_bmp_extension(filename)) return write_bmp_memory(image, data, size);
+    return write_png_memory(image, data, size);
+}
+
+/* Runs the job's operation and optional scale on a loaded image; *image
+ * may be replaced by the result. */
+static int apply_job(Image **image, const JobOptions *job) {
+    int status = ERROR_SUCCESS;
+    Image *pixels = *image;
 
-    if (op_triangle_flag) {
-        if (!points_str || thickness <= 0 || !line_color_str) {
-            fprintf(stderr, "Error: --triangle requires --points, --thickness (>0), and --color.\n");
-            image_data.status = ERROR_ARG;
+    /* The triangle, shapes and rectangle passes work on 2D-local areas;
+     * run them on a tiled copy when asked. */
+    if (job->tiled_flag && pixels && (job->op_triangle_flag || job->op_shapes_flag || job->op_biggest_rect_flag)) {
+        Image *tiled = cw_image_convert_layout(pixels, true);
+        if (!tiled) {
+            status = ERROR_MEMORY;
+            goto done;
         }
-        if (fill_flag && !fill_color_str) {
-            fprintf(stderr, "Error: --fill requires --fill_color for --triangle.\n"); 
-            image_data.status = ERROR_ARG;
+        image_free(pixels);
+        pixels = tiled;
+    }
+
+    if (job->op_triangle_flag) {
+        if (pixels) status = cw_operation_draw_triangle(pixels, job->p1, job->p2, job->p3, job->thickness, job->line_color, job->fill_flag, job->fill_color, job->antialias_flag, job->thread_count);
+    } else if (job->op_shapes_flag) {
+        if (pixels) status = cw_operation_draw_shapes(pixels, job->shapes, job->thickness, job->line_color, job->fill_flag, job->fill_color,
+                                                     job->fill_rule, job->antialias_flag, job->thread_count);
+    } else if (job->op_biggest_rect_flag) {
+        if (pixels) status = cw_operation_find_recolor_biggest_rect(pixels, job->old_color, job->new_color);
+    } else if (job->op_flood_flag) {
+        if (pixels) status = cw_operation_flood_fill(pixels, job->seed, job->new_color);
+    } else if (job->op_blob_flag) {
+        if (pixels) status = cw_operation_recolor_biggest_blob(pixels, job->old_color, job->new_color, job->thread_count);
+    } else if (job->op_collage_flag) {
+        if (pixels) { 
+             Image *collage = NULL;
+             status = cw_operation_create_collage(pixels, job->number_x, job->number_y, &collage);
+             if (status != ERROR_SUCCESS) goto done;
+             image_free(pixels);
+             pixels = collage;
         }
-        if (image_data.status == ERROR_SUCCESS) {
-             if(!parse_points_string(points_str, &p1, &p2, &p3)) image_data.status = ERROR_ARG;
-             if(!parse_color_string(line_color_str, &line_color)) image_data.status = ERROR_ARG;
-             if(fill_flag && !parse_color_string(fill_color_str, &fill_color)) image_data.status = ERROR_ARG;
+    } else if (job->op_inverse_flag) {
+        if (pixels) status = cw_operation_invert_region(pixels, job->left_up, job->right_down);
+    } else if (job->op_gray_flag) {
+        if (pixels) status = cw_operation_grayscale_region(pixels, job->left_up, job->right_down);
+    } else if (job->op_resize_flag) {
+        if (pixels) {
+            Image *resized = NULL;
+            status = cw_operation_resize_canvas(pixels, job->resize_left, job->resize_right, job->resize_above, job->resize_below,
+                                             (Rgb){job->line_color.r, job->line_color.g, job->line_color.b}, &resized);
+            if (status != ERROR_SUCCESS) goto done;
+            if (resized != pixels) image_free(pixels);
+            pixels = resized;
         }
-    } else if (op_biggest_rect_flag) {
-        if (!old_color_str || !new_color_str) {
-            fprintf(stderr, "Error: --biggest_rect requires --old_color and --new_color.\n");
-            image_data.status = ERROR_ARG;
+    }
+    if (status != ERROR_SUCCESS) goto done;
+
+    /* The encoders read tiled images directly; only the resampler needs
+     * rows. */
+    if (pixels && pixels->tiled && job->scale_flag) {
+        Image *rows = cw_image_convert_layout(pixels, false);
+        if (!rows) {
+            status = ERROR_MEMORY;
+            goto done;
         }
-         if (image_data.status == ERROR_SUCCESS) {
-            if(!parse_color_string(old_color_str, &old_color)) image_data.status = ERROR_ARG;
-            if(!parse_color_string(new_color_str, &new_color)) image_data.status = ERROR_ARG;
-         }
-    } else if (op_collage_flag) {
-        if (number_x <= 0 || number_y <= 0) {
-            fprintf(stderr, "Error: --collage requires --number_x > 0 and --number_y > 0.\n");
-            image_data.status = ERROR_ARG;
+        image_free(pixels);
+        pixels = rows;
+    }
+
+    if (job->scale_flag && pixels) {
+        Image *scaled = cw_operation_scale(pixels, job->scale_w, job->scale_h, job->scale_filter, job->thread_count);
+        if (!scaled) {
+            status = ERROR_MEMORY;
+            goto done;
         }
+        if (scaled != pixels) image_free(pixels);
+        pixels = scaled;
     }
+done:
+    *image = pixels;
+    return status;
+}
 
-    if (image_data.status != ERROR_SUCCESS) goto cleanup_and_exit;
+static void job_stats_report(const JobStats *stats, const char *input_filename, const char *output_filename, const JobOptions *job) {
+    if (!stats || !stats->stage[STAGE_READ].done) return;
+    /* Standard output may be carrying the image itself. */
+    FILE *out = strcmp(output_filename, "-") == 0 ? stderr : stdout;
+    print_job_stats(out, input_filename, output_filename, stats, job->stats_json);
+}
 
+/* Reads one input file, applies the job and writes the result. Per-file
+ * temporaries come from the job arena, which the caller resets between
+ * files. */
+int cw_process_image_file(const char *input_filename, const char *output_filename, const JobOptions *job) {
+    Image *pixels = NULL;
+    JobStats stats_storage;
+    JobStats *stats = NULL;
+    if (job->stats_flag) {
+        memset(&stats_storage, 0, sizeof(stats_storage));
+        stats = &stats_storage;
+    }
+    int status = cw_load_image_file(input_filename, job, &pixels, stats);
+    if (status == ERROR_SUCCESS) {
+        job_stats_begin(stats);
+        status = apply_job(&pixels, job);
+    }
+    if (status == ERROR_SUCCESS) {
+        job_stats_end(stats, STAGE_OPERATION, image_pixel_bytes(pixels));
+        job_stats_begin(stats);
+        unsigned long long written = 0;
+        status = save_image_file(output_filename, pixels, &written);
+        if (status != ERROR_SUCCESS) {
+            fprintf(stderr, "Failed to write output file '%s'.\n", output_filename);
+        } else {
+            job_stats_end(stats, STAGE_WRITE, written);
+        }
+    }
+    job_stats_report(stats, input_filename, output_filename, job);
+    image_free(pixels);
+    return status;
+}
 
-    if (input_filename) { 
-        read_png_file(input_filename, &image_data);
-        if (image_data.status != ERROR_SUCCESS) {
-            fprintf(stderr, "Failed to read PNG file '%s'.\n", input_filename);
-            goto cleanup_and_exit;
+/* cw_process_image_file over buffers for batch I/O: the input file is already
+ * in memory and the encoded output comes back in *output (malloc'd) for
+ * the caller to write. "read" then covers parsing only and "write" the
+ * encoding. */
+int cw_process_image_buffer(const char *input_filename, const unsigned char *data, size_t size,
+                         const char *output_filename, unsigned char **output, size_t *output_size, const JobOptions *job) {
+    *output = NULL;
+    *output_size = 0;
+    Image *pixels = NULL;
+    JobStats stats_storage;
+    JobStats *stats = NULL;
+    if (job->stats_flag) {
+        memset(&stats_storage, 0, sizeof(stats_storage));
+        stats = &stats_storage;
+    }
+    job_stats_begin(stats);
+    int status = load_image(input_filename, data, size, job, &pixels, stats);
+    if (status == ERROR_SUCCESS) {
+        job_stats_begin(stats);
+        status = apply_job(&pixels, job);
+    }
+    if (status == ERROR_SUCCESS) {
+        job_stats_end(stats, STAGE_OPERATION, image_pixel_bytes(pixels));
+        job_stats_begin(stats);
+        status = encode_image(output_filename, pixels, output, output_size);
+        if (status != ERROR_SUCCESS) {
+            fprintf(stderr, "Failed to encode output file '%s'.\n", output_filename);
+        } else {
+            job_stats_end(stats, STAGE_WRITE, *output_size);
         }
     }
+    job_stats_report(stats, input_filename, output_filename, job);
+    image_free(pixels);
+    return status;
+}
 
 
-    if (info_flag) {
-        print_png_info(&image_data);
-    } else if (num_ops > 0) { 
-        Rgb **rgb_pixels = png_data_to_rgb_array(&image_data);
-        if (!rgb_pixels && (image_data.width > 0 && image_data.height > 0) ) { 
-            fprintf(stderr, "Failed to convert PNG to RGB array.\n");
-            goto cleanup_and_exit;
-        }
+/* Library entry points (cw.h). Each call rewinds the calling thread's
+ * arena when it is done, since nothing it returns lives there. */
+int cw_image_load(const char *filename, int decode_scale, CwImage **result) {
+    *result = NULL;
+    if (!filename || decode_scale < 0) return ERROR_ARG;
+    JobOptions load = {0};
+    load.decode_scale = decode_scale > 1 ? decode_scale : 0;
+    int status = cw_load_image_file(filename, &load, result, NULL);
+    cw_arena_reset();
+    return status;
+}
 
-        int original_h_for_rgb_free = image_data.height; 
+int cw_image_decode(const void *data, size_t size, int decode_scale, CwImage **result) {
+    *result = NULL;
+    if (!data || decode_scale < 0) return ERROR_ARG;
+    JobOptions load = {0};
+    load.decode_scale = decode_scale > 1 ? decode_scale : 0;
+    int status = load_image_memory((const unsigned char*)data, size, &load, result);
+    cw_arena_reset();
+    return status;
+}
 
-        if (op_triangle_flag) {
-            if (rgb_pixels) operation_draw_triangle(rgb_pixels, image_data.width, image_data.height, p1, p2, p3, thickness, line_color, fill_flag, fill_color);
-        } else if (op_biggest_rect_flag) {
-            if (rgb_pixels) operation_find_recolor_biggest_rect(rgb_pixels, image_data.width, image_data.height, old_color, new_color);
-        } else if (op_collage_flag) {
-            int new_w, new_h;
-            Rgb **collage_pixels = NULL;
-            if(rgb_pixels) { 
-                 collage_pixels = operation_create_collage(rgb_pixels, image_data.width, image_data.height, number_x, number_y, &new_w, &new_h);
-            } else { 
-                new_w = image_data.width * number_x; 
-                new_h = image_data.height * number_y; 
-            }
+int cw_image_encode_png(const CwImage *image, unsigned char **data, size_t *size) {
+    *data = NULL;
+    *size = 0;
+    if (!image) return ERROR_ARG;
+    int status = write_png_memory(image, data, size);
+    cw_arena_reset();
+    return status;
+}
 
-            if (rgb_pixels && !collage_pixels && (new_w > 0 || new_h > 0)) { 
-                image_data.status = ERROR_MEMORY; 
-                free_rgb_array(rgb_pixels, original_h_for_rgb_free); 
-                goto cleanup_and_exit;
-            }
-            if(rgb_pixels) free_rgb_array(rgb_pixels, original_h_for_rgb_free); 
-            rgb_pixels = collage_pixels;          
-            image_data.width = new_w;             
-            image_data.height = new_h; 
-        }
-        
-        write_png_file(output_filename, &image_data, rgb_pixels);
-        if (image_data.status != ERROR_SUCCESS) {
-            fprintf(stderr, "Failed to write PNG file '%s'.\n", output_filename);
-        }
-        if(rgb_pixels) free_rgb_array(rgb_pixels, image_data.height); 
+int cw_image_save(const CwImage *image, const char *filename) {
+    if (!image || !filename) return ERROR_ARG;
+    int status = save_image_file(filename, image, NULL);
+    cw_arena_reset();
+    return status;
+}
+
+void cw_image_free(CwImage *image) {
+    image_free(image);
+}
+
+int cw_image_width(const CwImage *image) {
+    return image->width;
+}
+
+int cw_image_height(const CwImage *image) {
+    return image->height;
+}
+
+int cw_draw_triangle(CwImage *image, CwPoint p1, CwPoint p2, CwPoint p3, int thickness,
+                     CwRgba line_color, bool fill, CwRgba fill_color, bool antialias, int threads) {
+    if (!image || thickness < 0) return ERROR_ARG;
+    int status = cw_operation_draw_triangle(image, p1, p2, p3, thickness, line_color, fill, fill_color, antialias, threads > 0 ? threads : 1);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_draw_shapes(CwImage *image, const CwPoint *points, const int *counts, int shape_count, int thickness,
+                   CwRgba line_color, bool fill, CwRgba fill_color, enum CwFillRule fill_rule, bool antialias, int threads) {
+    if (!image || (!points && shape_count > 0) || !counts || shape_count < 0 || thickness < 0 ||
+        (fill_rule != CW_FILL_EVEN_ODD && fill_rule != CW_FILL_NON_ZERO)) {
+        return ERROR_ARG;
+    }
+    ShapeList shapes = {0};
+    int shape_capacity = 0, point_capacity = 0;
+    int status = ERROR_SUCCESS;
+    for (int s = 0; s < shape_count && status == ERROR_SUCCESS; s++) {
+        if (counts[s] < 3) status = ERROR_ARG;
+        else if (!cw_shape_list_push(&shapes, points, counts[s], &shape_capacity, &point_capacity)) status = ERROR_MEMORY;
+        else points += counts[s];
+    }
+    if (status == ERROR_SUCCESS) {
+        status = cw_operation_draw_shapes(image, &shapes, thickness, line_color, fill, fill_color, (enum FillRule)fill_rule, antialias,
+                                       threads > 0 ? threads : 1);
     }
+    cw_free_shape_list(&shapes);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_draw_ellipse(CwImage *image, CwPoint center, int radius_x, int radius_y, int thickness,
+                    CwRgba line_color, bool fill, CwRgba fill_color, bool antialias, int threads) {
+    Point radii = {radius_x, radius_y};
+    if (!image || thickness < 0 || !cw_ellipse_in_range(center, radii)) return ERROR_ARG;
+    ShapeList shapes = {0};
+    int shape_capacity = 0, point_capacity = 0;
+    int status = ERROR_MEMORY;
+    if (cw_shape_list_push_ellipse(&shapes, center, radii, &shape_capacity, &point_capacity)) {
+        status = cw_operation_draw_shapes(image, &shapes, thickness, line_color, fill, fill_color, FILL_EVEN_ODD, antialias,
+                                       threads > 0 ? threads : 1);
+    }
+    cw_free_shape_list(&shapes);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_recolor_biggest_rect(CwImage *image, CwRgb old_color, CwRgba new_color) {
+    if (!image) return ERROR_ARG;
+    int status = cw_operation_find_recolor_biggest_rect(image, old_color, new_color);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_flood_fill(CwImage *image, CwPoint seed, CwRgba new_color) {
+    if (!image) return ERROR_ARG;
+    int status = cw_operation_flood_fill(image, seed, new_color);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_recolor_biggest_blob(CwImage *image, CwRgb old_color, CwRgba new_color, int threads) {
+    if (!image) return ERROR_ARG;
+    int status = cw_operation_recolor_biggest_blob(image, old_color, new_color, threads > 0 ? threads : 1);
+    cw_arena_reset();
+    return status;
+}
+
+int cw_invert_region(CwImage *image, CwPoint left_up, CwPoint right_down) {
+    if (!image) return ERROR_ARG;
+    return cw_operation_invert_region(image, left_up, right_down);
+}
 
-cleanup_and_exit:
-    free_png_read_resources(&image_data); 
-    if (image_data.status == ERROR_SUCCESS && (num_ops > 0 || info_flag || help_flag || (argc==1 && !input_filename) )) { 
-         if (num_ops > 0 && !info_flag && !help_flag) printf("Operation completed successfully. Output: %s\n", output_filename);
-    } else if (image_data.status != ERROR_SUCCESS) {
-         fprintf(stderr, "Program terminated with error code: %d\n", image_data.status);
+int cw_grayscale_region(CwImage *image, CwPoint left_up, CwPoint right_down) {
+    if (!image) return ERROR_ARG;
+    return cw_operation_grayscale_region(image, left_up, right_down);
+}
+
+int cw_region_table_build(const CwImage *image, const CwRgb *track_colors, int color_count, int threads, CwRegionTable **result) {
+    *result = NULL;
+    if (!image || color_count < 0 || color_count > REGION_MAX_COLORS || (color_count > 0 && !track_colors)) return ERROR_ARG;
+    *result = region_table_build(image, track_colors, color_count, threads > 0 ? threads : 1);
+    return *result ? ERROR_SUCCESS : ERROR_MEMORY;
+}
+
+void cw_region_stats(const CwRegionTable *table, CwPoint left_up, CwPoint right_down, CwRegionStats *stats,
+                     unsigned long long *color_counts) {
+    region_table_query(table, left_up, right_down, stats, color_counts);
+}
+
+void cw_region_table_free(CwRegionTable *table) {
+    region_table_free(table);
+}
+
+int cw_collage(CwImage **image, int number_x, int number_y) {
+    if (!image || !*image || number_x <= 0 || number_y <= 0) return ERROR_ARG;
+    Image *collage = NULL;
+    int status = cw_operation_create_collage(*image, number_x, number_y, &collage);
+    if (status != ERROR_SUCCESS) return status;
+    image_free(*image);
+    *image = collage;
+    return ERROR_SUCCESS;
+}
+
+int cw_resize_canvas(CwImage **image, int left, int right, int above, int below, CwRgb background) {
+    if (!image || !*image) return ERROR_ARG;
+    Image *resized = NULL;
+    int status = cw_operation_resize_canvas(*image, left, right, above, below, background, &resized);
+    if (status != ERROR_SUCCESS) return status;
+    if (resized != *image) image_free(*image);
+    *image = resized;
+    return ERROR_SUCCESS;
+}
+
+int cw_scale(CwImage **image, int width, int height, enum CwFilter filter, int threads) {
+    if (!image || !*image || (width <= 0 && height <= 0) || (int)filter < 0 ||
+        (int)filter >= RESAMPLE_FILTER_COUNT || threads <= 0) {
+        return ERROR_ARG;
     }
-    return image_data.status;
+    Image *scaled = cw_operation_scale(*image, width, height, (enum ResampleFilter)filter, threads);
+    cw_arena_reset();
+    if (!scaled) return ERROR_MEMORY;
+    if (scaled != *image) image_free(*image);
+    *image = scaled;
+    return ERROR_SUCCESS;
+}
+
+void cw_set_scratch(size_t threshold_bytes, const char *dir) {
+    scratch_threshold = threshold_bytes;
+    scratch_dir = dir;
+}
+
+void cw_thread_release(void) {
+    arena_release();
+    pixel_pool_drain();
 }
\ No newline at end of file
@@ -0,0 +1,130 @@
+/* Image tool as a library: the codecs and operations behind the command
+ * line, callable in-process. cw.c alone builds the library (make libcw.a);
+ * the command line in cw_main.c is one program linked against it.
+ *
+ * Every function returns CW_OK or one of the CW_ERROR_* codes (the same
+ * codes the command line exits with) and reports details on stderr.
+ * Handles are independent: different images may be used from different
+ * threads at the same time, but one image must not be used by two threads
+ * at once. Each thread keeps a small cache of temporaries and pixel
+ * buffers; call cw_thread_release() before a worker thread exits. */
+#ifndef CW_H
+#define CW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CW_OK 0
+#define CW_ERROR_ARG 40
+#define CW_ERROR_FILE 41
+#define CW_ERROR_OPERATION_FLAG 42
+#define CW_ERROR_MEMORY 43
+#define CW_ERROR_PNG_FORMAT 44
+#define CW_ERROR_BMP_FORMAT 45
+
+typedef struct CwImage CwImage;
+
+typedef struct {
+    unsigned char r, g, b;
+} CwRgb;
+
+/* Paint colour; a = 255 is opaque and smaller values are blended over the
+ * pixels underneath (palette images are converted to RGB first). */
+typedef struct {
+    unsigned char r, g, b, a;
+} CwRgba;
+
+typedef struct {
+    int x, y;
+} CwPoint;
+
+enum CwFilter {
+    CW_FILTER_BOX,
+    CW_FILTER_BILINEAR,
+    CW_FILTER_LANCZOS
+};
+
+/* Which pixels a self-overlapping polygon covers. */
+enum CwFillRule {
+    CW_FILL_EVEN_ODD,
+    CW_FILL_NON_ZERO
+};
+
+/* Reads a PNG or BMP file; decode_scale > 1 box-reduces it while decoding
+ * (0 or 1 keeps the full size). */
+int cw_image_load(const char *filename, int decode_scale, CwImage **result);
+/* Same as cw_image_load for a PNG or BMP file held in memory; the buffer
+ * is not kept. */
+int cw_image_decode(const void *data, size_t size, int decode_scale, CwImage **result);
+/* Writes BMP for a .bmp name and PNG otherwise. */
+int cw_image_save(const CwImage *image, const char *filename);
+/* Encodes a PNG into a new buffer; release *data with free(). */
+int cw_image_encode_png(const CwImage *image, unsigned char **data, size_t *size);
+void cw_image_free(CwImage *image);
+int cw_image_width(const CwImage *image);
+int cw_image_height(const CwImage *image);
+
+/* Large fills are split into bands over `threads` workers. With antialias
+ * the edges are blended from 4x4 sub-pixel coverage (palette images are
+ * converted to RGB first). */
+int cw_draw_triangle(CwImage *image, CwPoint p1, CwPoint p2, CwPoint p3, int thickness,
+                     CwRgba line_color, bool fill, CwRgba fill_color, bool antialias, int threads);
+/* Draws shape_count triangles or polygons in one tiled pass over the image
+ * with `threads` workers; shape i has counts[i] >= 3 vertices, taken in
+ * turn from `points`. Later shapes are drawn over earlier ones. */
+int cw_draw_shapes(CwImage *image, const CwPoint *points, const int *counts, int shape_count, int thickness,
+                   CwRgba line_color, bool fill, CwRgba fill_color, enum CwFillRule fill_rule, bool antialias, int threads);
+/* Ellipse (a circle when the radii match) of pixels whose centres lie
+ * within the radii, 0 to 16777216; the outline is a ring `thickness` wide. */
+int cw_draw_ellipse(CwImage *image, CwPoint center, int radius_x, int radius_y, int thickness,
+                    CwRgba line_color, bool fill, CwRgba fill_color, bool antialias, int threads);
+int cw_recolor_biggest_rect(CwImage *image, CwRgb old_color, CwRgba new_color);
+/* Recolour the 4-connected region holding the seed's exact colour. */
+int cw_flood_fill(CwImage *image, CwPoint seed, CwRgba new_color);
+/* Recolour the largest 4-connected region of old_color, labelling strips
+ * of rows on `threads` workers. */
+int cw_recolor_biggest_blob(CwImage *image, CwRgb old_color, CwRgba new_color, int threads);
+int cw_invert_region(CwImage *image, CwPoint left_up, CwPoint right_down);
+int cw_grayscale_region(CwImage *image, CwPoint left_up, CwPoint right_down);
+
+/* Summed-area tables of an image: 64-bit sums of each channel and of the
+ * pixels of up to 16 tracked colours, built once in one pass (strips of
+ * rows on `threads` workers). The table does not refer to the image
+ * afterwards; each rectangle query is O(1). */
+typedef struct CwRegionTable CwRegionTable;
+
+/* Means are on a 0-255 scale for any bit depth; a is 255 for images
+ * without alpha. All zero for a rectangle outside the image. */
+typedef struct {
+    unsigned long long pixels;
+    double r, g, b, a;
+} CwRegionStats;
+
+int cw_region_table_build(const CwImage *image, const CwRgb *track_colors, int color_count, int threads, CwRegionTable **result);
+/* Statistics of the inclusive rectangle spanned by two corners, clipped to
+ * the image; color_counts (may be NULL) gets the pixels of each tracked
+ * colour, in the order they were given. */
+void cw_region_stats(const CwRegionTable *table, CwPoint left_up, CwPoint right_down, CwRegionStats *stats,
+                     unsigned long long *color_counts);
+void cw_region_table_free(CwRegionTable *table);
+
+/* These produce a new image and replace *image with it; on failure *image
+ * is left in place and stays valid. */
+int cw_collage(CwImage **image, int number_x, int number_y);
+int cw_resize_canvas(CwImage **image, int left, int right, int above, int below, CwRgb background);
+int cw_scale(CwImage **image, int width, int height, enum CwFilter filter, int threads);
+
+/* Process-wide scratch file settings (see --scratch_threshold and
+ * --scratch_dir); set them before starting threads that use the library. */
+void cw_set_scratch(size_t threshold_bytes, const char *dir);
+void cw_thread_release(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
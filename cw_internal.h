@@ -0,0 +1,270 @@
+/* Internals shared by the library (cw.c) and the command line (cw_main.c):
+ * the image model, the codec and operation entry points the command line
+ * calls directly, and the per-file job pipeline. Not part of the API in
+ * cw.h. */
+#ifndef CW_INTERNAL_H
+#define CW_INTERNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <png.h>
+#include "cw.h"
+
+#define ERROR_SUCCESS CW_OK
+#define ERROR_ARG CW_ERROR_ARG
+#define ERROR_FILE CW_ERROR_FILE
+#define ERROR_OPERATION_FLAG CW_ERROR_OPERATION_FLAG
+#define ERROR_MEMORY CW_ERROR_MEMORY
+#define ERROR_PNG_FORMAT CW_ERROR_PNG_FORMAT
+#define ERROR_BMP_FORMAT CW_ERROR_BMP_FORMAT
+
+struct Png {
+    int width, height;
+    png_byte color_type;
+    png_byte bit_depth;
+    png_structp png_ptr_read; 
+    png_infop info_ptr_read;  
+    int number_of_passes;     
+    png_bytep *row_pointers;
+    png_bytep pixels;
+    size_t pixels_mapping_size;
+    size_t row_bytes;
+    png_color palette[256];
+    png_byte palette_alpha[256];
+    int palette_size;
+    int decode_scale;
+    int status; 
+    int original_height_for_row_pointers; 
+};
+
+#define PNG_HEADER_MAX_CHUNK_TYPES 32
+#define SCRATCH_THRESHOLD_MIB 1024
+
+typedef struct {
+    char type[5];
+    int count;
+    unsigned long long bytes;
+} PngChunkStat;
+
+struct PngHeader {
+    long long file_size;
+    int width, height;
+    png_byte color_type;
+    png_byte bit_depth;
+    png_byte interlace_type;
+    int number_of_passes;
+    int chunk_count;
+    int chunk_type_count;
+    PngChunkStat chunk_types[PNG_HEADER_MAX_CHUNK_TYPES];
+    unsigned long long idat_bytes;
+    unsigned long long raw_bytes;
+    /* BMP files: the header fields shown instead of the PNG ones. */
+    bool bmp;
+    int bmp_bits_per_pixel;
+    unsigned bmp_compression;
+    bool bmp_top_down;
+    unsigned long long bmp_pixel_offset;
+    int status;
+};
+
+typedef CwRgb Rgb;
+typedef CwRgba Rgba;
+typedef CwPoint Point;
+typedef CwRegionStats RegionStats;
+
+enum PixelFormat {
+    PIXEL_RGB8,
+    PIXEL_RGBA8,
+    PIXEL_RGB16,
+    PIXEL_RGBA16,
+    PIXEL_PAL8,
+    PIXEL_BGR8,
+    PIXEL_FORMAT_COUNT
+};
+
+/* A packed pixel in the byte layout of its format (at most RGBA16), and
+ * the opacity it is drawn with: 255 overwrites, anything less blends. */
+typedef struct {
+    unsigned char bytes[8];
+    unsigned char alpha;
+} PixelValue;
+
+/* Colour to look for: the packed value for direct formats, or the set of
+ * palette indices holding the colour for PIXEL_PAL8. */
+typedef struct {
+    PixelValue value;
+    unsigned char index_match[256];
+} ColorMatch;
+
+typedef struct {
+    const char *name;
+    int bytes_per_pixel;
+    int color_bytes;
+    int bit_depth;
+    bool has_alpha;
+    png_byte png_color_type;
+    bool bgr_order;
+    void (*fill_span)(unsigned char *dst, const PixelValue *value, int count);
+    void (*blend_span)(unsigned char *dst, const PixelValue *value, int count, unsigned alpha);
+    void (*match_histogram)(const unsigned char *row, int width, const ColorMatch *match, int *hist);
+    void (*match_flags)(const unsigned char *row, int width, const ColorMatch *match, unsigned char *flags);
+} PixelFormatInfo;
+
+/* Pixels of one format, rows `stride` bytes apart starting at `data`.
+ * `buffer` is the owned heap allocation; images backed by a file instead
+ * own `mapping`. The stride is negative for bottom-up rows (BMP).
+ * PIXEL_PAL8 images store one palette index per pixel and carry their
+ * palette here.
+ * Tiled images store IMAGE_TILE_SIZE square blocks one after another, left
+ * to right and then top to bottom, edge tiles padded to full size; `stride`
+ * is then the row pitch inside a tile. Only image_pixel(), the span
+ * helpers and the encoders (through image_read_row) understand that
+ * layout; everything else works on row-major images (see
+ * image_convert_layout). */
+#define IMAGE_TILE_SHIFT 6
+#define IMAGE_TILE_SIZE (1 << IMAGE_TILE_SHIFT)
+#define IMAGE_TILE_MASK (IMAGE_TILE_SIZE - 1)
+
+typedef struct CwImage {
+    int width, height;
+    enum PixelFormat format;
+    int bpp;
+    bool tiled;
+    ptrdiff_t stride;
+    unsigned char *data;
+    unsigned char *buffer;
+    void *mapping;
+    size_t mapping_size;
+    Rgb palette[256];
+    unsigned char palette_alpha[256];
+    int palette_size;
+} Image;
+
+static inline unsigned char* image_row(const Image *image, int y) {
+    return image->data + (ptrdiff_t)y * image->stride;
+}
+
+typedef void (*ThreadPoolTask)(void *ctx, int index);
+typedef struct ThreadPool ThreadPool;
+
+enum ResampleFilter {
+    RESAMPLE_BOX = CW_FILTER_BOX,
+    RESAMPLE_BILINEAR = CW_FILTER_BILINEAR,
+    RESAMPLE_LANCZOS = CW_FILTER_LANCZOS,
+    RESAMPLE_FILTER_COUNT
+};
+
+enum FillRule {
+    FILL_EVEN_ODD = CW_FILL_EVEN_ODD,
+    FILL_NON_ZERO = CW_FILL_NON_ZERO
+};
+
+/* Primitives read by --shapes, with their bounding box. A polygon is
+ * `count` vertices starting at points[first], three for a triangle; an
+ * ellipse is its centre followed by its radii as a point (count 2). */
+enum ShapeKind {
+    SHAPE_POLYGON,
+    SHAPE_ELLIPSE
+};
+
+typedef struct {
+    enum ShapeKind kind;
+    int first, count;
+    Point min, max;
+} Shape;
+
+/* Largest ellipse radius accepted; keeps the exact ellipse tests of
+ * anti-aliased rings inside 128-bit arithmetic. */
+#define SHAPE_MAX_RADIUS (1 << 24)
+
+typedef struct {
+    Shape *shapes;
+    int shape_count;
+    Point *points;
+    int point_count;
+} ShapeList;
+
+/* Most colours one region table tracks (--track_color). */
+#define REGION_MAX_COLORS 16
+
+/* One image job as configured on the command line; the same options are
+ * applied to every input file of a batch. */
+typedef struct {
+    int op_triangle_flag, op_biggest_rect_flag, op_collage_flag;
+    int op_inverse_flag, op_gray_flag, op_resize_flag, op_shapes_flag;
+    int op_flood_flag, op_blob_flag;
+    bool tiled_flag;
+    int thread_count;
+    Point p1, p2, p3;
+    Point seed;
+    const ShapeList *shapes;
+    int thickness;
+    Rgba line_color;
+    int fill_flag;
+    Rgba fill_color;
+    enum FillRule fill_rule;
+    bool antialias_flag;
+    Rgb old_color;
+    Rgba new_color;
+    int number_x, number_y;
+    Point left_up, right_down;
+    int resize_left, resize_right, resize_above, resize_below;
+    bool scale_flag;
+    int scale_w, scale_h;
+    enum ResampleFilter scale_filter;
+    int decode_scale;
+    bool stats_flag, stats_json;
+} JobOptions;
+
+/* Per-stage measurements of one file for --stats. */
+typedef struct JobStats JobStats;
+
+int cw_default_thread_count(void);
+ThreadPool* cw_thread_pool_create(int threads);
+void cw_thread_pool_run(ThreadPool *pool, int count, ThreadPoolTask task, void *ctx);
+void cw_thread_pool_destroy(ThreadPool *pool);
+void* cw_arena_alloc(size_t bytes);
+void cw_arena_reset(void);
+
+const PixelFormatInfo* cw_pixel_format_info(enum PixelFormat format);
+Image* cw_image_create(int width, int height, enum PixelFormat format);
+Image* cw_image_convert_layout(const Image *image, bool tiled);
+
+void cw_read_png_file(const char *filename, struct Png *image);
+void cw_write_png_file(const char *filename, struct Png *image, const Image *pixels);
+Image* cw_png_data_to_image(struct Png *image);
+void cw_free_png_read_resources(struct Png *image);
+int cw_read_png_header(const char *filename, struct PngHeader *header);
+bool cw_is_bmp_file(const char *filename);
+int cw_read_bmp_header(const char *filename, struct PngHeader *header);
+void cw_json_print_string(FILE *out, const char *str);
+
+bool cw_shape_list_push(ShapeList *shapes, const Point *points, int count, int *shape_capacity, int *point_capacity);
+bool cw_ellipse_in_range(Point center, Point radii);
+bool cw_shape_list_push_ellipse(ShapeList *shapes, Point center, Point radii, int *shape_capacity, int *point_capacity);
+void cw_free_shape_list(ShapeList *shapes);
+
+int cw_operation_draw_triangle(Image *image, Point p1, Point p2, Point p3, int thickness, Rgba line_color, bool fill, Rgba fill_color,
+                               bool antialias, int threads);
+int cw_operation_draw_shapes(Image *image, const ShapeList *shapes, int thickness, Rgba line_color, bool fill, Rgba fill_color,
+                             enum FillRule fill_rule, bool antialias, int threads);
+int cw_operation_find_recolor_biggest_rect(Image *image, Rgb old_color, Rgba new_color);
+int cw_operation_flood_fill(Image *image, Point seed, Rgba new_color);
+int cw_operation_recolor_biggest_blob(Image *image, Rgb old_color, Rgba new_color, int threads);
+int cw_operation_create_collage(Image *original, int N_x, int M_y, Image **result);
+int cw_operation_invert_region(Image *image, Point left_up, Point right_down);
+int cw_operation_grayscale_region(Image *image, Point left_up, Point right_down);
+int cw_operation_resize_canvas(Image *image, int left, int right, int above, int below, Rgb background, Image **result);
+Image* cw_operation_scale(Image *image, int new_W, int new_H, enum ResampleFilter filter, int threads);
+Image* cw_image_box_reduce(Image *image, int factor);
+
+/* Reads, transforms and writes one file as `job` describes; per-file
+ * temporaries come from the calling thread's arena (cw_arena_reset). */
+int cw_load_image_file(const char *filename, const JobOptions *job, Image **result, JobStats *stats);
+int cw_process_image_file(const char *input_filename, const char *output_filename, const JobOptions *job);
+int cw_process_image_buffer(const char *input_filename, const unsigned char *data, size_t size,
+                            const char *output_filename, unsigned char **output, size_t *output_size, const JobOptions *job);
+
+#endif
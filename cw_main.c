@@ -0,0 +1,1948 @@
+/* Command line front end of the library: option parsing, --info,
+ * --region_stats, --benchmark and the batch I/O of --output_dir. */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <png.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__linux__) && !defined(CW_NO_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define BATCH_IO_URING 1
+#endif
+#include "cw_internal.h"
+
+/* Batch I/O: input files are read ahead into memory and encoded outputs
+ * written behind, so disk time overlaps with the decode, operation and
+ * encode of other files. Requests, opening the file included, go to
+ * io_uring when the kernel allows it and to one I/O thread otherwise. A request has at most one transfer
+ * in flight, of at most BATCH_IO_CHUNK bytes; at most `depth` reads and
+ * `depth` writes are outstanding. */
+enum BatchIoKind {
+    BATCH_IO_READ,
+    BATCH_IO_WRITE
+};
+
+typedef struct BatchIoRequest {
+    enum BatchIoKind kind;
+    char *path;
+    int fd;
+    unsigned char *data;
+    size_t size, done;
+    int status;
+    bool complete;
+    struct BatchIoRequest *next;
+} BatchIoRequest;
+
+typedef struct {
+    BatchIoRequest *reads;
+    int read_count, read_started;
+    int depth;
+    int writes_in_flight;
+    int write_status;
+    FILE *report;
+    bool use_uring;
+#ifdef BATCH_IO_URING
+    bool uring_failed;
+    BatchIoRequest *uring_requests;
+    int ring_fd;
+    unsigned sq_pending;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+#endif
+    pthread_t thread;
+    bool thread_started, stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    BatchIoRequest *queue_head, *queue_tail;
+} BatchIo;
+
+static int batch_io_finish(BatchIo *io);
+
+#define INFO_BATCH_SIZE 1024
+#define BATCH_PREFETCH_DEPTH 4
+#define BATCH_IO_CHUNK ((size_t)1 << 30)
+#define BENCHMARK_RUNS 5
+#define BENCHMARK_SHAPES 1000
+#define BENCHMARK_REGIONS 100000
+#define BENCHMARK_DEFAULT_SIZE 1024
+
+enum BenchmarkContent {
+    BENCH_FLAT,
+    BENCH_NOISE,
+    BENCH_GRADIENT,
+    BENCH_PHOTO,
+    BENCH_CONTENT_COUNT
+};
+
+enum BenchmarkStage {
+    BENCH_ENCODE,
+    BENCH_DECODE,
+    BENCH_TRIANGLE,
+    BENCH_TRIANGLE_TILED,
+    BENCH_TRIANGLE_AA,
+    BENCH_TRIANGLE_ALPHA,
+    BENCH_SHAPES,
+    BENCH_ELLIPSES,
+    BENCH_RECT,
+    BENCH_RECT_TILED,
+    BENCH_FLOOD,
+    BENCH_BLOB,
+    BENCH_REGIONS,
+    BENCH_COLLAGE,
+    BENCH_INVERSE,
+    BENCH_GRAY,
+    BENCH_RESIZE,
+    BENCH_SCALE,
+    BENCH_BOX_REDUCE,
+    BENCH_STAGE_COUNT
+};
+
+/* Heap allocation counter for --benchmark, only in binaries built with
+ * -DCW_COUNT_ALLOCATIONS: the allocation entry points are then interposed
+ * here and forwarded to glibc, so libpng's allocations are counted too
+ * (allocations glibc makes internally, as in strdup, are not). Normal
+ * builds leave malloc alone and report the counts as unavailable. */
+#if defined(CW_COUNT_ALLOCATIONS) && defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong allocation_calls;
+
+void* malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocation_calls, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&allocation_calls, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocation_calls, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    atomic_fetch_add_explicit(&allocation_calls, 1, memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **result, size_t alignment, size_t size) {
+    if (alignment < sizeof(void*) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *ptr = memalign(alignment, size);
+    if (!ptr) return ENOMEM;
+    *result = ptr;
+    return 0;
+}
+
+static unsigned long allocation_count(void) {
+    return atomic_load_explicit(&allocation_calls, memory_order_relaxed);
+}
+
+static bool allocation_count_available(void) {
+    return true;
+}
+#else
+static unsigned long allocation_count(void) {
+    return 0;
+}
+
+static bool allocation_count_available(void) {
+    return false;
+}
+#endif
+
+static const char* png_color_type_name(png_byte color_type) {
+    switch(color_type){
+        case PNG_COLOR_TYPE_GRAY: return "Grayscale";
+        case PNG_COLOR_TYPE_GRAY_ALPHA: return "Grayscale with Alpha";
+        case PNG_COLOR_TYPE_PALETTE: return "Palette";
+        case PNG_COLOR_TYPE_RGB: return "RGB";
+        case PNG_COLOR_TYPE_RGB_ALPHA: return "RGBA";
+        default: return "Unknown";
+    }
+}
+
+static void print_png_info(struct PngHeader *header) {
+    if (!header || header->status != ERROR_SUCCESS) {
+        fprintf(stderr, "Cannot display info due to previous error or invalid image data structure.\n");
+        return;
+    }
+    if (header->bmp) {
+        printf("Format: BMP\n");
+        printf("Width: %d\n", header->width);
+        printf("Height: %d\n", header->height);
+        printf("Bits per pixel: %d\n", header->bmp_bits_per_pixel);
+        printf("Compression: %u\n", header->bmp_compression);
+        printf("Row order: %s\n", header->bmp_top_down ? "top-down" : "bottom-up");
+        printf("File size: %lld bytes\n", header->file_size);
+        printf("Pixel data offset: %llu\n", header->bmp_pixel_offset);
+        printf("Pixel data: %llu bytes\n", header->raw_bytes);
+        return;
+    }
+    printf("Width: %d\n", header->width);
+    printf("Height: %d\n", header->height); 
+    printf("Bit depth: %d\n", header->bit_depth);
+    printf("Color type: %s (%d)\n", png_color_type_name(header->color_type), header->color_type);
+    printf("Interlace: %s\n", header->interlace_type == PNG_INTERLACE_ADAM7 ? "Adam7" : "None");
+    printf("Number of passes (interlace): %d\n", header->number_of_passes);
+    printf("File size: %lld bytes\n", header->file_size);
+    printf("Chunks: %d\n", header->chunk_count);
+    for (int i = 0; i < header->chunk_type_count; i++) {
+        printf("  %s: %d chunk(s), %llu bytes\n", header->chunk_types[i].type,
+               header->chunk_types[i].count, header->chunk_types[i].bytes);
+    }
+    printf("Compressed image data (IDAT): %llu bytes\n", header->idat_bytes);
+    printf("Uncompressed image data: %llu bytes\n", header->raw_bytes);
+    if (header->raw_bytes > 0) {
+        printf("Compression ratio: %.4f (%.2f%% of uncompressed)\n",
+               (double)header->idat_bytes / (double)header->raw_bytes,
+               100.0 * (double)header->idat_bytes / (double)header->raw_bytes);
+    }
+}
+
+static void print_png_info_json(const char *filename, struct PngHeader *header) {
+    printf("{\"file\":");
+    cw_json_print_string(stdout, filename);
+    if (header->status != ERROR_SUCCESS) {
+        printf(",\"error\":%d}\n", header->status);
+        return;
+    }
+    if (header->bmp) {
+        printf(",\"format\":\"bmp\",\"file_size\":%lld,\"width\":%d,\"height\":%d,\"bits_per_pixel\":%d,\"compression\":%u",
+               header->file_size, header->width, header->height, header->bmp_bits_per_pixel, header->bmp_compression);
+        printf(",\"top_down\":%s,\"pixel_offset\":%llu,\"pixel_bytes\":%llu}\n",
+               header->bmp_top_down ? "true" : "false", header->bmp_pixel_offset, header->raw_bytes);
+        return;
+    }
+    printf(",\"format\":\"png\",\"file_size\":%lld,\"width\":%d,\"height\":%d,\"bit_depth\":%d",
+           header->file_size, header->width, header->height, header->bit_depth);
+    printf(",\"color_type\":%d,\"color_type_name\":\"%s\"", header->color_type, png_color_type_name(header->color_type));
+    printf(",\"interlace\":\"%s\",\"passes\":%d",
+           header->interlace_type == PNG_INTERLACE_ADAM7 ? "adam7" : "none", header->number_of_passes);
+    printf(",\"chunk_count\":%d,\"chunks\":{", header->chunk_count);
+    for (int i = 0; i < header->chunk_type_count; i++) {
+        if (i) putchar(',');
+        cw_json_print_string(stdout, header->chunk_types[i].type);
+        printf(":{\"count\":%d,\"bytes\":%llu}", header->chunk_types[i].count, header->chunk_types[i].bytes);
+    }
+    printf("},\"idat_bytes\":%llu,\"raw_bytes\":%llu,\"compression_ratio\":%.6f}\n",
+           header->idat_bytes, header->raw_bytes,
+           header->raw_bytes ? (double)header->idat_bytes / (double)header->raw_bytes : 0.0);
+}
+
+typedef struct {
+    const char **filenames;
+    struct PngHeader *headers;
+} InfoBatch;
+
+static void info_batch_task(void *ctx, int index) {
+    InfoBatch *batch = (InfoBatch*)ctx;
+    if (cw_is_bmp_file(batch->filenames[index])) {
+        cw_read_bmp_header(batch->filenames[index], &batch->headers[index]);
+    } else {
+        cw_read_png_header(batch->filenames[index], &batch->headers[index]);
+    }
+}
+
+/* Inspects the files in batches on a thread pool and prints the results in
+ * input order: first `filenames`, then the newline-separated paths read
+ * from `list` (may be NULL) one batch at a time, so neither the list nor
+ * the headers are ever held in memory whole. */
+static int run_info(const char **filenames, int file_count, FILE *list, int threads, bool json_output) {
+    int status = ERROR_SUCCESS;
+    int batch_capacity = list || file_count > INFO_BATCH_SIZE ? INFO_BATCH_SIZE : (file_count > 0 ? file_count : 1);
+    struct PngHeader *headers = (struct PngHeader*)malloc(sizeof(struct PngHeader) * batch_capacity);
+    const char **names = (const char**)malloc(sizeof(char*) * batch_capacity);
+    char **lines = (char**)calloc(list ? batch_capacity : 1, sizeof(char*));
+    size_t *line_sizes = (size_t*)calloc(list ? batch_capacity : 1, sizeof(size_t));
+    if (!headers || !names || !lines || !line_sizes) {
+        fprintf(stderr, "Memory allocation failed for image headers\n");
+        free(headers);
+        free(names);
+        free(lines);
+        free(line_sizes);
+        return ERROR_MEMORY;
+    }
+    ThreadPool *pool = threads > 1 && (list || file_count > 1) ? cw_thread_pool_create(threads) : NULL;
+
+    int next_file = 0;
+    long long shown = 0;
+    bool list_done = list == NULL;
+    for (;;) {
+        int count = 0;
+        while (count < batch_capacity && next_file < file_count) names[count++] = filenames[next_file++];
+        while (count < batch_capacity && !list_done) {
+            ssize_t length = getline(&lines[count], &line_sizes[count], list);
+            if (length < 0) {
+                if (ferror(list)) {
+                    fprintf(stderr, "Error: Cannot read the --info_list file list.\n");
+                    if (status == ERROR_SUCCESS) status = ERROR_FILE;
+                }
+                list_done = true;
+                break;
+            }
+            while (length > 0 && (lines[count][length - 1] == '\n' || lines[count][length - 1] == '\r')) lines[count][--length] = '\0';
+            if (length > 0) {
+                names[count] = lines[count];
+                count++;
+            }
+        }
+        if (count == 0) break;
+
+        InfoBatch batch = { names, headers };
+        cw_thread_pool_run(pool, count, info_batch_task, &batch);
+
+        for (int i = 0; i < count; i++, shown++) {
+            if (json_output) {
+                print_png_info_json(names[i], &headers[i]);
+            } else {
+                if (list || file_count > 1) printf("%sFile: %s\n", shown ? "\n" : "", names[i]);
+                if (headers[i].status != ERROR_SUCCESS) {
+                    fprintf(stderr, "Failed to read the header of '%s'.\n", names[i]);
+                } else {
+                    print_png_info(&headers[i]);
+                }
+            }
+            if (headers[i].status != ERROR_SUCCESS && status == ERROR_SUCCESS) status = headers[i].status;
+        }
+        fflush(stdout);
+    }
+
+    cw_thread_pool_destroy(pool);
+    for (int i = 0; list && i < batch_capacity; i++) free(lines[i]);
+    free(lines);
+    free(line_sizes);
+    free(names);
+    free(headers);
+    return status;
+}
+
+static double benchmark_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char *const benchmark_content_names[BENCH_CONTENT_COUNT] = {
+    "flat", "noise", "gradient", "photo"
+};
+
+static const char *const benchmark_stage_names[BENCH_STAGE_COUNT] = {
+    "encode", "decode", "triangle", "triangle/tiled", "triangle/aa", "triangle/alpha", "shapes_1k", "ellipses_1k", "biggest_rect", "biggest_rect/tiled", "flood_fill", "biggest_blob",
+    "region_stats", "collage_2x2", "inverse", "gray", "resize", "scale_half", "box_reduce_4"
+};
+
+/* Parses a comma separated list of content names (or "all") into a mask. */
+static int parse_benchmark_contents(const char *optarg_str, unsigned *mask) {
+    *mask = 0;
+    if (strcmp(optarg_str, "all") == 0) {
+        *mask = (1u << BENCH_CONTENT_COUNT) - 1;
+        return 1;
+    }
+    const char *p = optarg_str;
+    while (*p) {
+        size_t len = strcspn(p, ",");
+        int found = -1;
+        for (int i = 0; i < BENCH_CONTENT_COUNT; i++) {
+            if (strlen(benchmark_content_names[i]) == len && strncmp(p, benchmark_content_names[i], len) == 0) found = i;
+        }
+        if (found < 0) {
+            fprintf(stderr, "Error: Unknown benchmark content '%.*s'. Use flat, noise, gradient, photo or all.\n", (int)len, p);
+            return 0;
+        }
+        *mask |= 1u << found;
+        p += len;
+        if (*p == ',') p++;
+    }
+    return *mask != 0;
+}
+
+/* Synthetic RGB8 content; "photo" resamples the given input image. */
+static Image* benchmark_image(enum BenchmarkContent content, int width, int height, const Image *photo) {
+    if (content == BENCH_PHOTO) {
+        Image *copy = cw_image_convert_layout(photo, false);
+        if (!copy) return NULL;
+        Image *scaled = cw_operation_scale(copy, width, height, RESAMPLE_LANCZOS, 1);
+        if (scaled != copy) cw_image_free(copy);
+        return scaled;
+    }
+    Image *image = cw_image_create(width, height, PIXEL_RGB8);
+    if (!image) return NULL;
+    uint32_t state = 0x9e3779b9u;
+    for (int y = 0; y < height; y++) {
+        unsigned char *p = image_row(image, y);
+        for (int x = 0; x < width; x++, p += 3) {
+            if (content == BENCH_FLAT) {
+                p[0] = 90; p[1] = 140; p[2] = 200;
+            } else if (content == BENCH_NOISE) {
+                state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+                p[0] = (unsigned char)state; p[1] = (unsigned char)(state >> 8); p[2] = (unsigned char)(state >> 16);
+            } else {
+                p[0] = (unsigned char)(x * 255 / (width > 1 ? width - 1 : 1));
+                p[1] = (unsigned char)(y * 255 / (height > 1 ? height - 1 : 1));
+                p[2] = (unsigned char)((p[0] + p[1]) / 2);
+            }
+        }
+    }
+    return image;
+}
+
+/* Colour of the top-left pixel, so --biggest_rect and --biggest_blob
+ * always have a target. */
+static Rgb benchmark_corner_color(const Image *image) {
+    const unsigned char *p = image_row(image, 0);
+    if (image->format == PIXEL_PAL8) return image->palette[p[0]];
+    const PixelFormatInfo *format = cw_pixel_format_info(image->format);
+    int step = format->bit_depth / 8;
+    Rgb color = {p[0], p[step], p[2 * step]};
+    if (format->bgr_order) {
+        color.r = p[2 * step];
+        color.b = p[0];
+    }
+    return color;
+}
+
+/* BENCHMARK_SHAPES small outlined triangles scattered over the image, the
+ * "shapes_1k" overlay, followed by as many ellipses for "ellipses_1k". */
+static bool benchmark_shapes(int width, int height, ShapeList *shapes) {
+    int shape_capacity = 0, point_capacity = 0;
+    uint32_t state = 0x2545f491u;
+    for (int i = 0; i < BENCHMARK_SHAPES; i++) {
+        Point points[3];
+        for (int k = 0; k < 3; k++) {
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            int size = width / 16 + 1;
+            points[k].x = (k == 0 ? (int)(state % (uint32_t)width) : points[0].x + (int)(state % (uint32_t)size) - size / 2);
+            state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+            size = height / 16 + 1;
+            points[k].y = (k == 0 ? (int)(state % (uint32_t)height) : points[0].y + (int)(state % (uint32_t)size) - size / 2);
+        }
+        if (!cw_shape_list_push(shapes, points, 3, &shape_capacity, &point_capacity)) return false;
+    }
+    for (int i = 0; i < BENCHMARK_SHAPES; i++) {
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+        Point center = {(int)(state % (uint32_t)width), (int)((state >> 8) % (uint32_t)height)};
+        state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+        Point radii = {(int)(state % (uint32_t)(width / 32 + 1)), (int)((state >> 8) % (uint32_t)(height / 32 + 1))};
+        if (!cw_shape_list_push_ellipse(shapes, center, radii, &shape_capacity, &point_capacity)) return false;
+    }
+    return true;
+}
+
+/* One timed run of a stage on `work`, a fresh copy of the content image
+ * (NULL for the codec stages). Images the stage creates are freed here. */
+static int benchmark_stage_run(enum BenchmarkStage stage, const Image *source, Image *work, struct Png *decoded,
+                               const char *path, int threads, Rgb corner, const ShapeList *shapes) {
+    int W = source->width, H = source->height;
+    Point a = {W / 10, H / 10}, b = {W * 9 / 10, H / 2}, c = {W / 4, H * 9 / 10};
+    Point lu = {W / 4, H / 4}, rd = {W * 3 / 4, H * 3 / 4};
+    Image *result = NULL;
+    switch (stage) {
+        case BENCH_ENCODE: {
+            struct Png props;
+            memset(&props, 0, sizeof(props));
+            cw_write_png_file(path, &props, work);
+            return props.status;
+        }
+        case BENCH_DECODE:
+            /* Includes wrapping the rows as an Image, which adopts the
+             * decoder's buffer and has no cost worth a stage of its own. */
+            cw_read_png_file(path, decoded);
+            if (decoded->status != ERROR_SUCCESS) return decoded->status;
+            result = cw_png_data_to_image(decoded);
+            break;
+        case BENCH_TRIANGLE:
+        case BENCH_TRIANGLE_TILED:
+        case BENCH_TRIANGLE_AA:
+            return cw_operation_draw_triangle(work, a, b, c, 3, (Rgba){255, 0, 0, 255}, true, (Rgba){0, 255, 0, 255}, stage == BENCH_TRIANGLE_AA, threads);
+        case BENCH_TRIANGLE_ALPHA:
+            return cw_operation_draw_triangle(work, a, b, c, 3, (Rgba){255, 0, 0, 128}, true, (Rgba){0, 255, 0, 96}, false, threads);
+        case BENCH_SHAPES:
+        case BENCH_ELLIPSES: {
+            ShapeList half = *shapes;
+            half.shape_count = BENCHMARK_SHAPES;
+            if (stage == BENCH_ELLIPSES) half.shapes += BENCHMARK_SHAPES;
+            return cw_operation_draw_shapes(work, &half, 2, (Rgba){255, 0, 0, 255}, true, (Rgba){0, 255, 0, 255}, FILL_EVEN_ODD, false, threads);
+        }
+        case BENCH_RECT:
+        case BENCH_RECT_TILED:
+            cw_operation_find_recolor_biggest_rect(work, corner, (Rgba){255, 255, 255, 255});
+            return ERROR_SUCCESS;
+        case BENCH_FLOOD:
+            return cw_operation_flood_fill(work, (Point){0, 0}, (Rgba){255, 255, 255, 255});
+        case BENCH_BLOB:
+            return cw_operation_recolor_biggest_blob(work, corner, (Rgba){255, 255, 255, 255}, threads);
+        case BENCH_REGIONS: {
+            /* One table, then BENCHMARK_REGIONS queries of scattered rectangles. */
+            CwRegionTable *table = NULL;
+            int status = cw_region_table_build(work, &corner, 1, threads, &table);
+            if (status != ERROR_SUCCESS) return status;
+            uint32_t state = 0x6d2b79f5u;
+            unsigned long long covered = 0, count;
+            for (int i = 0; i < BENCHMARK_REGIONS; i++) {
+                state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+                Point p = {(int)(state % (uint32_t)W), (int)((state >> 8) % (uint32_t)H)};
+                state ^= state << 13; state ^= state >> 17; state ^= state << 5;
+                Point q = {(int)(state % (uint32_t)W), (int)((state >> 8) % (uint32_t)H)};
+                RegionStats stats;
+                cw_region_stats(table, p, q, &stats, &count);
+                covered += stats.pixels + count;
+            }
+            cw_region_table_free(table);
+            return covered ? ERROR_SUCCESS : ERROR_ARG;
+        }
+        case BENCH_COLLAGE: {
+            int status = cw_operation_create_collage(work, 2, 2, &result);
+            if (status != ERROR_SUCCESS) return status;
+            break;
+        }
+        case BENCH_INVERSE:
+            cw_operation_invert_region(work, lu, rd);
+            return ERROR_SUCCESS;
+        case BENCH_GRAY:
+            cw_operation_grayscale_region(work, lu, rd);
+            return ERROR_SUCCESS;
+        case BENCH_RESIZE: {
+            int status = cw_operation_resize_canvas(work, W / 8, W / 8, H / 8, H / 8, (Rgb){0, 0, 0}, &result);
+            if (status != ERROR_SUCCESS) return status;
+            break;
+        }
+        case BENCH_SCALE:
+            result = cw_operation_scale(work, W / 2, H / 2, RESAMPLE_LANCZOS, threads);
+            break;
+        case BENCH_BOX_REDUCE:
+            result = cw_image_box_reduce(work, 4);
+            break;
+        default:
+            return ERROR_ARG;
+    }
+    if (!result) return ERROR_MEMORY;
+    if (result != work) cw_image_free(result);
+    return ERROR_SUCCESS;
+}
+
+/* Times every codec stage and operation on synthetic images of one size,
+ * best of BENCHMARK_RUNS, with the heap allocations of one run ("-" unless
+ * built with CW_COUNT_ALLOCATIONS). Copying the content image for each
+ * run is outside the timed region; the encoded image goes to a temporary
+ * file in scratch_dir (NULL for $TMPDIR, then /tmp). */
+static int run_benchmark_suite(int width, int height, unsigned contents, const Image *photo, int threads, const char *scratch_dir) {
+    char path[4096];
+    const char *dir = scratch_dir ? scratch_dir : getenv("TMPDIR");
+    if (!dir || !*dir) dir = "/tmp";
+    snprintf(path, sizeof(path), "%s/cw-bench-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create a benchmark file in %s.\n", dir);
+        return ERROR_FILE;
+    }
+    close(fd);
+    ShapeList shapes = {0};
+    if (!benchmark_shapes(width, height, &shapes)) {
+        fprintf(stderr, "Memory allocation failed for benchmark shapes\n");
+        cw_free_shape_list(&shapes);
+        unlink(path);
+        return ERROR_MEMORY;
+    }
+
+    double mpix = (double)width * height / 1e6;
+    printf("Benchmark %dx%d, best of %d runs%s\n", width, height, BENCHMARK_RUNS,
+           allocation_count_available() ? "" : " (allocation counts unavailable)");
+    printf("%-9s %-19s %10s %10s %8s\n", "content", "stage", "ms", "MPix/s", "allocs");
+    int status = ERROR_SUCCESS;
+    for (int content = 0; content < BENCH_CONTENT_COUNT && status == ERROR_SUCCESS; content++) {
+        if (!(contents & (1u << content))) continue;
+        if (content == BENCH_PHOTO && !photo) {
+            printf("%-9s (skipped: needs --input)\n", benchmark_content_names[content]);
+            continue;
+        }
+        Image *source = benchmark_image((enum BenchmarkContent)content, width, height, photo);
+        if (!source) {
+            status = ERROR_MEMORY;
+            break;
+        }
+        Rgb corner = benchmark_corner_color(source);
+        struct Png props;
+        memset(&props, 0, sizeof(props));
+        cw_write_png_file(path, &props, source);
+        status = props.status;
+        for (int stage = 0; stage < BENCH_STAGE_COUNT && status == ERROR_SUCCESS; stage++) {
+            bool tiled = stage == BENCH_TRIANGLE_TILED || stage == BENCH_RECT_TILED;
+            double best = 0;
+            unsigned long allocs = 0;
+            for (int run = 0; run < BENCHMARK_RUNS && status == ERROR_SUCCESS; run++) {
+                Image *work = NULL;
+                struct Png decoded;
+                memset(&decoded, 0, sizeof(decoded));
+                if (stage != BENCH_DECODE) {
+                    work = cw_image_convert_layout(source, tiled);
+                    if (!work) status = ERROR_MEMORY;
+                }
+                if (status == ERROR_SUCCESS) {
+                    unsigned long allocs_before = allocation_count();
+                    double start = benchmark_seconds();
+                    status = benchmark_stage_run((enum BenchmarkStage)stage, source, work, &decoded, path, threads, corner, &shapes);
+                    double elapsed = benchmark_seconds() - start;
+                    allocs = allocation_count() - allocs_before;
+                    if (run == 0 || elapsed < best) best = elapsed;
+                }
+                cw_image_free(work);
+                cw_free_png_read_resources(&decoded);
+                cw_arena_reset();
+            }
+            if (status == ERROR_SUCCESS) {
+                printf("%-9s %-19s %10.3f %10.1f ", benchmark_content_names[content], benchmark_stage_names[stage],
+                       best * 1e3, best > 0 ? mpix / best : 0.0);
+                if (allocation_count_available()) printf("%8lu\n", allocs);
+                else printf("%8s\n", "-");
+            }
+        }
+        cw_image_free(source);
+    }
+    cw_free_shape_list(&shapes);
+    unlink(path);
+    return status;
+}
+
+static int parse_color_string(const char* optarg_str, Rgb* color_struct) {
+    int r_int, g_int, b_int;
+    if (!optarg_str) { 
+        fprintf(stderr, "Error: Color string is NULL.\n");
+        return 0;
+    }
+    if (sscanf(optarg_str, "%d.%d.%d", &r_int, &g_int, &b_int) != 3 ||
+        r_int < 0 || r_int > 255 || g_int < 0 || g_int > 255 || b_int < 0 || b_int > 255) {
+        fprintf(stderr, "Error: Incorrect color format '%s'. Expected rrr.ggg.bbb with components in 0-255.\n", optarg_str);
+        return 0; 
+    }
+    color_struct->r = (unsigned char)r_int;
+    color_struct->g = (unsigned char)g_int;
+    color_struct->b = (unsigned char)b_int;
+    return 1; 
+}
+
+/* r.g.b or r.g.b.a; alpha defaults to 255 (opaque). */
+static int parse_rgba_string(const char* optarg_str, Rgba* color_struct) {
+    int r_int, g_int, b_int, a_int = 255;
+    if (!optarg_str) {
+        fprintf(stderr, "Error: Color string is NULL.\n");
+        return 0;
+    }
+    /* %n records how far each form got; the string must end right there. */
+    int end = -1;
+    sscanf(optarg_str, "%d.%d.%d.%d%n", &r_int, &g_int, &b_int, &a_int, &end);
+    if (end < 0 || optarg_str[end] != '\0') {
+        end = -1;
+        a_int = 255;
+        sscanf(optarg_str, "%d.%d.%d%n", &r_int, &g_int, &b_int, &end);
+    }
+    if (end < 0 || optarg_str[end] != '\0' ||
+        r_int < 0 || r_int > 255 || g_int < 0 || g_int > 255 || b_int < 0 || b_int > 255 || a_int < 0 || a_int > 255) {
+        fprintf(stderr, "Error: Incorrect color format '%s'. Expected rrr.ggg.bbb[.aaa] with components in 0-255.\n", optarg_str);
+        return 0;
+    }
+    color_struct->r = (unsigned char)r_int;
+    color_struct->g = (unsigned char)g_int;
+    color_struct->b = (unsigned char)b_int;
+    color_struct->a = (unsigned char)a_int;
+    return 1;
+}
+
+static int parse_filter_string(const char* optarg_str, enum ResampleFilter* filter) {
+    static const char *const names[RESAMPLE_FILTER_COUNT] = {
+        [RESAMPLE_BOX] = "box", [RESAMPLE_BILINEAR] = "bilinear", [RESAMPLE_LANCZOS] = "lanczos"
+    };
+    for (int f = 0; f < RESAMPLE_FILTER_COUNT; f++) {
+        if (optarg_str && strcmp(optarg_str, names[f]) == 0) {
+            *filter = (enum ResampleFilter)f;
+            return 1;
+        }
+    }
+    fprintf(stderr, "Error: Unknown filter '%s'. Expected box, bilinear or lanczos.\n", optarg_str ? optarg_str : "");
+    return 0;
+}
+
+static int parse_fill_rule_string(const char* optarg_str, enum FillRule* rule) {
+    if (optarg_str && strcmp(optarg_str, "evenodd") == 0) {
+        *rule = FILL_EVEN_ODD;
+        return 1;
+    }
+    if (optarg_str && strcmp(optarg_str, "nonzero") == 0) {
+        *rule = FILL_NON_ZERO;
+        return 1;
+    }
+    fprintf(stderr, "Error: Unknown fill rule '%s'. Expected evenodd or nonzero.\n", optarg_str ? optarg_str : "");
+    return 0;
+}
+
+static int parse_points_string(const char* optarg_str, Point* p1, Point* p2, Point* p3) {
+    if (!optarg_str) { 
+        fprintf(stderr, "Error: Points string is NULL.\n");
+        return 0;
+    }
+    if (sscanf(optarg_str, "%d.%d.%d.%d.%d.%d", &p1->x, &p1->y, &p2->x, &p2->y, &p3->x, &p3->y) != 6) {
+        fprintf(stderr, "Error: Incorrect points format '%s'. Expected x1.y1.x2.y2.x3.y3.\n", optarg_str);
+        return 0; 
+    }
+    return 1; 
+}
+
+static int parse_point_string(const char* optarg_str, Point* point) {
+    if (!optarg_str) { 
+        fprintf(stderr, "Error: Point string is NULL.\n");
+        return 0;
+    }
+    if (sscanf(optarg_str, "%d.%d", &point->x, &point->y) != 2) {
+        fprintf(stderr, "Error: Incorrect point format '%s'. Expected x.y.\n", optarg_str);
+        return 0; 
+    }
+    return 1; 
+}
+
+/* Reads a --shapes file, one primitive per line in drawing order: a
+ * triangle or polygon as [polygon] x1.y1.x2.y2.x3.y3[.x4.y4...] (at least
+ * three vertices), `circle cx.cy.r` or `ellipse cx.cy.rx.ry`. Blank lines
+ * and lines starting with '#' are skipped. */
+static int load_shapes_file(const char *filename, ShapeList *shapes) {
+    memset(shapes, 0, sizeof(*shapes));
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open shapes file '%s'.\n", filename);
+        return ERROR_FILE;
+    }
+    int status = ERROR_SUCCESS;
+    int shape_capacity = 0, point_capacity = 0, line_capacity = 0;
+    Point *line_points = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while (status == ERROR_SUCCESS && getline(&line, &line_size, fp) != -1) {
+        line_number++;
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+        /* Values a circle or ellipse takes; 0 for a polygon. */
+        int expected = 0;
+        static const struct { const char *name; int values; } keywords[] = {{"polygon", 0}, {"circle", 3}, {"ellipse", 4}};
+        for (size_t k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+            size_t length = strlen(keywords[k].name);
+            if (strncmp(p, keywords[k].name, length) == 0 && (p[length] == ' ' || p[length] == '\t')) {
+                expected = keywords[k].values;
+                p += length;
+                while (*p == ' ' || *p == '\t') p++;
+                break;
+            }
+        }
+
+        int values = 0;
+        while (true) {
+            char *end = NULL;
+            errno = 0;
+            long v = strtol(p, &end, 10);
+            if (end == p || errno == ERANGE || v < INT_MIN || v > INT_MAX) break;
+            if (values / 2 == line_capacity) {
+                int capacity = line_capacity ? line_capacity * 2 : 16;
+                Point *grown = (Point*)realloc(line_points, sizeof(Point) * capacity);
+                if (!grown) {
+                    status = ERROR_MEMORY;
+                    break;
+                }
+                line_points = grown;
+                line_capacity = capacity;
+            }
+            if (values % 2 == 0) line_points[values / 2].x = (int)v;
+            else line_points[values / 2].y = (int)v;
+            values++;
+            p = end;
+            if (*p != '.') break;
+            p++;
+        }
+        if (status != ERROR_SUCCESS) {
+            fprintf(stderr, "Memory allocation failed for shapes\n");
+            break;
+        }
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        bool valid = *p == '\0' && (expected ? values == expected : values % 2 == 0 && values >= 6);
+        Point radii = {0, 0};
+        if (valid && expected) {
+            radii = expected == 3 ? (Point){line_points[1].x, line_points[1].x} : line_points[1];
+            valid = cw_ellipse_in_range(line_points[0], radii);
+        }
+        if (!valid) {
+            fprintf(stderr, "Error: Incorrect shape on line %d of '%s'. Expected x1.y1.x2.y2.x3.y3[.x4.y4...], circle cx.cy.r "
+                            "or ellipse cx.cy.rx.ry with radii in 0-%d.\n", line_number, filename, SHAPE_MAX_RADIUS);
+            status = ERROR_ARG;
+        } else if (expected && !cw_shape_list_push_ellipse(shapes, line_points[0], radii, &shape_capacity, &point_capacity)) {
+            fprintf(stderr, "Memory allocation failed for shapes\n");
+            status = ERROR_MEMORY;
+        } else if (!expected && !cw_shape_list_push(shapes, line_points, values / 2, &shape_capacity, &point_capacity)) {
+            fprintf(stderr, "Memory allocation failed for shapes\n");
+            status = ERROR_MEMORY;
+        }
+    }
+    if (status == ERROR_SUCCESS && ferror(fp)) {
+        fprintf(stderr, "Error: Cannot read shapes file '%s'.\n", filename);
+        status = ERROR_FILE;
+    }
+    free(line);
+    free(line_points);
+    fclose(fp);
+    if (status != ERROR_SUCCESS) cw_free_shape_list(shapes);
+    return status;
+}
+
+/* Reads a --region_stats file, one rectangle per line as x0.y0.x1.y1 (two
+ * opposite corners, both inclusive). Blank lines and lines starting with
+ * '#' are skipped. *corners gets two points per rectangle; free() it. */
+static int load_regions_file(const char *filename, Point **corners, int *count) {
+    *corners = NULL;
+    *count = 0;
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot open regions file '%s'.\n", filename);
+        return ERROR_FILE;
+    }
+    int status = ERROR_SUCCESS;
+    int capacity = 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int line_number = 0;
+    while (status == ERROR_SUCCESS && getline(&line, &line_size, fp) != -1) {
+        line_number++;
+        const char *p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+
+        int v[4];
+        int values = 0;
+        while (values < 4) {
+            char *end = NULL;
+            errno = 0;
+            long value = strtol(p, &end, 10);
+            if (end == p || errno == ERANGE || value < INT_MIN || value > INT_MAX) break;
+            v[values++] = (int)value;
+            p = end;
+            if (values == 4 || *p != '.') break;
+            p++;
+        }
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (values != 4 || *p != '\0') {
+            fprintf(stderr, "Error: Incorrect rectangle on line %d of '%s'. Expected x0.y0.x1.y1.\n", line_number, filename);
+            status = ERROR_ARG;
+            break;
+        }
+        if (*count == capacity) {
+            int grown_capacity = capacity ? capacity * 2 : 256;
+            Point *grown = (Point*)realloc(*corners, sizeof(Point) * 2 * grown_capacity);
+            if (!grown) {
+                fprintf(stderr, "Memory allocation failed for regions\n");
+                status = ERROR_MEMORY;
+                break;
+            }
+            *corners = grown;
+            capacity = grown_capacity;
+        }
+        (*corners)[2 * *count] = (Point){v[0], v[1]};
+        (*corners)[2 * *count + 1] = (Point){v[2], v[3]};
+        (*count)++;
+    }
+    if (status == ERROR_SUCCESS && ferror(fp)) {
+        fprintf(stderr, "Error: Cannot read regions file '%s'.\n", filename);
+        status = ERROR_FILE;
+    }
+    free(line);
+    fclose(fp);
+    if (status != ERROR_SUCCESS) {
+        free(*corners);
+        *corners = NULL;
+        *count = 0;
+    }
+    return status;
+}
+
+static void print_help() {
+    puts("Usage: program_name [operation] [operation_args] [-i input.png] [-o output.png]");
+    puts("\nOperations (only one per execution):");
+    puts("  --triangle                  Draw a triangle.");
+    puts("      --points <x1.y1.x2.y2.x3.y3> Vertex coordinates (required).");
+    puts("      --thickness <int>       Line thickness, >0 (required).");
+    puts("      --color <r.g.b[.a]>     Line color, 0-255; alpha < 255 blends (required).");
+    puts("      --fill                  (Optional) Flag to fill the triangle.");
+    puts("      --fill_color <r.g.b[.a]> (Optional) Fill color if --fill is used.");
+    puts("\n  --shapes <file>             Draw every triangle and polygon listed in the file in one");
+    puts("                              tiled, multithreaded pass; one x1.y1.x2.y2.x3.y3[.x4.y4...],");
+    puts("                              circle cx.cy.r or ellipse cx.cy.rx.ry per line, '#' starts");
+    puts("                              a comment.");
+    puts("      --thickness <int>       Outline thickness (0 or omitted: fill only).");
+    puts("      --color <r.g.b[.a]>     Outline color (required with --thickness).");
+    puts("      --fill                  (Optional) Fill the shapes.");
+    puts("      --fill_color <r.g.b[.a]> (Optional) Fill color if --fill is used.");
+    puts("      --fill_rule <rule>      (Optional) evenodd or nonzero for self-overlapping polygons");
+    puts("                              (default evenodd).");
+    puts("\n  --biggest_rect              Find and recolor the largest rectangle of a specific color.");
+    puts("      --old_color <r.g.b>     Color of the rectangle to find (required).");
+    puts("      --new_color <r.g.b[.a]> Color to repaint with; alpha < 255 blends (required).");
+    puts("\n  --flood_fill                Recolor the 4-connected region of the seed pixel's color.");
+    puts("      --seed <x.y>            Pixel the region grows from (required).");
+    puts("      --new_color <r.g.b[.a]> Color to repaint with (required).");
+    puts("\n  --biggest_blob              Recolor the largest 4-connected region of a specific color;");
+    puts("                              rows are labelled in parallel strips (see --threads).");
+    puts("      --old_color <r.g.b>     Color of the region to find (required).");
+    puts("      --new_color <r.g.b[.a]> Color to repaint with (required).");
+    puts("\n  --region_stats <file>       Print the pixel count, mean color and tracked color counts");
+    puts("                              of every rectangle in the file (x0.y0.x1.y1 per line, '#'");
+    puts("                              starts a comment), each from summed-area tables built once.");
+    puts("      --track_color <r.g.b>   (Optional) Color to count; repeat for up to 16 colors.");
+    puts("\n  --collage                   Create a collage from the input image.");
+    puts("      --number_x <int>        Number of repetitions along X-axis, >0 (required).");
+    puts("      --number_y <int>        Number of repetitions along Y-axis, >0 (required).");
+    puts("\n  --inverse                   Invert colors in a region.");
+    puts("  --gray                      Convert a region to grayscale.");
+    puts("      --left_up <x.y>         Top-left corner of the region (required).");
+    puts("      --right_down <x.y>      Bottom-right corner of the region (required).");
+    puts("\n  --resize                    Change the canvas size.");
+    puts("      --left <int>            Columns to add on the left (negative crops).");
+    puts("      --right <int>           Columns to add on the right (negative crops).");
+    puts("      --above <int>           Rows to add on top (negative crops).");
+    puts("      --below <int>           Rows to add at the bottom (negative crops).");
+    puts("      --color <r.g.b>         (Optional) Background for added areas (default 0.0.0).");
+    puts("\n  --scale <WxH>               Resample to WxH; runs alone or after the operation above.");
+    puts("                              A 0 side keeps the aspect ratio (e.g. 320x0).");
+    puts("      --filter <name>         (Optional) box, bilinear or lanczos (default lanczos).");
+    puts("\n  --decode_scale <n>          Average n x n blocks while decoding, before any operation;");
+    puts("                              the full-size image is never held (thumbnails).");
+    puts("\n  --benchmark                 Time encode, decode and every operation on");
+    puts("                              synthetic images (MPix/s and heap allocations per run).");
+    puts("                              An input file, if given, is the \"photo\" content.");
+    puts("                              Heap allocations are counted only in a binary built");
+    puts("                              with -DCW_COUNT_ALLOCATIONS (make cw_count_allocs).");
+    puts("      --bench_size <WxH>      (Optional) Image size (default 1024x1024).");
+    puts("      --bench_content <list>  (Optional) flat,noise,gradient,photo or all (default all).");
+    puts("\nOther options:");
+    puts("  -i, --input <file>          Input PNG or uncompressed 24-bit BMP file name; \"-\"");
+    puts("                              reads standard input.");
+    puts("  -o, --output <file>         Output file name (default: out.png); a .bmp name");
+    puts("                              writes BMP, anything else writes PNG; \"-\" writes");
+    puts("                              PNG to standard output.");
+    puts("      --output_dir <dir>      (Optional) Batch mode: apply the operation to the input and");
+    puts("                              every extra file name, writing each to <dir>/<name>.");
+    puts("      --prefetch <int>        (Optional) Batch mode: files read ahead and written behind");
+    puts("                              asynchronously (default: 4, 0 = one file at a time).");
+    puts("      --info                  Show information about the input PNG or BMP file(s); extra");
+    puts("                              file names may follow the options.");
+    puts("      --info_list <file>      (Optional) Also inspect the newline-separated paths listed in");
+    puts("                              <file> (\"-\" for stdin), read in batches; implies --info.");
+    puts("      --json                  (Optional) Print --info and --stats as one JSON object per file,");
+    puts("                              and --region_stats as one per rectangle.");
+    puts("      --stats                 (Optional) Report wall/CPU time, peak RSS and bytes for the");
+    puts("                              read, convert, operation and write stages of each file.");
+    puts("      --threads <int>         (Optional) Worker threads for --info, --scale, --triangle");
+    puts("                              fills, --shapes, --biggest_blob and --region_stats (default:");
+    puts("                              CPU count).");
+    puts("      --antialias             (Optional) Smooth the edges of --triangle and --shapes by");
+    puts("                              blending 4x4 sub-pixel coverage; palette images become RGB.");
+    puts("      --tiled                 (Optional) Run --triangle, --shapes and --biggest_rect on a");
+    puts("                              64x64-tiled copy of the image.");
+    puts("      --scratch_threshold <MiB>");
+    puts("                              (Optional) Keep images of at least this size in a");
+    puts("                              memory-mapped scratch file (default: 1024, 0 = always).");
+    puts("      --scratch_dir <dir>     (Optional) Directory for scratch files (default: $TMPDIR or /tmp).");
+    puts("  -h, --help                  Show this help message.");
+}
+
+/* --region_stats: loads the input once, builds its region table and prints
+ * the statistics of each rectangle of the regions file in file order, as
+ * text or one JSON object per rectangle. */
+static int run_region_stats(const char *input_filename, const JobOptions *job, const char *regions_path, const Rgb *colors, int color_count,
+                     bool json_output) {
+    Point *corners = NULL;
+    int region_count = 0;
+    int status = load_regions_file(regions_path, &corners, &region_count);
+    if (status != ERROR_SUCCESS) return status;
+    Image *image = NULL;
+    CwRegionTable *table = NULL;
+    status = cw_load_image_file(input_filename, job, &image, NULL);
+    if (status == ERROR_SUCCESS) status = cw_region_table_build(image, colors, color_count, job->thread_count, &table);
+    cw_image_free(image);
+
+    for (int i = 0; table && i < region_count; i++) {
+        Point a = corners[2 * i], b = corners[2 * i + 1];
+        RegionStats stats;
+        unsigned long long counts[REGION_MAX_COLORS];
+        cw_region_stats(table, a, b, &stats, counts);
+        if (json_output) {
+            printf("{\"left_up\":[%d,%d],\"right_down\":[%d,%d],\"pixels\":%llu", a.x, a.y, b.x, b.y, stats.pixels);
+            if (stats.pixels) {
+                printf(",\"mean\":{\"r\":%.4f,\"g\":%.4f,\"b\":%.4f,\"a\":%.4f}", stats.r, stats.g, stats.b, stats.a);
+            } else {
+                printf(",\"mean\":null");
+            }
+            printf(",\"colors\":[");
+            for (int c = 0; c < color_count; c++) {
+                printf("%s{\"color\":[%d,%d,%d],\"pixels\":%llu}", c ? "," : "", colors[c].r, colors[c].g, colors[c].b, counts[c]);
+            }
+            printf("]}\n");
+        } else {
+            printf("Region %d.%d to %d.%d: %llu pixels", a.x, a.y, b.x, b.y, stats.pixels);
+            if (stats.pixels) printf(", mean R %.2f G %.2f B %.2f A %.2f", stats.r, stats.g, stats.b, stats.a);
+            putchar('\n');
+            for (int c = 0; c < color_count; c++) {
+                printf("  %d.%d.%d: %llu pixels\n", colors[c].r, colors[c].g, colors[c].b, counts[c]);
+            }
+        }
+    }
+    fflush(stdout);
+    cw_region_table_free(table);
+    free(corners);
+    return status;
+}
+
+static int batch_io_open_flags(const BatchIoRequest *req) {
+    return req->kind == BATCH_IO_WRITE ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+}
+
+/* Books the result of opening the request's file (a descriptor, or
+ * -errno); reads also size and allocate the buffer. */
+static bool batch_io_opened(BatchIoRequest *req, int result) {
+    req->fd = result >= 0 ? result : -1;
+    if (req->kind == BATCH_IO_WRITE) {
+        if (req->fd < 0) {
+            fprintf(stderr, "Error: Cannot open file %s for writing.\n", req->path);
+            req->status = ERROR_FILE;
+            return false;
+        }
+        return true;
+    }
+    struct stat st;
+    if (req->fd < 0 || fstat(req->fd, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open file %s for reading.\n", req->path);
+        req->status = ERROR_FILE;
+        return false;
+    }
+    req->size = (size_t)st.st_size;
+    req->data = (unsigned char*)malloc(req->size ? req->size : 1);
+    if (!req->data) {
+        fprintf(stderr, "Memory allocation failed for input %s\n", req->path);
+        req->status = ERROR_MEMORY;
+        return false;
+    }
+    return true;
+}
+
+static bool batch_io_open(BatchIoRequest *req) {
+    int fd = open(req->path, batch_io_open_flags(req), 0644);
+    return batch_io_opened(req, fd >= 0 ? fd : -errno);
+}
+
+/* Books one transfer result (bytes, or -errno); true once the request is
+ * finished, successfully or not. */
+static bool batch_io_progress(BatchIoRequest *req, ssize_t result) {
+    if (result == 0 && req->kind == BATCH_IO_READ) {
+        req->size = req->done;
+        return true;
+    }
+    if (result <= 0) {
+        fprintf(stderr, "Error: %s %s failed: %s.\n", req->kind == BATCH_IO_READ ? "Reading" : "Writing",
+                req->path, result < 0 ? strerror((int)-result) : "no progress");
+        req->status = ERROR_FILE;
+        return true;
+    }
+    req->done += (size_t)result;
+    return req->done >= req->size;
+}
+
+static size_t batch_io_chunk(const BatchIoRequest *req) {
+    size_t left = req->size - req->done;
+    return left < BATCH_IO_CHUNK ? left : BATCH_IO_CHUNK;
+}
+
+static void batch_io_transfer_sync(BatchIoRequest *req) {
+    while (req->status == ERROR_SUCCESS && req->done < req->size) {
+        ssize_t n = req->kind == BATCH_IO_READ
+            ? pread(req->fd, req->data + req->done, batch_io_chunk(req), (off_t)req->done)
+            : pwrite(req->fd, req->data + req->done, batch_io_chunk(req), (off_t)req->done);
+        if (n < 0 && errno == EINTR) continue;
+        if (batch_io_progress(req, n < 0 ? -(ssize_t)errno : n)) break;
+    }
+}
+
+/* Last step of a request, on whichever thread finished it (under the lock
+ * for the I/O thread). Writes are freed here. */
+static void batch_io_complete(BatchIo *io, BatchIoRequest *req) {
+#ifdef BATCH_IO_URING
+    for (BatchIoRequest **link = &io->uring_requests; *link; link = &(*link)->next) {
+        if (*link == req) {
+            *link = req->next;
+            break;
+        }
+    }
+#endif
+    if (req->fd >= 0 && close(req->fd) != 0 && req->kind == BATCH_IO_WRITE && req->status == ERROR_SUCCESS) {
+        fprintf(stderr, "Error: Closing %s failed: %s.\n", req->path, strerror(errno));
+        req->status = ERROR_FILE;
+    }
+    req->fd = -1;
+    if (req->kind == BATCH_IO_READ) {
+        req->complete = true;
+        return;
+    }
+    if (req->status != ERROR_SUCCESS) {
+        fprintf(stderr, "Failed to write output file '%s'.\n", req->path);
+        if (io->write_status == ERROR_SUCCESS) io->write_status = req->status;
+    } else if (io->report) {
+        fprintf(io->report, "Operation completed successfully. Output: %s\n", req->path);
+    }
+    io->writes_in_flight--;
+    free(req->data);
+    free(req->path);
+    free(req);
+}
+
+#ifdef BATCH_IO_URING
+static bool batch_io_uring_init(BatchIo *io, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return false;
+    io->ring_fd = fd;
+    io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && io->cq_ring_size > io->sq_ring_size) io->sq_ring_size = io->cq_ring_size;
+    io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    io->cq_ring = single ? io->sq_ring
+                         : mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    io->sqes = (struct io_uring_sqe*)mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, io->sqes_size);
+        if (!single && io->cq_ring != MAP_FAILED) munmap(io->cq_ring, io->cq_ring_size);
+        if (io->sq_ring != MAP_FAILED) munmap(io->sq_ring, io->sq_ring_size);
+        close(fd);
+        return false;
+    }
+    unsigned char *sq = (unsigned char*)io->sq_ring, *cq = (unsigned char*)io->cq_ring;
+    io->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    io->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    io->sq_array = (unsigned*)(sq + params.sq_off.array);
+    io->cq_head = (unsigned*)(cq + params.cq_off.head);
+    io->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    io->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void batch_io_uring_release(BatchIo *io) {
+    munmap(io->sqes, io->sqes_size);
+    if (io->cq_ring != io->sq_ring) munmap(io->cq_ring, io->cq_ring_size);
+    munmap(io->sq_ring, io->sq_ring_size);
+    close(io->ring_fd);
+}
+
+/* Hands queued entries to the kernel and optionally waits for one
+ * completion. Entries the kernel did not take stay pending; any error but
+ * EINTR, EAGAIN or EBUSY marks the ring as failed. */
+static void batch_io_uring_enter(BatchIo *io, bool wait) {
+    long taken = syscall(__NR_io_uring_enter, io->ring_fd, io->sq_pending, wait ? 1 : 0,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (taken > 0) io->sq_pending -= (unsigned)taken;
+    if (taken < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && !io->uring_failed) {
+        fprintf(stderr, "Warning: io_uring failed (%s); finishing the remaining I/O synchronously.\n", strerror(errno));
+        io->uring_failed = true;
+    }
+}
+
+/* Queues the next step of a request: opening its file, then one transfer
+ * at a time. */
+static void batch_io_uring_submit(BatchIo *io, BatchIoRequest *req) {
+    unsigned tail = *io->sq_tail;
+    unsigned index = tail & *io->sq_mask;
+    struct io_uring_sqe *sqe = &io->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    if (req->fd < 0) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)req->path;
+        sqe->len = 0644;
+        sqe->open_flags = (uint32_t)batch_io_open_flags(req);
+    } else {
+        sqe->opcode = req->kind == BATCH_IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = req->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(req->data + req->done);
+        sqe->len = (uint32_t)batch_io_chunk(req);
+        sqe->off = req->done;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    io->sq_array[index] = index;
+    __atomic_store_n(io->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    io->sq_pending++;
+    batch_io_uring_enter(io, false);
+}
+
+/* After a failed io_uring_enter the ring is dropped and every request it
+ * held is finished on this thread; later requests run synchronously too.
+ * A transfer the kernel did finish is simply repeated. */
+static void batch_io_uring_abandon(BatchIo *io) {
+    batch_io_uring_release(io);
+    io->use_uring = false;
+    while (io->uring_requests) {
+        BatchIoRequest *req = io->uring_requests;
+        if (req->fd >= 0 || batch_io_open(req)) batch_io_transfer_sync(req);
+        batch_io_complete(io, req);
+    }
+}
+
+static void batch_io_uring_reap(BatchIo *io, bool wait) {
+    unsigned head = *io->cq_head;
+    if (wait && head == __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE)) batch_io_uring_enter(io, true);
+    unsigned tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && !io->uring_failed) {
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+        BatchIoRequest *req = (BatchIoRequest*)(uintptr_t)cqe->user_data;
+        int result = cqe->res;
+        __atomic_store_n(io->cq_head, ++head, __ATOMIC_RELEASE);
+        if (result == -EINTR || result == -EAGAIN) {
+            batch_io_uring_submit(io, req);
+        } else if (req->fd < 0) {
+            /* Kernels before 5.6 lack IORING_OP_OPENAT/READ/WRITE. */
+            bool opened = result == -EINVAL || result == -EOPNOTSUPP ? batch_io_open(req) : batch_io_opened(req, result);
+            if (!opened || req->done >= req->size) batch_io_complete(io, req);
+            else batch_io_uring_submit(io, req);
+        } else if (result == -EINVAL || result == -EOPNOTSUPP) {
+            batch_io_transfer_sync(req);
+            batch_io_complete(io, req);
+        } else if (batch_io_progress(req, result)) {
+            batch_io_complete(io, req);
+        } else {
+            batch_io_uring_submit(io, req);
+        }
+    }
+    if (io->uring_failed) batch_io_uring_abandon(io);
+}
+#endif
+
+static void* batch_io_worker(void *arg) {
+    BatchIo *io = (BatchIo*)arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->queue_head && !io->stop) pthread_cond_wait(&io->changed, &io->lock);
+        BatchIoRequest *req = io->queue_head;
+        if (!req) break;
+        io->queue_head = req->next;
+        if (!io->queue_head) io->queue_tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+        if (batch_io_open(req)) batch_io_transfer_sync(req);
+        pthread_mutex_lock(&io->lock);
+        batch_io_complete(io, req);
+        pthread_cond_broadcast(&io->changed);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+/* Starts a request; for the I/O thread the caller holds the lock. */
+static void batch_io_start(BatchIo *io, BatchIoRequest *req) {
+#ifdef BATCH_IO_URING
+    if (io->use_uring) {
+        req->next = io->uring_requests;
+        io->uring_requests = req;
+        batch_io_uring_submit(io, req);
+        if (io->uring_failed) batch_io_uring_abandon(io);
+        return;
+    }
+#endif
+    if (!io->thread_started) {
+        if (batch_io_open(req)) batch_io_transfer_sync(req);
+        batch_io_complete(io, req);
+        return;
+    }
+    req->next = NULL;
+    if (io->queue_tail) io->queue_tail->next = req;
+    else io->queue_head = req;
+    io->queue_tail = req;
+    pthread_cond_broadcast(&io->changed);
+}
+
+/* Waits for the next completion: io_uring is polled on this thread, the
+ * I/O thread is waited for with the lock held. Without either, requests
+ * finish as they start and there is nothing to wait for. */
+static void batch_io_wait(BatchIo *io) {
+#ifdef BATCH_IO_URING
+    if (io->use_uring) {
+        batch_io_uring_reap(io, true);
+        return;
+    }
+#endif
+    if (io->thread_started) pthread_cond_wait(&io->changed, &io->lock);
+}
+
+static void batch_io_fill_window(BatchIo *io, int next_needed) {
+    while (io->read_started < io->read_count && io->read_started < next_needed + io->depth) {
+        batch_io_start(io, &io->reads[io->read_started++]);
+    }
+}
+
+/* Starts reading ahead through paths. Finished writes are announced on
+ * report when it is set. */
+static BatchIo* batch_io_create(const char *const *paths, int count, int depth, FILE *report) {
+    BatchIo *io = (BatchIo*)calloc(1, sizeof(BatchIo));
+    if (!io) return NULL;
+    io->reads = (BatchIoRequest*)calloc(count > 0 ? count : 1, sizeof(BatchIoRequest));
+    if (!io->reads) {
+        free(io);
+        return NULL;
+    }
+    io->read_count = count;
+    io->depth = depth;
+    io->report = report;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->changed, NULL);
+    for (int i = 0; i < count; i++) {
+        io->reads[i].kind = BATCH_IO_READ;
+        io->reads[i].fd = -1;
+        io->reads[i].path = strdup(paths[i]);
+        if (!io->reads[i].path) {
+            batch_io_finish(io);
+            return NULL;
+        }
+    }
+#ifdef BATCH_IO_URING
+    io->use_uring = batch_io_uring_init(io, 2 * (unsigned)depth);
+#endif
+    if (!io->use_uring) {
+        if (pthread_create(&io->thread, NULL, batch_io_worker, io) != 0) {
+            batch_io_finish(io);
+            return NULL;
+        }
+        io->thread_started = true;
+    }
+    pthread_mutex_lock(&io->lock);
+    batch_io_fill_window(io, 0);
+    pthread_mutex_unlock(&io->lock);
+    return io;
+}
+
+/* Waits for input `index` and passes its buffer (malloc'd, possibly set
+ * even on failure) to the caller, then reads further ahead. */
+static int batch_io_take_input(BatchIo *io, int index, unsigned char **data, size_t *size) {
+    BatchIoRequest *req = &io->reads[index];
+    pthread_mutex_lock(&io->lock);
+    batch_io_fill_window(io, index);
+    while (!req->complete) batch_io_wait(io);
+    *data = req->data;
+    *size = req->size;
+    req->data = NULL;
+    batch_io_fill_window(io, index + 1);
+    pthread_mutex_unlock(&io->lock);
+    return req->status;
+}
+
+/* Queues `data` (malloc'd; always taken over) to be written to path. A
+ * failure shows up in batch_io_finish. */
+static int batch_io_write(BatchIo *io, const char *path, unsigned char *data, size_t size) {
+    BatchIoRequest *req = (BatchIoRequest*)calloc(1, sizeof(BatchIoRequest));
+    char *path_copy = strdup(path);
+    if (!req || !path_copy) {
+        fprintf(stderr, "Memory allocation failed for output %s\n", path);
+        free(req);
+        free(path_copy);
+        free(data);
+        return ERROR_MEMORY;
+    }
+    req->kind = BATCH_IO_WRITE;
+    req->path = path_copy;
+    req->fd = -1;
+    req->data = data;
+    req->size = size;
+    pthread_mutex_lock(&io->lock);
+    while (io->writes_in_flight >= io->depth) batch_io_wait(io);
+    io->writes_in_flight++;
+    batch_io_start(io, req);
+    pthread_mutex_unlock(&io->lock);
+    return ERROR_SUCCESS;
+}
+
+/* Drains every outstanding transfer, frees the batch I/O state and returns
+ * the first write error. */
+static int batch_io_finish(BatchIo *io) {
+    if (io->thread_started) {
+        pthread_mutex_lock(&io->lock);
+        io->stop = true;
+        pthread_cond_broadcast(&io->changed);
+        pthread_mutex_unlock(&io->lock);
+        pthread_join(io->thread, NULL);
+    }
+#ifdef BATCH_IO_URING
+    for (int i = 0; io->use_uring && i < io->read_started; i++) {
+        while (io->use_uring && !io->reads[i].complete) batch_io_uring_reap(io, true);
+    }
+    while (io->use_uring && io->writes_in_flight > 0) batch_io_uring_reap(io, true);
+    if (io->use_uring) batch_io_uring_release(io);
+#endif
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->changed);
+    int status = io->write_status;
+    for (int i = 0; i < io->read_count; i++) {
+        if (io->reads[i].fd >= 0) close(io->reads[i].fd);
+        free(io->reads[i].data);
+        free(io->reads[i].path);
+    }
+    free(io->reads);
+    free(io);
+    return status;
+}
+
+int main(int argc, char *argv[]) {
+    bool json_flag = false;
+    char *input_filename = NULL;
+    char *output_filename = "out.png"; 
+
+    int op_triangle_flag = 0;
+    int op_biggest_rect_flag = 0;
+    int op_collage_flag = 0;
+    int op_inverse_flag = 0;
+    int op_gray_flag = 0;
+    int op_resize_flag = 0;
+    int op_shapes_flag = 0;
+    int op_flood_flag = 0;
+    int op_blob_flag = 0;
+    int info_flag = 0;
+    char* info_list_path = NULL;
+    char* regions_path = NULL;
+    char* track_color_strs[REGION_MAX_COLORS]; int track_count = 0; Rgb track_colors[REGION_MAX_COLORS];
+    int benchmark_flag = 0;
+    char* bench_size_str = NULL; int bench_w = BENCHMARK_DEFAULT_SIZE, bench_h = BENCHMARK_DEFAULT_SIZE;
+    char* bench_content_str = NULL; unsigned bench_contents = (1u << BENCH_CONTENT_COUNT) - 1;
+    bool tiled_flag = false;
+    bool antialias_flag = false;
+    char* fill_rule_str = NULL; enum FillRule fill_rule = FILL_EVEN_ODD;
+    char* scratch_threshold_str = NULL; size_t scratch_threshold = (size_t)SCRATCH_THRESHOLD_MIB << 20;
+    const char* scratch_dir = NULL;
+    int help_flag = 0;
+    int thread_count = cw_default_thread_count();
+
+    char* points_str = NULL; Point p1={0}, p2={0}, p3={0}; 
+    char* shapes_path = NULL; ShapeList shapes = {0};
+    int thickness = 0;
+    char* line_color_str = NULL; Rgba line_color={0}; 
+    int fill_flag = 0;
+    char* fill_color_str = NULL; Rgba fill_color={0}; 
+
+    char* old_color_str = NULL; Rgb old_color={0}; 
+    char* new_color_str = NULL; Rgba new_color={0}; 
+
+    int number_x = 0, number_y = 0;
+
+    char* left_up_str = NULL; Point left_up={0};
+    char* right_down_str = NULL; Point right_down={0};
+    char* seed_str = NULL; Point seed={0};
+
+    int resize_left = 0, resize_right = 0, resize_above = 0, resize_below = 0;
+
+    char* scale_str = NULL; int scale_w = 0, scale_h = 0;
+    char* filter_str = NULL; enum ResampleFilter scale_filter = RESAMPLE_LANCZOS;
+    int decode_scale = 0;
+    bool stats_flag = false;
+
+    char* output_dir = NULL;
+    int prefetch_depth = BATCH_PREFETCH_DEPTH;
+    int status = ERROR_SUCCESS;
+
+
+    const struct option long_options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"input", required_argument, NULL, 'i'},
+        {"output", required_argument, NULL, 'o'},
+        {"info", no_argument, NULL, 256}, 
+        {"json", no_argument, NULL, 261},
+        {"threads", required_argument, NULL, 262},
+
+        {"triangle", no_argument, NULL, 257},
+        {"points", required_argument, NULL, 'p'}, 
+        {"thickness", required_argument, NULL, 't'},
+        {"color", required_argument, NULL, 'c'},
+        {"fill", no_argument, NULL, 258},
+        {"fill_color", required_argument, NULL, 'f'},
+
+        {"biggest_rect", no_argument, NULL, 259},
+        {"old_color", required_argument, NULL, 'O'}, 
+        {"new_color", required_argument, NULL, 'N'},
+
+        {"collage", no_argument, NULL, 260},
+        {"number_x", required_argument, NULL, 'x'},
+        {"number_y", required_argument, NULL, 'y'},
+
+        {"inverse", no_argument, NULL, 263},
+        {"gray", no_argument, NULL, 264},
+        {"left_up", required_argument, NULL, 265},
+        {"right_down", required_argument, NULL, 266},
+
+        {"resize", no_argument, NULL, 267},
+        {"left", required_argument, NULL, 268},
+        {"right", required_argument, NULL, 269},
+        {"above", required_argument, NULL, 270},
+        {"below", required_argument, NULL, 271},
+
+        {"scale", required_argument, NULL, 272},
+        {"filter", required_argument, NULL, 273},
+        {"decode_scale", required_argument, NULL, 274},
+        {"tiled", no_argument, NULL, 275},
+        {"benchmark", no_argument, NULL, 276},
+        {"scratch_threshold", required_argument, NULL, 277},
+        {"scratch_dir", required_argument, NULL, 278},
+        {"output_dir", required_argument, NULL, 279},
+        {"bench_size", required_argument, NULL, 280},
+        {"bench_content", required_argument, NULL, 281},
+        {"stats", no_argument, NULL, 282},
+        {"prefetch", required_argument, NULL, 283},
+        {"shapes", required_argument, NULL, 284},
+        {"antialias", no_argument, NULL, 285},
+        {"fill_rule", required_argument, NULL, 286},
+        {"flood_fill", no_argument, NULL, 287},
+        {"seed", required_argument, NULL, 288},
+        {"biggest_blob", no_argument, NULL, 289},
+        {"region_stats", required_argument, NULL, 290},
+        {"track_color", required_argument, NULL, 291},
+        {"info_list", required_argument, NULL, 292},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "hi:o:p:t:c:f:O:N:x:y:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'h': help_flag = 1; break;
+            case 'i': input_filename = optarg; break;
+            case 'o': output_filename = optarg; break;
+            case 256: info_flag = 1; break; 
+            case 292: info_flag = 1; info_list_path = optarg; break;
+            case 261: json_flag = true; break;
+            case 262: thread_count = atoi(optarg); break;
+
+            case 257: op_triangle_flag = 1; break; 
+            case 'p': points_str = optarg; break;
+            case 't': thickness = atoi(optarg); break;
+            case 'c': line_color_str = optarg; break;
+            case 258: fill_flag = 1; break; 
+            case 'f': fill_color_str = optarg; break;
+
+            case 259: op_biggest_rect_flag = 1; break; 
+            case 'O': old_color_str = optarg; break;
+            case 'N': new_color_str = optarg; break;
+
+            case 260: op_collage_flag = 1; break; 
+            case 'x': number_x = atoi(optarg); break;
+            case 'y': number_y = atoi(optarg); break;
+
+            case 263: op_inverse_flag = 1; break;
+            case 264: op_gray_flag = 1; break;
+            case 265: left_up_str = optarg; break;
+            case 266: right_down_str = optarg; break;
+
+            case 267: op_resize_flag = 1; break;
+            case 268: resize_left = atoi(optarg); break;
+            case 269: resize_right = atoi(optarg); break;
+            case 270: resize_above = atoi(optarg); break;
+            case 271: resize_below = atoi(optarg); break;
+
+            case 272: scale_str = optarg; break;
+            case 273: filter_str = optarg; break;
+            case 274: decode_scale = atoi(optarg); if (decode_scale < 1) decode_scale = -1; break;
+            case 275: tiled_flag = true; break;
+            case 276: benchmark_flag = 1; break;
+            case 277: scratch_threshold_str = optarg; break;
+            case 278: scratch_dir = optarg; break;
+            case 279: output_dir = optarg; break;
+            case 280: bench_size_str = optarg; break;
+            case 281: bench_content_str = optarg; break;
+            case 282: stats_flag = true; break;
+            case 283: prefetch_depth = atoi(optarg); break;
+            case 284: op_shapes_flag = 1; shapes_path = optarg; break;
+            case 285: antialias_flag = true; break;
+            case 286: fill_rule_str = optarg; break;
+            case 287: op_flood_flag = 1; break;
+            case 288: seed_str = optarg; break;
+            case 289: op_blob_flag = 1; break;
+            case 290: regions_path = optarg; break;
+            case 291: if (track_count < REGION_MAX_COLORS) track_color_strs[track_count] = optarg; track_count++; break;
+            
+            case '?': 
+                fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
+                status = ERROR_ARG;
+                goto cleanup_and_exit;
+            default: 
+                status = ERROR_ARG; 
+                goto cleanup_and_exit;
+        }
+    }
+    
+    if (optind < argc && input_filename == NULL) {
+        input_filename = argv[optind];
+    }
+
+    /* Keep stdout machine-readable when JSON or region statistics are
+     * requested, and free for the image itself with "-o -". */
+    FILE *messages = json_flag || regions_path || (!output_dir && strcmp(output_filename, "-") == 0) ? stderr : stdout;
+    fprintf(messages, "Course work for option 4.19, created by Omelyash Egor\n");
+
+
+    if (help_flag || (argc == 1 && !input_filename) ) { 
+        print_help();
+        status = ERROR_SUCCESS; 
+        goto cleanup_and_exit;
+    }
+
+    if (!input_filename && ((info_flag && !info_list_path) || regions_path || op_triangle_flag || op_biggest_rect_flag || op_collage_flag ||
+                            op_inverse_flag || op_gray_flag || op_resize_flag || op_shapes_flag || op_flood_flag || op_blob_flag ||
+                            scale_str || decode_scale)) {
+         fprintf(stderr, "Error: Input file is required for this operation.\n");
+         status = ERROR_FILE;
+         goto cleanup_and_exit;
+    }
+
+
+    int num_ops = op_triangle_flag + op_biggest_rect_flag + op_collage_flag + op_inverse_flag + op_gray_flag + op_resize_flag +
+                  op_shapes_flag + op_flood_flag + op_blob_flag;
+    if (num_ops > 1) {
+        fprintf(stderr, "Error: Only one image processing operation allowed at a time.\n");
+        status = ERROR_OPERATION_FLAG;
+        goto cleanup_and_exit;
+    }
+    if (num_ops == 0 && !info_flag && !regions_path && !scale_str && !decode_scale && !benchmark_flag) { 
+        fprintf(stderr, "Error: No operation specified. Use --help for options.\n");
+        status = ERROR_OPERATION_FLAG;
+        goto cleanup_and_exit;
+    }
+
+    if (op_triangle_flag) {
+        if (!points_str || thickness <= 0 || !line_color_str) {
+            fprintf(stderr, "Error: --triangle requires --points, --thickness (>0), and --color.\n");
+            status = ERROR_ARG;
+        }
+        if (fill_flag && !fill_color_str) {
+            fprintf(stderr, "Error: --fill requires --fill_color for --triangle.\n"); 
+            status = ERROR_ARG;
+        }
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) {
+             if(!parse_points_string(points_str, &p1, &p2, &p3)) status = ERROR_ARG;
+             if(!parse_rgba_string(line_color_str, &line_color)) status = ERROR_ARG;
+             if(fill_flag && !parse_rgba_string(fill_color_str, &fill_color)) status = ERROR_ARG;
+        }
+    } else if (op_shapes_flag) {
+        if (thickness < 0 || (thickness > 0 && !line_color_str) || (thickness == 0 && !fill_flag)) {
+            fprintf(stderr, "Error: --shapes requires --thickness (>0) and --color, --fill, or both.\n");
+            status = ERROR_ARG;
+        }
+        if (fill_flag && !fill_color_str) {
+            fprintf(stderr, "Error: --fill requires --fill_color for --shapes.\n");
+            status = ERROR_ARG;
+        }
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) {
+            if (thickness > 0 && !parse_rgba_string(line_color_str, &line_color)) status = ERROR_ARG;
+            if (fill_flag && !parse_rgba_string(fill_color_str, &fill_color)) status = ERROR_ARG;
+            if (fill_rule_str && !parse_fill_rule_string(fill_rule_str, &fill_rule)) status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) status = load_shapes_file(shapes_path, &shapes);
+    } else if (op_biggest_rect_flag) {
+        if (!old_color_str || !new_color_str) {
+            fprintf(stderr, "Error: --biggest_rect requires --old_color and --new_color.\n");
+            status = ERROR_ARG;
+        }
+         if (status == ERROR_SUCCESS) {
+            if(!parse_color_string(old_color_str, &old_color)) status = ERROR_ARG;
+            if(!parse_rgba_string(new_color_str, &new_color)) status = ERROR_ARG;
+         }
+    } else if (op_flood_flag) {
+        if (!seed_str || !new_color_str) {
+            fprintf(stderr, "Error: --flood_fill requires --seed and --new_color.\n");
+            status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) {
+            if (!parse_point_string(seed_str, &seed)) status = ERROR_ARG;
+            if (!parse_rgba_string(new_color_str, &new_color)) status = ERROR_ARG;
+        }
+    } else if (op_blob_flag) {
+        if (!old_color_str || !new_color_str) {
+            fprintf(stderr, "Error: --biggest_blob requires --old_color and --new_color.\n");
+            status = ERROR_ARG;
+        }
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) {
+            if (!parse_color_string(old_color_str, &old_color)) status = ERROR_ARG;
+            if (!parse_rgba_string(new_color_str, &new_color)) status = ERROR_ARG;
+        }
+    } else if (op_collage_flag) {
+        if (number_x <= 0 || number_y <= 0) {
+            fprintf(stderr, "Error: --collage requires --number_x > 0 and --number_y > 0.\n");
+            status = ERROR_ARG;
+        }
+    } else if (op_inverse_flag || op_gray_flag) {
+        if (!left_up_str || !right_down_str) {
+            fprintf(stderr, "Error: --inverse and --gray require --left_up and --right_down.\n");
+            status = ERROR_ARG;
+        }
+        if (status == ERROR_SUCCESS) {
+            if(!parse_point_string(left_up_str, &left_up)) status = ERROR_ARG;
+            if(!parse_point_string(right_down_str, &right_down)) status = ERROR_ARG;
+        }
+    } else if (op_resize_flag) {
+        Rgb background = {0, 0, 0};
+        if (line_color_str && !parse_color_string(line_color_str, &background)) status = ERROR_ARG;
+        line_color = (Rgba){background.r, background.g, background.b, 255};
+    }
+
+    if (scale_str) {
+        if (sscanf(scale_str, "%dx%d", &scale_w, &scale_h) != 2 || scale_w < 0 || scale_h < 0 || (scale_w == 0 && scale_h == 0)) {
+            fprintf(stderr, "Error: Incorrect scale '%s'. Expected WxH with at least one side > 0.\n", scale_str);
+            status = ERROR_ARG;
+        }
+        if (filter_str && !parse_filter_string(filter_str, &scale_filter)) status = ERROR_ARG;
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+    }
+
+    if (decode_scale < 0) {
+        fprintf(stderr, "Error: --decode_scale must be a positive integer.\n");
+        status = ERROR_ARG;
+    }
+
+    if (prefetch_depth < 0 || prefetch_depth > 256) {
+        fprintf(stderr, "Error: --prefetch must be between 0 and 256.\n");
+        status = ERROR_ARG;
+    }
+
+    if (scratch_threshold_str) {
+        char *end = NULL;
+        long long mib = strtoll(scratch_threshold_str, &end, 10);
+        if (!end || *end != '\0' || end == scratch_threshold_str || mib < 0 || mib > (long long)(SIZE_MAX >> 20)) {
+            fprintf(stderr, "Error: Incorrect --scratch_threshold '%s'. Expected MiB >= 0.\n", scratch_threshold_str);
+            status = ERROR_ARG;
+        } else {
+            scratch_threshold = (size_t)mib << 20;
+        }
+    }
+
+    if (regions_path) {
+        if (num_ops > 0 || info_flag || benchmark_flag || scale_str) {
+            fprintf(stderr, "Error: --region_stats runs on its own.\n");
+            status = ERROR_OPERATION_FLAG;
+        }
+        if (track_count > REGION_MAX_COLORS) {
+            fprintf(stderr, "Error: At most %d --track_color colors are allowed.\n", REGION_MAX_COLORS);
+            status = ERROR_ARG;
+        }
+        for (int i = 0; i < track_count && i < REGION_MAX_COLORS; i++) {
+            if (!parse_color_string(track_color_strs[i], &track_colors[i])) status = ERROR_ARG;
+        }
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+    } else if (track_count > 0) {
+        fprintf(stderr, "Error: --track_color requires --region_stats.\n");
+        status = ERROR_ARG;
+    }
+
+    if (benchmark_flag && num_ops > 0) {
+        fprintf(stderr, "Error: --benchmark runs on its own.\n");
+        status = ERROR_OPERATION_FLAG;
+    } else if (benchmark_flag) {
+        if (bench_size_str && (sscanf(bench_size_str, "%dx%d", &bench_w, &bench_h) != 2 || bench_w <= 0 || bench_h <= 0)) {
+            fprintf(stderr, "Error: Incorrect --bench_size '%s'. Expected WxH.\n", bench_size_str);
+            status = ERROR_ARG;
+        }
+        if (bench_content_str && !parse_benchmark_contents(bench_content_str, &bench_contents)) status = ERROR_ARG;
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+        }
+    }
+
+    if (status != ERROR_SUCCESS) goto cleanup_and_exit;
+    cw_set_scratch(scratch_threshold, scratch_dir);
+
+
+    if (info_flag) {
+        if (thread_count <= 0) {
+            fprintf(stderr, "Error: --threads must be > 0.\n");
+            status = ERROR_ARG;
+            goto cleanup_and_exit;
+        }
+        const char **info_files = (const char**)malloc(sizeof(char*) * (argc + 1));
+        if (!info_files) {
+            fprintf(stderr, "Memory allocation failed for input file list\n");
+            status = ERROR_MEMORY;
+            goto cleanup_and_exit;
+        }
+        int info_count = 0;
+        if (input_filename) info_files[info_count++] = input_filename;
+        for (int i = optind; i < argc; i++) {
+            if (argv[i] != input_filename) info_files[info_count++] = argv[i];
+        }
+        FILE *info_list = NULL;
+        if (info_list_path) {
+            info_list = strcmp(info_list_path, "-") == 0 ? stdin : fopen(info_list_path, "r");
+            if (!info_list) {
+                fprintf(stderr, "Error: Cannot open file list %s for reading.\n", info_list_path);
+                free(info_files);
+                status = ERROR_FILE;
+                goto cleanup_and_exit;
+            }
+        }
+        status = run_info(info_files, info_count, info_list, thread_count, json_flag);
+        if (info_list && info_list != stdin) fclose(info_list);
+        free(info_files);
+        goto cleanup_and_exit;
+    }
+
+    if (regions_path) {
+        JobOptions load = {0};
+        load.decode_scale = decode_scale;
+        load.thread_count = thread_count;
+        status = run_region_stats(input_filename, &load, regions_path, track_colors, track_count, json_flag);
+        goto cleanup_and_exit;
+    }
+
+    if (benchmark_flag) {
+        /* The input, when given, is the source of the "photo" content. */
+        Image *photo = NULL;
+        if (input_filename) {
+            JobOptions load = {0};
+            status = cw_load_image_file(input_filename, &load, &photo, NULL);
+        }
+        if (status == ERROR_SUCCESS) status = run_benchmark_suite(bench_w, bench_h, bench_contents, photo, thread_count, scratch_dir);
+        cw_image_free(photo);
+        goto cleanup_and_exit;
+    }
+
+    JobOptions job = {
+        .op_triangle_flag = op_triangle_flag, .op_biggest_rect_flag = op_biggest_rect_flag,
+        .op_collage_flag = op_collage_flag, .op_inverse_flag = op_inverse_flag,
+        .op_gray_flag = op_gray_flag, .op_resize_flag = op_resize_flag, .op_shapes_flag = op_shapes_flag,
+        .op_flood_flag = op_flood_flag, .op_blob_flag = op_blob_flag, .seed = seed,
+        .tiled_flag = tiled_flag, .thread_count = thread_count,
+        .p1 = p1, .p2 = p2, .p3 = p3, .shapes = &shapes,
+        .thickness = thickness, .line_color = line_color, .fill_flag = fill_flag, .fill_color = fill_color,
+        .fill_rule = fill_rule, .antialias_flag = antialias_flag,
+        .old_color = old_color, .new_color = new_color,
+        .number_x = number_x, .number_y = number_y,
+        .left_up = left_up, .right_down = right_down,
+        .resize_left = resize_left, .resize_right = resize_right,
+        .resize_above = resize_above, .resize_below = resize_below,
+        .scale_flag = scale_str != NULL, .scale_w = scale_w, .scale_h = scale_h, .scale_filter = scale_filter,
+        .decode_scale = decode_scale,
+        .stats_flag = stats_flag, .stats_json = json_flag,
+    };
+
+    if (!output_dir) {
+        status = cw_process_image_file(input_filename, output_filename, &job);
+        if (status == ERROR_SUCCESS) fprintf(messages, "Operation completed successfully. Output: %s\n", output_filename);
+        goto cleanup_and_exit;
+    }
+
+    /* Batch: every input file is written under output_dir with its own
+     * name. The job arena and the pixel buffer pool are reused from one
+     * file to the next; a failed file does not stop the others. Unless
+     * --prefetch is 0, inputs are read ahead and outputs written behind
+     * while other files are processed. */
+    const char **inputs = (const char**)malloc(sizeof(char*) * (argc + 1));
+    if (!inputs) {
+        fprintf(stderr, "Memory allocation failed for input file list\n");
+        status = ERROR_MEMORY;
+        goto cleanup_and_exit;
+    }
+    int input_count = 0;
+    bool stdin_input = false;
+    for (int i = optind - 1; i < argc; i++) {
+        const char *input = i < optind ? input_filename : argv[i];
+        if (i >= optind && argv[i] == input_filename) continue;
+        if (strcmp(input, "-") == 0) stdin_input = true;
+        inputs[input_count++] = input;
+    }
+    BatchIo *io = prefetch_depth > 0 && !stdin_input ? batch_io_create(inputs, input_count, prefetch_depth, messages) : NULL;
+    for (int i = 0; i < input_count; i++) {
+        const char *input = inputs[i];
+        const char *base = strrchr(input, '/');
+        base = base ? base + 1 : input;
+        size_t path_size = strlen(output_dir) + strlen(base) + 2;
+        char *output = (char*)cw_arena_alloc(path_size);
+        if (!output) {
+            fprintf(stderr, "Memory allocation failed for output path\n");
+            status = ERROR_MEMORY;
+            break;
+        }
+        snprintf(output, path_size, "%s/%s", output_dir, base);
+        int file_status;
+        if (io) {
+            unsigned char *data = NULL, *encoded = NULL;
+            size_t size = 0, encoded_size = 0;
+            file_status = batch_io_take_input(io, i, &data, &size);
+            if (file_status == ERROR_SUCCESS) {
+                file_status = cw_process_image_buffer(input, data, size, output, &encoded, &encoded_size, &job);
+            }
+            free(data);
+            if (file_status == ERROR_SUCCESS) file_status = batch_io_write(io, output, encoded, encoded_size);
+        } else {
+            file_status = cw_process_image_file(input, output, &job);
+        }
+        if (file_status == ERROR_SUCCESS && !io) {
+            fprintf(messages, "Operation completed successfully. Output: %s\n", output);
+        } else if (file_status != ERROR_SUCCESS) {
+            fprintf(stderr, "Failed to process '%s' (error code %d).\n", input, file_status);
+            if (status == ERROR_SUCCESS) status = file_status;
+        }
+        cw_arena_reset();
+    }
+    if (io) {
+        int write_status = batch_io_finish(io);
+        if (status == ERROR_SUCCESS) status = write_status;
+    }
+    free(inputs);
+
+cleanup_and_exit:
+    cw_free_shape_list(&shapes);
+    cw_thread_release();
+    if (status != ERROR_SUCCESS) {
+         fprintf(stderr, "Program terminated with error code: %d\n", status);
+    }
+    return status;
+}
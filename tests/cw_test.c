@@ -0,0 +1,588 @@
+/* Regression tests for the library, through cw.h only: exact pixels after
+ * each operation, the same result with one and with several threads, and
+ * malformed or truncated BMP and PNG input. Pixels go in and come out as
+ * PNG (libpng's simplified API), so the codecs are exercised too.
+ * Exits non-zero when a check fails. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <png.h>
+#include <zlib.h>
+#include "cw.h"
+
+static int checks, failures;
+
+#define CHECK(cond) do {                                                    \
+    checks++;                                                               \
+    if (!(cond)) {                                                          \
+        failures++;                                                         \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+    }                                                                       \
+} while (0)
+
+/* RGBA pixels read back from an image, row-major. */
+typedef struct {
+    int width, height;
+    unsigned char *rgba;
+} Pixels;
+
+static const unsigned char *pixel_at(const Pixels *p, int x, int y) {
+    return p->rgba + ((size_t)y * p->width + x) * 4;
+}
+
+static bool pixel_is(const Pixels *p, int x, int y, int r, int g, int b, int a) {
+    const unsigned char *px = pixel_at(p, x, y);
+    return px[0] == r && px[1] == g && px[2] == b && px[3] == a;
+}
+
+static Pixels read_pixels(const CwImage *image) {
+    Pixels p = {0, 0, NULL};
+    unsigned char *png = NULL;
+    size_t size = 0;
+    if (cw_image_encode_png(image, &png, &size) != CW_OK) return p;
+    png_image decoded;
+    memset(&decoded, 0, sizeof(decoded));
+    decoded.version = PNG_IMAGE_VERSION;
+    if (png_image_begin_read_from_memory(&decoded, png, size)) {
+        decoded.format = PNG_FORMAT_RGBA;
+        p.rgba = (unsigned char*)malloc(PNG_IMAGE_SIZE(decoded));
+        if (p.rgba && png_image_finish_read(&decoded, NULL, p.rgba, 0, NULL)) {
+            p.width = (int)decoded.width;
+            p.height = (int)decoded.height;
+        } else {
+            free(p.rgba);
+            p.rgba = NULL;
+        }
+    }
+    png_image_free(&decoded);
+    free(png);
+    return p;
+}
+
+static bool near(double a, double b) {
+    return a - b < 1e-9 && b - a < 1e-9;
+}
+
+static bool same_pixels(const CwImage *a, const CwImage *b) {
+    Pixels pa = read_pixels(a), pb = read_pixels(b);
+    bool same = pa.rgba && pb.rgba && pa.width == pb.width && pa.height == pb.height &&
+                memcmp(pa.rgba, pb.rgba, (size_t)pa.width * pa.height * 4) == 0;
+    free(pa.rgba);
+    free(pb.rgba);
+    return same;
+}
+
+/* Encodes RGB (channels 3) or RGBA (4) pixels as PNG; free() the result. */
+static unsigned char *encode_png(const unsigned char *pixels, int width, int height, int channels, size_t *size) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    image.width = (png_uint_32)width;
+    image.height = (png_uint_32)height;
+    image.format = channels == 4 ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+    png_alloc_size_t bytes = 0;
+    if (!png_image_write_to_memory(&image, NULL, &bytes, 0, pixels, 0, NULL)) return NULL;
+    unsigned char *png = (unsigned char*)malloc(bytes);
+    if (png && !png_image_write_to_memory(&image, png, &bytes, 0, pixels, 0, NULL)) {
+        free(png);
+        return NULL;
+    }
+    *size = bytes;
+    return png;
+}
+
+static CwImage *make_image(const unsigned char *pixels, int width, int height, int channels) {
+    size_t size = 0;
+    unsigned char *png = encode_png(pixels, width, height, channels, &size);
+    CwImage *image = NULL;
+    if (png) cw_image_decode(png, size, 0, &image);
+    free(png);
+    return image;
+}
+
+/* A solid RGB image. */
+static CwImage *make_solid(int width, int height, CwRgb color) {
+    unsigned char *rgb = (unsigned char*)malloc((size_t)width * height * 3);
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        rgb[3 * i] = color.r;
+        rgb[3 * i + 1] = color.g;
+        rgb[3 * i + 2] = color.b;
+    }
+    CwImage *image = make_image(rgb, width, height, 3);
+    free(rgb);
+    return image;
+}
+
+/* Deterministic noise, so every operation sees varied pixels. */
+static CwImage *make_noise(int width, int height, int channels, uint32_t seed) {
+    size_t bytes = (size_t)width * height * channels;
+    unsigned char *pixels = (unsigned char*)malloc(bytes);
+    for (size_t i = 0; i < bytes; i++) {
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        pixels[i] = (unsigned char)(seed >> 8);
+    }
+    CwImage *image = make_image(pixels, width, height, channels);
+    free(pixels);
+    return image;
+}
+
+/* Error messages for the invalid calls and inputs are expected; keep them
+ * off the test output. */
+static int quiet_stderr(void) {
+    fflush(stderr);
+    int saved = dup(2);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, 2);
+        close(null);
+    }
+    return saved;
+}
+
+static void restore_stderr(int saved) {
+    fflush(stderr);
+    if (saved >= 0) {
+        dup2(saved, 2);
+        close(saved);
+    }
+}
+
+/* Paints an inclusive rectangle through the library itself. */
+static void paint_rect(CwImage *image, int x0, int y0, int x1, int y1, CwRgb color) {
+    CwPoint points[4] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+    int count = 4;
+    CwRgba fill = {color.r, color.g, color.b, 255};
+    cw_draw_shapes(image, points, &count, 1, 1, fill, true, fill, CW_FILL_EVEN_ODD, false, 1);
+}
+
+static void test_codec_round_trip(void) {
+    unsigned char rgb[4 * 3 * 3];
+    for (int i = 0; i < (int)sizeof(rgb); i++) rgb[i] = (unsigned char)(i * 7);
+    CwImage *image = make_image(rgb, 4, 3, 3);
+    CHECK(image != NULL);
+    if (!image) return;
+    CHECK(cw_image_width(image) == 4 && cw_image_height(image) == 3);
+    Pixels p = read_pixels(image);
+    CHECK(p.rgba != NULL);
+    for (int i = 0; p.rgba && i < 12; i++) {
+        CHECK(pixel_is(&p, i % 4, i / 4, rgb[3 * i], rgb[3 * i + 1], rgb[3 * i + 2], 255));
+    }
+    free(p.rgba);
+
+    /* The same pixels through a BMP file. */
+    char path[] = "/tmp/cw_test_XXXXXX.bmp";
+    int fd = mkstemps(path, 4);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        close(fd);
+        CwImage *loaded = NULL;
+        CHECK(cw_image_save(image, path) == CW_OK);
+        CHECK(cw_image_load(path, 0, &loaded) == CW_OK);
+        CHECK(loaded && same_pixels(image, loaded));
+        cw_image_free(loaded);
+        unlink(path);
+    }
+    cw_image_free(image);
+}
+
+static void test_triangle(void) {
+    CwImage *image = make_solid(40, 40, (CwRgb){255, 255, 255});
+    CHECK(cw_draw_triangle(image, (CwPoint){5, 5}, (CwPoint){30, 5}, (CwPoint){5, 30}, 1,
+                           (CwRgba){255, 0, 0, 255}, true, (CwRgba){0, 0, 255, 255}, false, 1) == CW_OK);
+    Pixels p = read_pixels(image);
+    CHECK(pixel_is(&p, 5, 5, 255, 0, 0, 255));
+    CHECK(pixel_is(&p, 20, 5, 255, 0, 0, 255));
+    CHECK(pixel_is(&p, 5, 20, 255, 0, 0, 255));
+    CHECK(pixel_is(&p, 10, 10, 0, 0, 255, 255));
+    CHECK(pixel_is(&p, 4, 4, 255, 255, 255, 255));
+    CHECK(pixel_is(&p, 25, 25, 255, 255, 255, 255));
+    CHECK(pixel_is(&p, 39, 39, 255, 255, 255, 255));
+    free(p.rgba);
+
+    /* Half-transparent paint blends over the blue fill. */
+    CHECK(cw_draw_triangle(image, (CwPoint){5, 5}, (CwPoint){30, 5}, (CwPoint){5, 30}, 1,
+                           (CwRgba){0, 0, 0, 0}, true, (CwRgba){0, 0, 0, 128}, false, 1) == CW_OK);
+    p = read_pixels(image);
+    const unsigned char *px = pixel_at(&p, 10, 10);
+    CHECK(px[0] == 0 && px[1] == 0 && px[2] >= 126 && px[2] <= 128);
+    free(p.rgba);
+    cw_image_free(image);
+}
+
+/* Triangles large enough to be split into bands must not depend on the
+ * thread count, opaque, translucent or anti-aliased. */
+static void test_triangle_threads(void) {
+    static const struct {
+        CwRgba line, fill;
+        bool antialias;
+    } cases[] = {
+        {{255, 0, 0, 255}, {0, 255, 0, 255}, false},
+        {{255, 0, 0, 100}, {0, 255, 0, 60}, false},
+        {{255, 0, 0, 255}, {0, 255, 0, 255}, true},
+    };
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (int channels = 3; channels <= 4; channels++) {
+            CwImage *one = make_noise(733, 611, channels, 12345);
+            CwImage *many = make_noise(733, 611, channels, 12345);
+            CHECK(cw_draw_triangle(one, (CwPoint){-40, 17}, (CwPoint){700, 90}, (CwPoint){300, 650}, 5,
+                                   cases[c].line, true, cases[c].fill, cases[c].antialias, 1) == CW_OK);
+            CHECK(cw_draw_triangle(many, (CwPoint){-40, 17}, (CwPoint){700, 90}, (CwPoint){300, 650}, 5,
+                                   cases[c].line, true, cases[c].fill, cases[c].antialias, 7) == CW_OK);
+            CHECK(same_pixels(one, many));
+            cw_image_free(one);
+            cw_image_free(many);
+        }
+    }
+
+    /* The tiled shape pass, with polygons and ellipses overlapping. */
+    CwPoint points[] = {{10, 10}, {500, 40}, {260, 580}, {600, 20}, {720, 300}, {650, 600}, {400, 500}};
+    int counts[] = {3, 4};
+    CwImage *one = make_noise(733, 611, 3, 777);
+    CwImage *many = make_noise(733, 611, 3, 777);
+    CHECK(cw_draw_shapes(one, points, counts, 2, 3, (CwRgba){9, 9, 9, 200}, true, (CwRgba){200, 30, 30, 150},
+                         CW_FILL_NON_ZERO, true, 1) == CW_OK);
+    CHECK(cw_draw_shapes(many, points, counts, 2, 3, (CwRgba){9, 9, 9, 200}, true, (CwRgba){200, 30, 30, 150},
+                         CW_FILL_NON_ZERO, true, 5) == CW_OK);
+    CHECK(cw_draw_ellipse(one, (CwPoint){360, 300}, 250, 170, 4, (CwRgba){0, 0, 0, 255}, true,
+                          (CwRgba){10, 200, 10, 255}, false, 1) == CW_OK);
+    CHECK(cw_draw_ellipse(many, (CwPoint){360, 300}, 250, 170, 4, (CwRgba){0, 0, 0, 255}, true,
+                          (CwRgba){10, 200, 10, 255}, false, 6) == CW_OK);
+    CHECK(same_pixels(one, many));
+    cw_image_free(one);
+    cw_image_free(many);
+}
+
+static void test_biggest_rect(void) {
+    CwImage *image = make_solid(20, 10, (CwRgb){0, 0, 0});
+    paint_rect(image, 2, 2, 7, 4, (CwRgb){255, 0, 0});
+    paint_rect(image, 12, 6, 13, 7, (CwRgb){255, 0, 0});
+    CHECK(cw_recolor_biggest_rect(image, (CwRgb){255, 0, 0}, (CwRgba){0, 0, 255, 255}) == CW_OK);
+    Pixels p = read_pixels(image);
+    CHECK(pixel_is(&p, 2, 2, 0, 0, 255, 255));
+    CHECK(pixel_is(&p, 7, 4, 0, 0, 255, 255));
+    CHECK(pixel_is(&p, 8, 4, 0, 0, 0, 255));
+    CHECK(pixel_is(&p, 12, 6, 255, 0, 0, 255));
+    CHECK(pixel_is(&p, 13, 7, 255, 0, 0, 255));
+    free(p.rgba);
+    cw_image_free(image);
+}
+
+static void test_flood_fill(void) {
+    CwImage *image = make_solid(20, 10, (CwRgb){255, 255, 255});
+    paint_rect(image, 10, 0, 10, 9, (CwRgb){0, 0, 0});
+    CHECK(cw_flood_fill(image, (CwPoint){2, 2}, (CwRgba){0, 255, 0, 255}) == CW_OK);
+    Pixels p = read_pixels(image);
+    CHECK(pixel_is(&p, 0, 0, 0, 255, 0, 255));
+    CHECK(pixel_is(&p, 9, 9, 0, 255, 0, 255));
+    CHECK(pixel_is(&p, 10, 5, 0, 0, 0, 255));
+    CHECK(pixel_is(&p, 11, 5, 255, 255, 255, 255));
+    free(p.rgba);
+    int saved = quiet_stderr();
+    CHECK(cw_flood_fill(image, (CwPoint){-1, 2}, (CwRgba){0, 255, 0, 255}) == CW_ERROR_ARG);
+    restore_stderr(saved);
+    cw_image_free(image);
+}
+
+static void test_biggest_blob(void) {
+    for (int threads = 1; threads <= 4; threads += 3) {
+        CwImage *image = make_solid(30, 300, (CwRgb){0, 0, 0});
+        /* An L of 2 + 150 pixels spanning many row strips, and a 5x5 square. */
+        paint_rect(image, 3, 10, 3, 159, (CwRgb){255, 0, 0});
+        paint_rect(image, 4, 159, 5, 159, (CwRgb){255, 0, 0});
+        paint_rect(image, 20, 20, 24, 24, (CwRgb){255, 0, 0});
+        CHECK(cw_recolor_biggest_blob(image, (CwRgb){255, 0, 0}, (CwRgba){0, 0, 255, 255}, threads) == CW_OK);
+        Pixels p = read_pixels(image);
+        CHECK(pixel_is(&p, 3, 10, 0, 0, 255, 255));
+        CHECK(pixel_is(&p, 3, 100, 0, 0, 255, 255));
+        CHECK(pixel_is(&p, 5, 159, 0, 0, 255, 255));
+        CHECK(pixel_is(&p, 22, 22, 255, 0, 0, 255));
+        CHECK(pixel_is(&p, 4, 158, 0, 0, 0, 255));
+        free(p.rgba);
+        cw_image_free(image);
+    }
+}
+
+static void test_invert_gray(void) {
+    unsigned char rgb[3 * 3 * 3] = {
+        10, 20, 30,   200, 100, 50,  255, 0, 0,
+        0, 255, 0,    0, 0, 255,     1, 2, 3,
+        90, 90, 90,   128, 64, 32,   7, 8, 9,
+    };
+    CwImage *image = make_image(rgb, 3, 3, 3);
+    CHECK(cw_invert_region(image, (CwPoint){1, 0}, (CwPoint){2, 1}) == CW_OK);
+    Pixels p = read_pixels(image);
+    CHECK(pixel_is(&p, 0, 0, 10, 20, 30, 255));
+    CHECK(pixel_is(&p, 1, 0, 55, 155, 205, 255));
+    CHECK(pixel_is(&p, 2, 1, 254, 253, 252, 255));
+    CHECK(pixel_is(&p, 1, 2, 128, 64, 32, 255));
+    free(p.rgba);
+
+    /* Luma is (77 R + 150 G + 29 B + 128) >> 8; corners may come in any order. */
+    CHECK(cw_grayscale_region(image, (CwPoint){2, 2}, (CwPoint){0, 1}) == CW_OK);
+    p = read_pixels(image);
+    CHECK(pixel_is(&p, 0, 1, 149, 149, 149, 255));
+    CHECK(pixel_is(&p, 1, 1, 226, 226, 226, 255));
+    CHECK(pixel_is(&p, 0, 2, 90, 90, 90, 255));
+    CHECK(pixel_is(&p, 1, 2, 80, 80, 80, 255));
+    CHECK(pixel_is(&p, 0, 0, 10, 20, 30, 255));
+    free(p.rgba);
+    cw_image_free(image);
+}
+
+static void test_region_stats(void) {
+    CwImage *image = make_solid(16, 8, (CwRgb){0, 0, 0});
+    paint_rect(image, 0, 0, 7, 7, (CwRgb){200, 100, 50});
+    for (int threads = 1; threads <= 3; threads += 2) {
+        CwRegionTable *table = NULL;
+        CwRgb tracked[2] = {{200, 100, 50}, {0, 0, 0}};
+        CHECK(cw_region_table_build(image, tracked, 2, threads, &table) == CW_OK);
+        if (!table) continue;
+        CwRegionStats stats;
+        unsigned long long counts[2];
+        cw_region_stats(table, (CwPoint){4, 0}, (CwPoint){11, 7}, &stats, counts);
+        CHECK(stats.pixels == 64);
+        CHECK(near(stats.r, 100.0) && near(stats.g, 50.0) && near(stats.b, 25.0) && near(stats.a, 255.0));
+        CHECK(counts[0] == 32 && counts[1] == 32);
+        cw_region_stats(table, (CwPoint){100, 100}, (CwPoint){200, 200}, &stats, counts);
+        CHECK(stats.pixels == 0 && counts[0] == 0 && counts[1] == 0);
+        cw_region_table_free(table);
+    }
+    cw_image_free(image);
+}
+
+static void test_collage_resize_scale(void) {
+    unsigned char rgb[2 * 2 * 3] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    CwImage *image = make_image(rgb, 2, 2, 3);
+    CHECK(cw_collage(&image, 3, 2) == CW_OK);
+    CHECK(cw_image_width(image) == 6 && cw_image_height(image) == 4);
+    Pixels p = read_pixels(image);
+    CHECK(pixel_is(&p, 0, 0, 1, 2, 3, 255));
+    CHECK(pixel_is(&p, 5, 3, 10, 11, 12, 255));
+    CHECK(pixel_is(&p, 4, 2, 1, 2, 3, 255));
+    free(p.rgba);
+
+    CHECK(cw_resize_canvas(&image, 2, 1, 3, 0, (CwRgb){50, 60, 70}) == CW_OK);
+    CHECK(cw_image_width(image) == 9 && cw_image_height(image) == 7);
+    p = read_pixels(image);
+    CHECK(pixel_is(&p, 0, 0, 50, 60, 70, 255));
+    CHECK(pixel_is(&p, 8, 6, 50, 60, 70, 255));
+    CHECK(pixel_is(&p, 2, 3, 1, 2, 3, 255));
+    CHECK(pixel_is(&p, 7, 6, 10, 11, 12, 255));
+    free(p.rgba);
+    CHECK(cw_collage(&image, 0, 1) == CW_ERROR_ARG);
+    cw_image_free(image);
+
+    /* A box filter halving uniform 2x2 blocks keeps their colours. */
+    CwImage *blocks = make_solid(8, 4, (CwRgb){10, 20, 30});
+    paint_rect(blocks, 2, 0, 3, 1, (CwRgb){200, 0, 100});
+    CHECK(cw_scale(&blocks, 4, 2, CW_FILTER_BOX, 1) == CW_OK);
+    CHECK(cw_image_width(blocks) == 4 && cw_image_height(blocks) == 2);
+    p = read_pixels(blocks);
+    CHECK(pixel_is(&p, 0, 0, 10, 20, 30, 255));
+    CHECK(pixel_is(&p, 1, 0, 200, 0, 100, 255));
+    CHECK(pixel_is(&p, 3, 1, 10, 20, 30, 255));
+    free(p.rgba);
+    cw_image_free(blocks);
+
+    for (int channels = 3; channels <= 4; channels++) {
+        for (int filter = CW_FILTER_BOX; filter <= CW_FILTER_LANCZOS; filter++) {
+            CwImage *one = make_noise(517, 389, channels, 99);
+            CwImage *many = make_noise(517, 389, channels, 99);
+            CHECK(cw_scale(&one, 200, 301, (enum CwFilter)filter, 1) == CW_OK);
+            CHECK(cw_scale(&many, 200, 301, (enum CwFilter)filter, 6) == CW_OK);
+            CHECK(same_pixels(one, many));
+            cw_image_free(one);
+            cw_image_free(many);
+        }
+    }
+}
+
+static int decode_status(const unsigned char *data, size_t size) {
+    CwImage *image = NULL;
+    int status = cw_image_decode(data, size, 0, &image);
+    CHECK(status == CW_OK || image == NULL);
+    cw_image_free(image);
+    return status;
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void put_le16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+/* An uncompressed 24-bit 5x3 BMP; rows are padded to 16 bytes. */
+#define TEST_BMP_SIZE (54 + 16 * 3)
+
+static void make_bmp(unsigned char *bmp) {
+    memset(bmp, 0, TEST_BMP_SIZE);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    put_le32(bmp + 2, TEST_BMP_SIZE);
+    put_le32(bmp + 10, 54);
+    put_le32(bmp + 14, 40);
+    put_le32(bmp + 18, 5);
+    put_le32(bmp + 22, 3);
+    put_le16(bmp + 26, 1);
+    put_le16(bmp + 28, 24);
+    for (int i = 54; i < TEST_BMP_SIZE; i++) bmp[i] = (unsigned char)i;
+}
+
+static void test_malformed_bmp(void) {
+    unsigned char bmp[TEST_BMP_SIZE], bad[TEST_BMP_SIZE];
+    make_bmp(bmp);
+    CHECK(decode_status(bmp, sizeof(bmp)) == CW_OK);
+
+    int saved = quiet_stderr();
+    for (size_t size = 2; size < sizeof(bmp); size++) CHECK(decode_status(bmp, size) == CW_ERROR_BMP_FORMAT);
+    for (size_t size = 0; size < 2; size++) CHECK(decode_status(bmp, size) != CW_OK);
+
+    static const struct {
+        int offset, bytes;
+        uint32_t value;
+    } fields[] = {
+        {10, 4, TEST_BMP_SIZE},     /* pixels start at the end of the file */
+        {10, 4, 0xffffffffu},       /* ... or past it */
+        {14, 4, 12},                /* OS/2 core header */
+        {18, 4, 0},                 /* no width */
+        {18, 4, 0xfffffffbu},       /* negative width */
+        {18, 4, 0x7fffffffu},       /* rows far past the end of the data */
+        {22, 4, 0},                 /* no height */
+        {22, 4, 0x80000000u},       /* height that cannot be negated */
+        {22, 4, 4},                 /* one row more than the data holds */
+        {22, 4, 0xfffffffbu},       /* top-down, too many rows */
+        {26, 2, 0},                 /* planes */
+        {28, 2, 8},                 /* palette images are not supported */
+        {28, 2, 32},
+        {30, 4, 1},                 /* RLE8 */
+    };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        memcpy(bad, bmp, sizeof(bmp));
+        if (fields[f].bytes == 4) put_le32(bad + fields[f].offset, fields[f].value);
+        else put_le16(bad + fields[f].offset, (uint16_t)fields[f].value);
+        int status = decode_status(bad, sizeof(bad));
+        CHECK(status == CW_ERROR_BMP_FORMAT);
+        if (status != CW_ERROR_BMP_FORMAT) printf("  field at offset %d\n", fields[f].offset);
+    }
+    restore_stderr(saved);
+
+    /* A top-down BMP with exactly enough rows is fine. */
+    memcpy(bad, bmp, sizeof(bmp));
+    put_le32(bad + 22, 0xfffffffdu);
+    CHECK(decode_status(bad, sizeof(bad)) == CW_OK);
+}
+
+/* Rewrites the CRC of the chunk whose data starts at `data`. */
+static void fix_chunk_crc(unsigned char *data, uint32_t length) {
+    uint32_t crc = (uint32_t)crc32(0, data - 4, length + 4);
+    data[length] = (unsigned char)(crc >> 24);
+    data[length + 1] = (unsigned char)(crc >> 16);
+    data[length + 2] = (unsigned char)(crc >> 8);
+    data[length + 3] = (unsigned char)crc;
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void test_malformed_png(void) {
+    unsigned char rgb[7 * 5 * 3];
+    for (int i = 0; i < (int)sizeof(rgb); i++) rgb[i] = (unsigned char)(i * 13);
+    size_t size = 0;
+    unsigned char *png = encode_png(rgb, 7, 5, 3, &size);
+    CHECK(png != NULL);
+    if (!png) return;
+    CHECK(decode_status(png, size) == CW_OK);
+    unsigned char *bad = (unsigned char*)malloc(size);
+    /* IHDR data follows the 8-byte signature and the chunk length and type. */
+    unsigned char *ihdr = bad + 16;
+
+    int saved = quiet_stderr();
+    /* Every prefix short of the IEND chunk is truncated image data. */
+    for (size_t prefix = 0; prefix + 12 < size; prefix++) CHECK(decode_status(png, prefix) != CW_OK);
+    for (size_t prefix = 8; prefix + 12 < size; prefix++) CHECK(decode_status(png, prefix) == CW_ERROR_PNG_FORMAT);
+
+    memcpy(bad, png, size);
+    bad[1] = 'X';
+    CHECK(decode_status(bad, size) != CW_OK);
+
+    memcpy(bad, png, size);
+    ihdr[3] ^= 1;
+    CHECK(decode_status(bad, size) == CW_ERROR_PNG_FORMAT);
+
+    static const struct {
+        int offset, bytes;
+        uint32_t value;
+    } fields[] = {
+        {0, 4, 0},              /* no width */
+        {4, 4, 0},              /* no height */
+        {0, 4, 0x7fffffffu},    /* over libpng's limits */
+        {0, 4, 0x80000000u},
+        {8, 1, 3},              /* bit depth not valid for RGB */
+        {9, 1, 1},              /* colour type that does not exist */
+        {10, 1, 1},             /* compression method */
+        {12, 1, 2},             /* interlace method */
+        {0, 4, 70000},          /* larger than the image data */
+    };
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        memcpy(bad, png, size);
+        if (fields[f].bytes == 4) put_be32(ihdr + fields[f].offset, fields[f].value);
+        else ihdr[fields[f].offset] = (unsigned char)fields[f].value;
+        fix_chunk_crc(ihdr, 13);
+        int status = decode_status(bad, size);
+        CHECK(status == CW_ERROR_PNG_FORMAT);
+        if (status != CW_ERROR_PNG_FORMAT) printf("  IHDR field at offset %d\n", fields[f].offset);
+    }
+    restore_stderr(saved);
+    free(bad);
+    free(png);
+}
+
+static void test_arguments(void) {
+    CwImage *image = make_solid(4, 4, (CwRgb){0, 0, 0});
+    CwImage *result = NULL;
+    int saved = quiet_stderr();
+    CHECK(cw_image_decode(NULL, 0, 0, &result) == CW_ERROR_ARG && result == NULL);
+    CHECK(cw_image_load("/nonexistent/cw_test.png", 0, &result) == CW_ERROR_FILE && result == NULL);
+    CHECK(cw_draw_triangle(image, (CwPoint){0, 0}, (CwPoint){1, 1}, (CwPoint){2, 0}, -1,
+                           (CwRgba){0, 0, 0, 255}, false, (CwRgba){0, 0, 0, 255}, false, 1) == CW_ERROR_ARG);
+    CHECK(cw_draw_ellipse(image, (CwPoint){0, 0}, -1, 3, 1, (CwRgba){0, 0, 0, 255}, false,
+                          (CwRgba){0, 0, 0, 255}, false, 1) == CW_ERROR_ARG);
+    CHECK(cw_scale(&image, 0, 0, CW_FILTER_BOX, 1) == CW_ERROR_ARG);
+    CHECK(cw_scale(&image, 2, 2, (enum CwFilter)7, 1) == CW_ERROR_ARG);
+    CwRegionTable *table = NULL;
+    CwRgb colors[17] = {{0, 0, 0}};
+    CHECK(cw_region_table_build(image, colors, 17, 1, &table) == CW_ERROR_ARG && table == NULL);
+    restore_stderr(saved);
+    cw_image_free(image);
+}
+
+int main(void) {
+    test_codec_round_trip();
+    test_triangle();
+    test_triangle_threads();
+    test_biggest_rect();
+    test_flood_fill();
+    test_biggest_blob();
+    test_invert_gray();
+    test_region_stats();
+    test_collage_resize_scale();
+    test_malformed_bmp();
+    test_malformed_png();
+    test_arguments();
+    cw_thread_release();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}